@@ -0,0 +1,380 @@
+/*
+ * Bench.cpp - host benchmarks of the step engine, planner and DS18B20 driver.
+ *
+ *   pour_bot_bench [name filter]
+ *
+ * Runs the firmware sources against the simulated peripherals in host/sim
+ * and prints one line per figure:
+ *  - isr.*      host nanoseconds per step ISR for each kind of move, which
+ *               tracks the relative cost of the IRAM step path;
+ *  - planner.*  queueMove() throughput with look-ahead replanning;
+ *  - jitter.*   how far step edges land from their alarms, and how far the
+ *               intervals between edges stray from the programmed ones,
+ *               with a model of ISR latency including rare long bursts;
+ *  - ds18b20.*  1-Wire transaction cost and retries over a noisy bus;
+ *  - log.*      deferred log cost per record, queued and formatted.
+ *
+ * Simulated times are deterministic for a given build; host times vary
+ * with the machine, so compare them run to run on the same one.
+ */
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "deferred_log.h"
+#include "ds18b20.h"
+#include "stepper.h"
+#include "motion_coordinator.h"
+#include "step_timing_trace.h"
+#include "sim.h"
+
+static const char *filter = NULL;
+
+static bool selected(const char *name)
+{
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report(const char *name, double value, const char *unit)
+{
+	printf("%-36s %12.2f %s\n", name, value, unit);
+}
+
+static double hostSeconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double percentile(std::vector<int64_t> &values, double fraction)
+{
+	if (values.empty()) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	size_t index = (size_t) (fraction * (values.size() - 1) + 0.5);
+	return (double) values[index];
+}
+
+/*
+ * ISR cost of one Stepper move, in host ns per step.
+ */
+static void benchStepper(const char *name, Stepper::StepMode mode, long speed,
+		long acceleration, long jerk)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(1);
+	Stepper stepper(513, 16, 17, 18, 19);
+	if (mode >= Stepper::MICROSTEP_4) {
+		stepper.attachPwm(LEDC_TIMER_0, LEDC_CHANNEL_0);
+	}
+	stepper.setStepMode(mode);
+	stepper.setMaxSpeed(speed);
+	stepper.setAcceleration(acceleration);
+	stepper.setJerk(jerk);
+	stepper.moveAsync(200000);
+	stepper.waitForCompletion(portMAX_DELAY);
+
+	const SimStats &stats = sim_stats();
+	report(name, (double) stats.isr_host_ns / stats.isr_calls, "ns/step");
+}
+
+static void benchCoordinated(const char *name)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(1);
+	Stepper x(513, 16, 17, 18, 19);
+	Stepper y(513, 21, 22, 23, 25);
+	Stepper z(513, 26, 27, 32, 33);
+	MotionCoordinator motion;
+	motion.addAxis(&x);
+	motion.addAxis(&y);
+	motion.addAxis(&z);
+	motion.setMaxSpeed(4000);
+	motion.setAcceleration(40000);
+	int steps[3] = {200000, -123457, 54321};
+	motion.moveAsync(steps);
+	motion.waitForCompletion(portMAX_DELAY);
+
+	const SimStats &stats = sim_stats();
+	report(name, (double) stats.isr_host_ns / stats.isr_calls, "ns/step");
+}
+
+/*
+ * Keeps the motion queue full of short segments in changing directions, so
+ * every queueMove() replans the whole look-ahead window.  Only the time
+ * spent queueing counts.
+ */
+static void benchPlanner(const char *name, int segments)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(7);
+	Stepper x(513, 16, 17, 18, 19);
+	Stepper y(513, 21, 22, 23, 25);
+	MotionCoordinator motion;
+	motion.addAxis(&x);
+	motion.addAxis(&y);
+	motion.setMaxSpeed(4000);
+	motion.setAcceleration(40000);
+	motion.setJunctionJump(400);
+
+	double queueing = 0;
+	int queued = 0;
+	while (queued < segments) {
+		while (queued < segments && motion.queueSpace() > 0) {
+			int steps[2];
+			steps[0] = 20 + sim_random() % 60;
+			steps[1] = (int) (sim_random() % 81) - 40;
+			double started = hostSeconds();
+			bool accepted = motion.queueMove(steps, 0);
+			queueing += hostSeconds() - started;
+			if (!accepted) {
+				fprintf(stderr, "%s: segment refused\n", name);
+				return;
+			}
+			queued++;
+		}
+		while (motion.queueSpace() == 0 && sim_run_next()) {
+		}
+	}
+	motion.waitForCompletion(portMAX_DELAY);
+	report(name, queued / queueing, "segments/s");
+}
+
+struct JitterRecord {
+	bool have_previous;
+	int64_t previous_isr_us;
+	std::vector<int64_t> lateness;        // ISR entry minus alarm
+	std::vector<int64_t> interval_error;  // |edge interval - programmed interval|
+};
+
+static void recordEdge(const SimStepEdge &edge, void *arg)
+{
+	JitterRecord *record = (JitterRecord *) arg;
+	record->lateness.push_back(edge.isr_us - edge.alarm_us);
+	if (record->have_previous) {
+		int64_t error = (edge.isr_us - record->previous_isr_us) - (int64_t) edge.interval_us;
+		record->interval_error.push_back(error < 0 ? -error : error);
+	}
+	record->have_previous = true;
+	record->previous_isr_us = edge.isr_us;
+}
+
+static void reportJitter(const char *name, JitterRecord &record)
+{
+	char label[64];
+	snprintf(label, sizeof(label), "%s.edge_p99", name);
+	report(label, percentile(record.lateness, 0.99), "us");
+	snprintf(label, sizeof(label), "%s.edge_max", name);
+	report(label, percentile(record.lateness, 1.0), "us");
+	snprintf(label, sizeof(label), "%s.interval_p99", name);
+	report(label, percentile(record.interval_error, 0.99), "us");
+	snprintf(label, sizeof(label), "%s.interval_max", name);
+	report(label, percentile(record.interval_error, 1.0), "us");
+	snprintf(label, sizeof(label), "%s.missed", name);
+	report(label, (double) sim_stats().late_isrs, "deadlines");
+}
+
+/*
+ * A fast ramped move with 1..3 us of ordinary latency and a 40 us stall
+ * every 2000 interrupts or so.  The firmware's own StepTimingTrace runs
+ * alongside, and should agree with what the simulation saw.
+ */
+static void benchJitterStepper(const char *name)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(3);
+	JitterRecord record;
+	record.have_previous = false;
+	sim_set_isr_latency(1, 2, 2000, 40);
+	sim_set_edge_hook(recordEdge, &record);
+
+	StepTimingTrace trace;
+	Stepper stepper(513, 16, 17, 18, 19);
+	stepper.setTimingTrace(&trace);
+	stepper.setMaxSpeed(10000);
+	stepper.setAcceleration(200000);
+	for (int i = 0; i < 20; i++) {
+		stepper.moveAsync(i % 2 ? -5000 : 5000);
+		stepper.waitForCompletion(portMAX_DELAY);
+		record.have_previous = false;
+	}
+	reportJitter(name, record);
+
+	char label[64];
+	snprintf(label, sizeof(label), "%s.trace_p99", name);
+	report(label, trace.jitterPercentile(990), "us");
+	snprintf(label, sizeof(label), "%s.trace_missed", name);
+	report(label, trace.missedDeadlines(), "deadlines");
+}
+
+static void benchJitterQueue(const char *name)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(5);
+	JitterRecord record;
+	record.have_previous = false;
+	sim_set_isr_latency(1, 2, 2000, 40);
+	sim_set_edge_hook(recordEdge, &record);
+
+	Stepper x(513, 16, 17, 18, 19);
+	Stepper y(513, 21, 22, 23, 25);
+	MotionCoordinator motion;
+	motion.addAxis(&x);
+	motion.addAxis(&y);
+	motion.setMaxSpeed(8000);
+	motion.setAcceleration(150000);
+	motion.setJunctionJump(800);
+	for (int i = 0; i < 2000; i++) {
+		int steps[2] = {100 + (int) (sim_random() % 200), (int) (sim_random() % 201) - 100};
+		while (motion.queueSpace() == 0) {
+			sim_run_next();
+		}
+		motion.queueMove(steps, 0);
+	}
+	motion.waitForCompletion(portMAX_DELAY);
+	reportJitter(name, record);
+}
+
+/*
+ * Three sensors on the UART transport, one bit in 5000 read back wrong:
+ * per conversion cycle (one broadcast conversion and three addressed
+ * reads) the host cost, the bus time and how reads fared.
+ */
+static void benchDs18b20(const char *name, int cycles)
+{
+	if (!selected(name)) {
+		return;
+	}
+	sim_reset(11);
+	sim_onewire_add(NULL, 92.5f);
+	sim_onewire_add(NULL, 21.0f);
+	sim_onewire_add(NULL, -4.25f);
+	ds18b20_init_uart(4, UART_NUM_1);
+
+	ds18b20_addr_t found[4];
+	int count = ds18b20_search(found, 4);
+	char label[64];
+	snprintf(label, sizeof(label), "%s.found", name);
+	report(label, count, "sensors");
+	if (count == 0) {
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		ds18b20_set_device_resolution(&found[i], 10);
+	}
+
+	sim_onewire_set_error_rate(5000);
+	int failures = 0;
+	double host = 0;
+	int64_t bus_us = 0;
+	uint32_t slots = sim_onewire_slots();
+	for (int c = 0; c < cycles; c++) {
+		double started = hostSeconds();
+		int64_t bus_started = sim_now_us();
+		ds18b20_start_conversion();
+		host += hostSeconds() - started;
+		bus_us += sim_now_us() - bus_started;
+		while (!ds18b20_poll_ready()) {
+			vTaskDelay(10 / portTICK_PERIOD_MS);
+		}
+		for (int i = 0; i < count; i++) {
+			float temperature;
+			started = hostSeconds();
+			bus_started = sim_now_us();
+			if (ds18b20_read_device(&found[i], &temperature) != ESP_OK) {
+				failures++;
+			}
+			host += hostSeconds() - started;
+			bus_us += sim_now_us() - bus_started;
+		}
+	}
+	slots = sim_onewire_slots() - slots;
+
+	snprintf(label, sizeof(label), "%s.host", name);
+	report(label, host * 1e6 / cycles, "us/cycle");
+	snprintf(label, sizeof(label), "%s.bus", name);
+	report(label, (double) bus_us / cycles, "us/cycle");
+	snprintf(label, sizeof(label), "%s.slots", name);
+	report(label, (double) slots / cycles, "slots/cycle");
+	snprintf(label, sizeof(label), "%s.failed", name);
+	report(label, 100.0 * failures / (cycles * count), "% of reads");
+}
+
+/*
+ * Host ns per deferred log record: writing it, as the step path would,
+ * and formatting it in the log task (output discarded).
+ */
+static void benchDeferredLog(const char *name, int rounds)
+{
+	if (!selected(name)) {
+		return;
+	}
+	esp_log_level_set("*", ESP_LOG_NONE);
+	dlog_set_level(ESP_LOG_VERBOSE);
+	dlog_flush(DLOG_RING_LENGTH);
+	uint32_t dropped = dlog_dropped();
+
+	double write = 0;
+	double flush = 0;
+	int records = 0;
+	for (int r = 0; r < rounds; r++) {
+		double started = hostSeconds();
+		for (int i = 0; i < DLOG_RING_LENGTH; i++) {
+			DLOGD("bench", "step %d of %d at %u us", i, DLOG_RING_LENGTH, r);
+		}
+		write += hostSeconds() - started;
+		started = hostSeconds();
+		records += dlog_flush(DLOG_RING_LENGTH);
+		flush += hostSeconds() - started;
+	}
+	dlog_set_level((esp_log_level_t) CONFIG_LOG_DEFAULT_LEVEL);
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	char label[64];
+	snprintf(label, sizeof(label), "%s.write", name);
+	report(label, write * 1e9 / records, "ns/record");
+	snprintf(label, sizeof(label), "%s.flush", name);
+	report(label, flush * 1e9 / records, "ns/record");
+	snprintf(label, sizeof(label), "%s.dropped", name);
+	report(label, dlog_dropped() - dropped, "records");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) {
+		filter = argv[1];
+	}
+	esp_log_level_set("*", ESP_LOG_WARN);
+
+	benchStepper("isr.full_step.constant", Stepper::FULL_STEP, 5000, 0, 0);
+	benchStepper("isr.full_step.trapezoid", Stepper::FULL_STEP, 5000, 50000, 0);
+	benchStepper("isr.full_step.s_curve", Stepper::FULL_STEP, 5000, 60000, 6000000);
+	benchStepper("isr.half_step.trapezoid", Stepper::HALF_STEP, 5000, 50000, 0);
+	benchStepper("isr.microstep_8.trapezoid", Stepper::MICROSTEP_8, 5000, 50000, 0);
+	benchCoordinated("isr.coordinated_3_axis");
+	benchPlanner("planner.queue_move", 200000);
+	benchJitterStepper("jitter.stepper");
+	benchJitterQueue("jitter.queue");
+	benchDs18b20("ds18b20.uart_3_sensors", 200);
+	benchDeferredLog("log.deferred", 2000);
+	return 0;
+}
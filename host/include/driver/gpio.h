@@ -0,0 +1,71 @@
+/*
+ * driver/gpio.h - host build stand-in.  Outputs land in the simulated GPIO
+ * registers; inputs and their interrupts are driven with sim_gpio_input().
+ */
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "soc/gpio_struct.h"
+
+typedef enum {
+  GPIO_NUM_0 = 0, GPIO_NUM_1, GPIO_NUM_2, GPIO_NUM_3, GPIO_NUM_4, GPIO_NUM_5,
+  GPIO_NUM_6, GPIO_NUM_7, GPIO_NUM_8, GPIO_NUM_9, GPIO_NUM_10, GPIO_NUM_11,
+  GPIO_NUM_12, GPIO_NUM_13, GPIO_NUM_14, GPIO_NUM_15, GPIO_NUM_16, GPIO_NUM_17,
+  GPIO_NUM_18, GPIO_NUM_19, GPIO_NUM_21 = 21, GPIO_NUM_22, GPIO_NUM_23,
+  GPIO_NUM_25 = 25, GPIO_NUM_26, GPIO_NUM_27, GPIO_NUM_32 = 32, GPIO_NUM_33,
+  GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_36, GPIO_NUM_37, GPIO_NUM_38, GPIO_NUM_39,
+  GPIO_NUM_MAX = 40
+} gpio_num_t;
+
+typedef enum {
+  GPIO_INTR_DISABLE,
+  GPIO_INTR_POSEDGE,
+  GPIO_INTR_NEGEDGE,
+  GPIO_INTR_ANYEDGE,
+  GPIO_INTR_LOW_LEVEL,
+  GPIO_INTR_HIGH_LEVEL
+} gpio_int_type_t;
+
+typedef enum {
+  GPIO_MODE_DISABLE = 0,
+  GPIO_MODE_INPUT = 1,
+  GPIO_MODE_OUTPUT = 2,
+  GPIO_MODE_INPUT_OUTPUT = 3,
+  GPIO_MODE_OUTPUT_OD = 6,
+  GPIO_MODE_INPUT_OUTPUT_OD = 7
+} gpio_mode_t;
+
+typedef enum { GPIO_PULLUP_DISABLE, GPIO_PULLUP_ENABLE } gpio_pullup_t;
+typedef enum { GPIO_PULLDOWN_DISABLE, GPIO_PULLDOWN_ENABLE } gpio_pulldown_t;
+
+typedef struct {
+  uint64_t pin_bit_mask;
+  gpio_mode_t mode;
+  gpio_pullup_t pull_up_en;
+  gpio_pulldown_t pull_down_en;
+  gpio_int_type_t intr_type;
+} gpio_config_t;
+
+typedef void (*gpio_isr_t)(void *arg);
+
+#define GPIO_IS_VALID_GPIO(n)        ((n) >= 0 && (n) < GPIO_NUM_MAX)
+#define GPIO_IS_VALID_OUTPUT_GPIO(n) ((n) >= 0 && (n) < 34)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+esp_err_t gpio_config(const gpio_config_t *config);
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level);
+int gpio_get_level(gpio_num_t pin);
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode);
+void gpio_pad_select_gpio(uint8_t pin);
+esp_err_t gpio_install_isr_service(int intr_alloc_flags);
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg);
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin);
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t type);
+esp_err_t gpio_intr_enable(gpio_num_t pin);
+esp_err_t gpio_intr_disable(gpio_num_t pin);
+#ifdef __cplusplus
+}
+#endif
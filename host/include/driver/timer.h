@@ -0,0 +1,47 @@
+/*
+ * driver/timer.h - host build stand-in.  The four general purpose timers
+ * count in simulated time and call their ISR when the alarm is reached.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_intr_alloc.h"
+#include "soc/timer_group_struct.h"
+
+#define TIMER_BASE_CLK 80000000
+
+typedef enum { TIMER_GROUP_0, TIMER_GROUP_1, TIMER_GROUP_MAX } timer_group_t;
+typedef enum { TIMER_0, TIMER_1, TIMER_MAX } timer_idx_t;
+typedef enum { TIMER_COUNT_DOWN, TIMER_COUNT_UP } timer_count_dir_t;
+typedef enum { TIMER_PAUSE, TIMER_START } timer_start_t;
+typedef enum { TIMER_ALARM_DIS, TIMER_ALARM_EN } timer_alarm_t;
+typedef enum { TIMER_INTR_LEVEL } timer_intr_mode_t;
+typedef enum { TIMER_AUTORELOAD_DIS, TIMER_AUTORELOAD_EN } timer_autoreload_t;
+
+typedef struct {
+  bool alarm_en;
+  bool counter_en;
+  timer_intr_mode_t intr_type;
+  timer_count_dir_t counter_dir;
+  bool auto_reload;
+  uint32_t divider;
+} timer_config_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+esp_err_t timer_init(timer_group_t group, timer_idx_t index, const timer_config_t *config);
+esp_err_t timer_set_counter_value(timer_group_t group, timer_idx_t index, uint64_t value);
+esp_err_t timer_set_alarm_value(timer_group_t group, timer_idx_t index, uint64_t value);
+esp_err_t timer_set_alarm(timer_group_t group, timer_idx_t index, timer_alarm_t enable);
+esp_err_t timer_enable_intr(timer_group_t group, timer_idx_t index);
+esp_err_t timer_disable_intr(timer_group_t group, timer_idx_t index);
+esp_err_t timer_isr_register(timer_group_t group, timer_idx_t index, void (*isr)(void *),
+    void *arg, int intr_alloc_flags, intr_handle_t *handle);
+esp_err_t timer_start(timer_group_t group, timer_idx_t index);
+esp_err_t timer_pause(timer_group_t group, timer_idx_t index);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,44 @@
+/*
+ * driver/uart.h - host build stand-in.  Every UART is wired to the
+ * simulated 1-Wire bus, the way ds18b20_init_uart() uses one.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+typedef enum { UART_NUM_0, UART_NUM_1, UART_NUM_2, UART_NUM_MAX } uart_port_t;
+typedef enum { UART_DATA_5_BITS, UART_DATA_6_BITS, UART_DATA_7_BITS, UART_DATA_8_BITS } uart_word_length_t;
+typedef enum { UART_STOP_BITS_1 = 1, UART_STOP_BITS_1_5, UART_STOP_BITS_2 } uart_stop_bits_t;
+typedef enum { UART_PARITY_DISABLE = 0, UART_PARITY_EVEN = 2, UART_PARITY_ODD = 3 } uart_parity_t;
+typedef enum { UART_HW_FLOWCTRL_DISABLE = 0 } uart_hw_flowcontrol_t;
+
+typedef struct {
+  int baud_rate;
+  uart_word_length_t data_bits;
+  uart_parity_t parity;
+  uart_stop_bits_t stop_bits;
+  uart_hw_flowcontrol_t flow_ctrl;
+  uint8_t rx_flow_ctrl_thresh;
+} uart_config_t;
+
+#define UART_PIN_NO_CHANGE (-1)
+#define UART_FIFO_LEN 128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config);
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts);
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size,
+    int queue_size, QueueHandle_t *queue, int intr_alloc_flags);
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud_rate);
+int uart_write_bytes(uart_port_t port, const char *data, size_t size);
+int uart_read_bytes(uart_port_t port, uint8_t *buffer, uint32_t length, TickType_t timeout);
+esp_err_t uart_flush_input(uart_port_t port);
+#ifdef __cplusplus
+}
+#endif
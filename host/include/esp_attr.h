@@ -0,0 +1,8 @@
+/*
+ * esp_attr.h - host build stand-in; there is no IRAM or DRAM on the host.
+ */
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
@@ -0,0 +1,20 @@
+/*
+ * esp_intr_alloc.h - host build stand-in; the flags are accepted and ignored.
+ */
+#pragma once
+
+#include "esp_err.h"
+
+typedef void *intr_handle_t;
+
+#define ESP_INTR_FLAG_LEVEL1 (1<<1)
+#define ESP_INTR_FLAG_LEVEL3 (1<<3)
+#define ESP_INTR_FLAG_IRAM   (1<<10)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+esp_err_t esp_intr_free(intr_handle_t handle);
+#ifdef __cplusplus
+}
+#endif
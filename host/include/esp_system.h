@@ -0,0 +1,6 @@
+/*
+ * esp_system.h - host build stand-in.
+ */
+#pragma once
+
+#include "esp_err.h"
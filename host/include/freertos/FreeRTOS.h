@@ -0,0 +1,51 @@
+/*
+ * freertos/FreeRTOS.h - host build stand-in.  The simulation runs a single
+ * task, and interrupts only ever run while that task is blocked or busy
+ * waiting, so critical sections have nothing to exclude.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+typedef uint32_t TickType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define pdFAIL  0
+
+#define portMAX_DELAY      ((TickType_t) 0xffffffffu)
+#define portTICK_PERIOD_MS (1000 / CONFIG_FREERTOS_HZ)
+#define portTICK_RATE_MS   portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)  ((TickType_t) ((ms) / portTICK_PERIOD_MS))
+#define portNUM_PROCESSORS 2
+#define configMAX_PRIORITIES 25
+#define tskNO_AFFINITY     0x7fffffff
+#define PRO_CPU_NUM 0
+#define APP_CPU_NUM 1
+
+typedef struct {
+  volatile uint32_t owner;
+  uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+#define portENTER_CRITICAL(mux)     ((void) (mux))
+#define portEXIT_CRITICAL(mux)      ((void) (mux))
+#define portENTER_CRITICAL_ISR(mux) ((void) (mux))
+#define portEXIT_CRITICAL_ISR(mux)  ((void) (mux))
+#define portYIELD_FROM_ISR()        do {} while (0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+BaseType_t xPortGetCoreID(void);
+void vPortCPUInitializeMutex(portMUX_TYPE *mux);
+#ifdef __cplusplus
+}
+#endif
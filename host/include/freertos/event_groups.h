@@ -0,0 +1,22 @@
+/*
+ * freertos/event_groups.h - host build stand-in.
+ */
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits);
+BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t group, EventBits_t bits,
+    BaseType_t *higher_priority_woken);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,8 @@
+/*
+ * freertos/queue.h - host build stand-in, only the handle type.
+ */
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void *QueueHandle_t;
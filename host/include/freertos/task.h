@@ -0,0 +1,31 @@
+/*
+ * freertos/task.h - host build stand-in.  Blocking calls run the simulated
+ * clock, and the interrupts due meanwhile, forward.
+ */
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef uint8_t StackType_t;
+typedef struct { void *pad; } StaticTask_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t period);
+TickType_t xTaskGetTickCount(void);
+TickType_t xTaskGetTickCountFromISR(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_woken);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t timeout);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+    void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+    void *arg, UBaseType_t priority, StackType_t *stack, StaticTask_t *tcb, BaseType_t core);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,15 @@
+/*
+ * rom/ets_sys.h - host build stand-in; busy waits advance the simulated clock.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void ets_delay_us(uint32_t us);
+int ets_printf(const char *format, ...);
+#ifdef __cplusplus
+}
+#endif
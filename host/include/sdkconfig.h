@@ -0,0 +1,17 @@
+/*
+ * sdkconfig.h - host build stand-in for the generated IDF configuration,
+ * with the values of the firmware's sdkconfig that the sources use.
+ */
+#pragma once
+
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ 240
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+
+#define CONFIG_POUR_BOT_MOTION_QUEUE_LENGTH 16
+#define CONFIG_POUR_BOT_RECIPE_MAX_EVENTS 256
+#define CONFIG_POUR_BOT_LOG_RECORDS 128
+#define CONFIG_POUR_BOT_HEATER_SAMPLES 32
+#define CONFIG_POUR_BOT_STEP_TRACE_SAMPLES 64
+#define CONFIG_POUR_BOT_CONTROL_CLIENTS 4
+#define CONFIG_SUPPORT_STATIC_ALLOCATION 1
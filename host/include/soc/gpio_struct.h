@@ -0,0 +1,50 @@
+/*
+ * soc/gpio_struct.h - host build stand-in for the GPIO registers, in the
+ * IDF layout up to the pin configuration words.  The simulation applies the
+ * write-1-to-set/clear registers to out and out1 after every interrupt.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef union {
+  struct {
+    uint32_t data:8;
+    uint32_t reserved8:24;
+  };
+  uint32_t val;
+} gpio_reg_high_t;
+
+typedef volatile struct gpio_dev_s {
+  uint32_t bt_select;
+  uint32_t out;
+  uint32_t out_w1ts;
+  uint32_t out_w1tc;
+  gpio_reg_high_t out1;
+  gpio_reg_high_t out1_w1ts;
+  gpio_reg_high_t out1_w1tc;
+  uint32_t sdio_select;
+  uint32_t enable;
+  uint32_t enable_w1ts;
+  uint32_t enable_w1tc;
+  gpio_reg_high_t enable1;
+  gpio_reg_high_t enable1_w1ts;
+  gpio_reg_high_t enable1_w1tc;
+  uint32_t strap;
+  uint32_t in;
+  gpio_reg_high_t in1;
+  uint32_t status;
+  uint32_t status_w1ts;
+  uint32_t status_w1tc;
+  gpio_reg_high_t status1;
+  gpio_reg_high_t status1_w1ts;
+  gpio_reg_high_t status1_w1tc;
+} gpio_dev_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern gpio_dev_t GPIO;
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ * soc/ledc_struct.h - host build stand-in for the LEDC channel registers.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef volatile struct ledc_dev_s {
+  struct {
+    struct {
+      union {
+        struct {
+          uint32_t timer_sel:2;
+          uint32_t sig_out_en:1;
+          uint32_t idle_lv:1;
+          uint32_t low_speed_update:1;
+          uint32_t reserved5:26;
+          uint32_t clk_en:1;
+        };
+        uint32_t val;
+      } conf0;
+      union {
+        struct {
+          uint32_t hpoint:20;
+          uint32_t reserved20:12;
+        };
+        uint32_t val;
+      } hpoint;
+      union {
+        struct {
+          uint32_t duty:25;
+          uint32_t reserved25:7;
+        };
+        uint32_t val;
+      } duty;
+      union {
+        struct {
+          uint32_t duty_scale:10;
+          uint32_t duty_cycle:10;
+          uint32_t duty_num:10;
+          uint32_t duty_inc:1;
+          uint32_t duty_start:1;
+        };
+        uint32_t val;
+      } conf1;
+      union {
+        struct {
+          uint32_t duty_read:25;
+          uint32_t reserved25:7;
+        };
+        uint32_t val;
+      } duty_rd;
+    } channel[8];
+  } channel_group[2];
+} ledc_dev_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern ledc_dev_t LEDC;
+#ifdef __cplusplus
+}
+#endif
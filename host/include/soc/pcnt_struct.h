@@ -0,0 +1,43 @@
+/*
+ * soc/pcnt_struct.h - host build stand-in for the pulse counter registers
+ * that the firmware reads directly.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef volatile struct pcnt_dev_s {
+  union {
+    struct {
+      uint32_t cnt_val:16;
+      uint32_t reserved16:16;
+    };
+    uint32_t val;
+  } cnt_unit[8];
+  union {
+    uint32_t val;
+  } int_raw;
+  union {
+    uint32_t val;
+  } int_st;
+  union {
+    uint32_t val;
+  } int_ena;
+  union {
+    uint32_t val;
+  } int_clr;
+  union {
+    struct {
+      uint32_t cnt_mode:2;
+      uint32_t thres1_lat:1;
+      uint32_t thres0_lat:1;
+      uint32_t l_lim_lat:1;
+      uint32_t h_lim_lat:1;
+      uint32_t zero_lat:1;
+      uint32_t reserved7:25;
+    };
+    uint32_t val;
+  } status_unit[8];
+} pcnt_dev_t;
+
+extern pcnt_dev_t PCNT;
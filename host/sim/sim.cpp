@@ -0,0 +1,609 @@
+/*
+ * Sim.cpp - simulated clock, general purpose timers and FreeRTOS calls.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "driver/timer.h"
+#include "soc/gpio_struct.h"
+#include "soc/ledc_struct.h"
+#include "soc/timer_group_struct.h"
+#include "esp_intr_alloc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "rom/ets_sys.h"
+#include "sim.h"
+
+#define SIM_TIMERS (TIMER_GROUP_MAX * TIMER_MAX)
+#define SIM_EVENT_GROUPS 8
+#define SIM_ESP_TIMERS 8
+#define SIM_US_PER_TICK (1000L * portTICK_PERIOD_MS)
+
+timg_dev_t TIMERG0;
+timg_dev_t TIMERG1;
+
+struct SimTimer {
+	void (*isr)(void *arg);
+	void *arg;
+	uint64_t counter;         // counter value when last started
+	uint64_t alarm;           // alarm value set through the driver
+	int64_t due_us;           // next alarm while counting with the alarm enabled
+	uint32_t interval_us;     // interval that led up to due_us
+};
+
+struct esp_timer {
+	esp_timer_cb_t callback;
+	void *arg;
+	bool used;
+	bool armed;
+	int64_t due_us;
+	uint64_t period_us;       // 0 for one-shot
+};
+
+static int64_t now_us;
+static SimTimer timers[SIM_TIMERS];
+static esp_timer esp_timers[SIM_ESP_TIMERS];
+static uint32_t random_state;
+
+static uint32_t latency_base_us;
+static uint32_t latency_spread_us;
+static uint32_t latency_burst_every;
+static uint32_t latency_burst_us;
+
+static sim_edge_hook_t edge_hook;
+static void *edge_hook_arg;
+static SimStats stats;
+
+static uint32_t notify_count;
+static EventBits_t event_groups[SIM_EVENT_GROUPS];
+static int event_group_count;
+static esp_log_level_t log_level = (esp_log_level_t) CONFIG_LOG_DEFAULT_LEVEL;
+
+static timg_dev_t *timerDevice(int timer)
+{
+	return (timer / TIMER_MAX == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+}
+
+static bool timerArmed(int timer)
+{
+	timg_dev_t *dev = timerDevice(timer);
+	int index = timer % TIMER_MAX;
+	return timers[timer].isr != NULL && dev->hw_timer[index].config.enable
+			&& dev->hw_timer[index].config.alarm_en;
+}
+
+static int nextTimer(void)
+{
+	int next = -1;
+	for (int t = 0; t < SIM_TIMERS; t++) {
+		if (timerArmed(t) && (next < 0 || timers[t].due_us < timers[next].due_us)) {
+			next = t;
+		}
+	}
+	return next;
+}
+
+static uint32_t nextLatency(void)
+{
+	uint32_t latency = latency_base_us;
+	if (latency_spread_us > 0) {
+		latency += sim_random() % (latency_spread_us + 1);
+	}
+	if (latency_burst_every > 0 && sim_random() % latency_burst_every == 0) {
+		latency += latency_burst_us;
+	}
+	return latency;
+}
+
+static uint64_t hostNanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Enters the ISR of one timer whose alarm is due and takes over what it
+ * programmed, the way the hardware reloads at the alarm.
+ */
+static void runTimer(int timer)
+{
+	SimTimer *sim = &timers[timer];
+	timg_dev_t *dev = timerDevice(timer);
+	int index = timer % TIMER_MAX;
+
+	int64_t entry = sim->due_us + nextLatency();
+	if (entry > now_us) {
+		now_us = entry;
+	}
+	entry = now_us;
+
+	// the alarm disables itself; the ISR re-enables it to continue
+	dev->hw_timer[index].config.alarm_en = 0;
+	GPIO.out_w1ts = 0;
+	GPIO.out_w1tc = 0;
+	GPIO.out1_w1ts.val = 0;
+	GPIO.out1_w1tc.val = 0;
+	bool duty_updated = false;
+	for (int c = 0; c < 8; c++) {
+		LEDC.channel_group[0].channel[c].conf1.duty_start = 0;
+	}
+
+	uint64_t started = hostNanoseconds();
+	sim->isr(sim->arg);
+	stats.isr_host_ns += hostNanoseconds() - started;
+	stats.isr_calls++;
+
+	for (int c = 0; c < 8; c++) {
+		duty_updated = duty_updated || LEDC.channel_group[0].channel[c].conf1.duty_start;
+	}
+	bool edge = GPIO.out_w1ts || GPIO.out_w1tc || GPIO.out1_w1ts.val
+			|| GPIO.out1_w1tc.val || duty_updated;
+	GPIO.out = (GPIO.out | GPIO.out_w1ts) & ~GPIO.out_w1tc;
+	GPIO.out1.val = (GPIO.out1.val | GPIO.out1_w1ts.val) & ~GPIO.out1_w1tc.val;
+
+	SimStepEdge record;
+	record.timer = timer;
+	record.alarm_us = sim->due_us;
+	record.isr_us = entry;
+	record.interval_us = sim->interval_us;
+	record.late = false;
+
+	if (dev->hw_timer[index].config.enable && dev->hw_timer[index].config.alarm_en) {
+		uint32_t interval = dev->hw_timer[index].alarm_low;
+		sim->due_us += interval;
+		sim->interval_us = interval;
+		if (sim->due_us < now_us) {
+			// already passed: the alarm fires as soon as it is enabled
+			record.late = true;
+			stats.late_isrs++;
+			sim->due_us = now_us;
+		}
+	}
+	if (edge) {
+		stats.edges++;
+		if (edge_hook != NULL) {
+			edge_hook(record, edge_hook_arg);
+		}
+	}
+}
+
+void sim_reset(uint32_t seed)
+{
+	now_us = 0;
+	random_state = seed != 0 ? seed : 1;
+	for (int t = 0; t < SIM_TIMERS; t++) {
+		timerDevice(t)->hw_timer[t % TIMER_MAX].config.val = 0;
+		timers[t].due_us = 0;
+	}
+	latency_base_us = 0;
+	latency_spread_us = 0;
+	latency_burst_every = 0;
+	latency_burst_us = 0;
+	edge_hook = NULL;
+	edge_hook_arg = NULL;
+	memset(&stats, 0, sizeof(stats));
+	memset(esp_timers, 0, sizeof(esp_timers));
+	notify_count = 0;
+	sim_gpio_reset();
+	sim_onewire_reset();
+	sim_pcnt_reset();
+}
+
+int64_t sim_now_us(void)
+{
+	return now_us;
+}
+
+bool sim_run_next(void)
+{
+	int timer = nextTimer();
+	if (timer < 0) {
+		return false;
+	}
+	runTimer(timer);
+	return true;
+}
+
+static esp_timer *nextEspTimer(void)
+{
+	esp_timer *next = NULL;
+	for (int t = 0; t < SIM_ESP_TIMERS; t++) {
+		if (esp_timers[t].armed && (next == NULL || esp_timers[t].due_us < next->due_us)) {
+			next = &esp_timers[t];
+		}
+	}
+	return next;
+}
+
+/*
+ * Runs an esp_timer callback at its due time; there is no dispatch task,
+ * so it sees no latency.
+ */
+static void runEspTimer(esp_timer *timer)
+{
+	if (timer->due_us > now_us) {
+		now_us = timer->due_us;
+	}
+	if (timer->period_us > 0) {
+		timer->due_us += timer->period_us;
+	} else {
+		timer->armed = false;
+	}
+	timer->callback(timer->arg);
+}
+
+void sim_run_until(int64_t time_us)
+{
+	while (1) {
+		int timer = nextTimer();
+		esp_timer *callback = nextEspTimer();
+		bool alarm_due = timer >= 0 && timers[timer].due_us <= time_us;
+		bool callback_due = callback != NULL && callback->due_us <= time_us;
+		if (callback_due && (!alarm_due || callback->due_us < timers[timer].due_us)) {
+			runEspTimer(callback);
+		} else if (alarm_due) {
+			runTimer(timer);
+		} else {
+			break;
+		}
+	}
+	if (time_us > now_us) {
+		now_us = time_us;
+	}
+}
+
+bool sim_run_until_idle(int64_t limit_us)
+{
+	int timer;
+	while ((timer = nextTimer()) >= 0) {
+		if (timers[timer].due_us > limit_us) {
+			sim_run_until(limit_us);
+			return false;
+		}
+		runTimer(timer);
+	}
+	return true;
+}
+
+void sim_set_isr_latency(uint32_t base_us, uint32_t spread_us,
+		uint32_t burst_every, uint32_t burst_us)
+{
+	latency_base_us = base_us;
+	latency_spread_us = spread_us;
+	latency_burst_every = burst_every;
+	latency_burst_us = burst_us;
+}
+
+void sim_set_edge_hook(sim_edge_hook_t hook, void *arg)
+{
+	edge_hook = hook;
+	edge_hook_arg = arg;
+}
+
+const SimStats &sim_stats(void)
+{
+	return stats;
+}
+
+// xorshift32, so runs repeat exactly for a given seed
+uint32_t sim_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+/*
+ * General purpose timer driver.  The configuration lives in the register
+ * stand-ins so the ISR and the driver see the same state.
+ */
+extern "C" {
+
+esp_err_t timer_init(timer_group_t group, timer_idx_t index, const timer_config_t *config)
+{
+	timg_dev_t *dev = (group == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+	dev->hw_timer[index].config.val = 0;
+	dev->hw_timer[index].config.alarm_en = config->alarm_en;
+	dev->hw_timer[index].config.autoreload = config->auto_reload;
+	dev->hw_timer[index].config.increase = config->counter_dir;
+	dev->hw_timer[index].config.divider = config->divider;
+	dev->hw_timer[index].config.enable = config->counter_en;
+	return ESP_OK;
+}
+
+esp_err_t timer_set_counter_value(timer_group_t group, timer_idx_t index, uint64_t value)
+{
+	timers[group * TIMER_MAX + index].counter = value;
+	return ESP_OK;
+}
+
+esp_err_t timer_set_alarm_value(timer_group_t group, timer_idx_t index, uint64_t value)
+{
+	timers[group * TIMER_MAX + index].alarm = value;
+	return ESP_OK;
+}
+
+esp_err_t timer_set_alarm(timer_group_t group, timer_idx_t index, timer_alarm_t enable)
+{
+	timg_dev_t *dev = (group == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+	dev->hw_timer[index].config.alarm_en = enable;
+	return ESP_OK;
+}
+
+esp_err_t timer_enable_intr(timer_group_t group, timer_idx_t index)
+{
+	return ESP_OK;
+}
+
+esp_err_t timer_disable_intr(timer_group_t group, timer_idx_t index)
+{
+	return ESP_OK;
+}
+
+esp_err_t timer_isr_register(timer_group_t group, timer_idx_t index, void (*isr)(void *),
+		void *arg, int intr_alloc_flags, intr_handle_t *handle)
+{
+	SimTimer *sim = &timers[group * TIMER_MAX + index];
+	sim->isr = isr;
+	sim->arg = arg;
+	if (handle != NULL) {
+		*handle = sim;
+	}
+	return ESP_OK;
+}
+
+esp_err_t esp_intr_free(intr_handle_t handle)
+{
+	SimTimer *sim = (SimTimer *) handle;
+	if (sim == NULL) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	sim->isr = NULL;
+	sim->arg = NULL;
+	return ESP_OK;
+}
+
+esp_err_t timer_start(timer_group_t group, timer_idx_t index)
+{
+	SimTimer *sim = &timers[group * TIMER_MAX + index];
+	timg_dev_t *dev = (group == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+	uint64_t remaining = sim->alarm > sim->counter ? sim->alarm - sim->counter : 0;
+	sim->due_us = now_us + (int64_t) remaining;
+	sim->interval_us = (uint32_t) remaining;
+	dev->hw_timer[index].config.enable = 1;
+	return ESP_OK;
+}
+
+esp_err_t timer_pause(timer_group_t group, timer_idx_t index)
+{
+	SimTimer *sim = &timers[group * TIMER_MAX + index];
+	timg_dev_t *dev = (group == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+	if (dev->hw_timer[index].config.enable && sim->due_us > now_us) {
+		sim->counter = sim->alarm - (uint64_t) (sim->due_us - now_us);
+	}
+	dev->hw_timer[index].config.enable = 0;
+	return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+	return now_us;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+	for (int t = 0; t < SIM_ESP_TIMERS; t++) {
+		if (!esp_timers[t].used) {
+			memset(&esp_timers[t], 0, sizeof(esp_timers[t]));
+			esp_timers[t].used = true;
+			esp_timers[t].callback = args->callback;
+			esp_timers[t].arg = args->arg;
+			*out_handle = &esp_timers[t];
+			return ESP_OK;
+		}
+	}
+	return ESP_ERR_NO_MEM;
+}
+
+static esp_err_t startEspTimer(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+{
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = true;
+	timer->due_us = now_us + (int64_t) timeout_us;
+	timer->period_us = period_us;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	return startEspTimer(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+	return startEspTimer(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	if (!timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = false;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->used = false;
+	return ESP_OK;
+}
+
+void ets_delay_us(uint32_t us)
+{
+	sim_run_until(now_us + us);
+}
+
+int ets_printf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int length = vprintf(format, args);
+	va_end(args);
+	return length;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+	log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+	if (level > log_level) {
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/*
+ * FreeRTOS.  The caller is the only task; blocking runs the clock forward.
+ */
+BaseType_t xPortGetCoreID(void)
+{
+	return APP_CPU_NUM;
+}
+
+void vPortCPUInitializeMutex(portMUX_TYPE *mux)
+{
+	mux->owner = 0;
+	mux->count = 0;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	sim_run_until(now_us + (int64_t) ticks * SIM_US_PER_TICK);
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake, TickType_t period)
+{
+	*previous_wake += period;
+	sim_run_until((int64_t) *previous_wake * SIM_US_PER_TICK);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t) (now_us / SIM_US_PER_TICK);
+}
+
+TickType_t xTaskGetTickCountFromISR(void)
+{
+	return xTaskGetTickCount();
+}
+
+// Only the caller runs, other tasks cannot be started.
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+		void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+	return pdFAIL;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+		void *arg, UBaseType_t priority, StackType_t *stack, StaticTask_t *tcb, BaseType_t core)
+{
+	return NULL;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return &notify_count;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_woken)
+{
+	notify_count++;
+	if (higher_priority_woken != NULL) {
+		*higher_priority_woken = pdTRUE;
+	}
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	notify_count++;
+	return pdPASS;
+}
+
+/*
+ * Runs alarms until a notification arrives.  Waiting forever with nothing
+ * armed would hang the firmware; here it returns 0 with an error.
+ */
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t timeout)
+{
+	int64_t limit = now_us + (int64_t) timeout * SIM_US_PER_TICK;
+	int timer;
+	while (notify_count == 0 && (timer = nextTimer()) >= 0
+			&& (timeout == portMAX_DELAY || timers[timer].due_us <= limit)) {
+		runTimer(timer);
+	}
+	if (notify_count == 0) {
+		if (timeout == portMAX_DELAY) {
+			fprintf(stderr, "sim: task blocked forever with no alarm armed\n");
+		} else if (limit > now_us) {
+			now_us = limit;
+		}
+		return 0;
+	}
+	uint32_t count = notify_count;
+	notify_count = clear_on_exit ? 0 : count - 1;
+	return count;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+	if (event_group_count == SIM_EVENT_GROUPS) {
+		return NULL;
+	}
+	return &event_groups[event_group_count++];
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	return *(EventBits_t *) group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	*(EventBits_t *) group |= bits;
+	return *(EventBits_t *) group;
+}
+
+BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t group, EventBits_t bits,
+		BaseType_t *higher_priority_woken)
+{
+	xEventGroupSetBits(group, bits);
+	return pdPASS;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	EventBits_t before = *(EventBits_t *) group;
+	*(EventBits_t *) group &= ~bits;
+	return before;
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * sim.h - simulated ESP32 peripherals behind the host build.
+ *
+ * The firmware sources are compiled unchanged against the stand-in IDF
+ * headers in host/include.  Behind those, time is a simulated microsecond
+ * clock that only moves while the code under test waits: vTaskDelay(),
+ * ulTaskNotifyTake(), ets_delay_us() and UART transfers run it forward and
+ * fire every timer alarm that falls due on the way, in time order.  There
+ * is one task, the caller, and ISRs run in between its calls exactly where
+ * the hardware would have interrupted it.
+ *
+ * Each alarm ISR is entered some latency after its alarm.  The latency
+ * model stands in for other interrupts and flash cache stalls; by default
+ * it is zero.  Like the real timers, a reloaded alarm is measured from the
+ * previous alarm, so latency moves single steps without accumulating.
+ *
+ * Step edges are observed from the register writes an ISR leaves behind:
+ * any write to the GPIO set/clear registers or an LEDC duty update counts
+ * as one edge, reported to the edge hook with its alarm and ISR entry times.
+ *
+ * The 1-Wire bus is simulated at time slot level behind the UART driver,
+ * with any number of DS18B20s on it (see sim_onewire_add()).
+ */
+
+// ensure this library description is only included once
+#ifndef Sim_h
+#define Sim_h
+
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "driver/pcnt.h"
+
+struct SimStepEdge {
+  int timer;                  // 0..3, group * 2 + index
+  int64_t alarm_us;           // when the alarm was due
+  int64_t isr_us;             // when the ISR entered and wrote the outputs
+  uint32_t interval_us;       // interval the previous ISR programmed
+  bool late;                  // entered after the following alarm was due
+};
+
+typedef void (*sim_edge_hook_t)(const SimStepEdge &edge, void *arg);
+
+struct SimStats {
+  uint64_t isr_calls;         // alarm ISRs run
+  uint64_t isr_host_ns;       // host time spent inside them
+  uint64_t edges;             // ISRs that changed the outputs
+  uint64_t late_isrs;         // ISRs entered after their next alarm was due
+};
+
+// Back to time 0 with no alarms armed, outputs low, no latency, no 1-Wire
+// devices and zeroed statistics.  seed drives the latency and bit errors.
+void sim_reset(uint32_t seed);
+
+int64_t sim_now_us(void);
+// Runs alarms until the clock reaches time_us.
+void sim_run_until(int64_t time_us);
+// Runs alarms until none is armed or the clock reaches limit_us.  Returns
+// true if everything stopped.
+bool sim_run_until_idle(int64_t limit_us);
+// Runs exactly the next alarm, returning false if none is armed.
+bool sim_run_next(void);
+
+// ISR entry latency: base_us plus up to spread_us of uniform noise, and one
+// in every burst_every alarms (0 for never) a further burst_us, the way a
+// Wi-Fi or flash operation would hold interrupts off.
+void sim_set_isr_latency(uint32_t base_us, uint32_t spread_us,
+    uint32_t burst_every, uint32_t burst_us);
+
+void sim_set_edge_hook(sim_edge_hook_t hook, void *arg);
+const SimStats &sim_stats(void);
+
+// Drives an input pin, running its GPIO interrupt handler on a matching edge.
+void sim_gpio_input(gpio_num_t pin, int level);
+// Level of an output pin from the simulated out/out1 registers.
+int sim_gpio_output(gpio_num_t pin);
+
+// Adds a DS18B20 with the given ROM code (NULL for a made-up one) reading
+// celsius.  Returns its index, or -1 if the bus is full.
+int sim_onewire_add(const uint8_t *rom, float celsius);
+void sim_onewire_set_temperature(int device, float celsius);
+// Corrupts one in every one_in bits read back from the bus, 0 for none.
+void sim_onewire_set_error_rate(uint32_t one_in);
+// Slots and resets seen on the bus since sim_reset().
+uint32_t sim_onewire_slots(void);
+
+// Moves a pulse counter unit by delta counts, one at a time, wrapping at its
+// limits and running the PCNT interrupt handler there, as an encoder would.
+void sim_pcnt_count(pcnt_unit_t unit, int32_t delta);
+
+// Shared between the simulation files.
+uint32_t sim_random(void);
+void sim_gpio_reset(void);
+void sim_onewire_reset(void);
+void sim_pcnt_reset(void);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * SimGpio.cpp - simulated GPIO matrix and LEDC driver.
+ */
+
+#include <string.h>
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "soc/gpio_struct.h"
+#include "soc/ledc_struct.h"
+#include "sim.h"
+
+gpio_dev_t GPIO;
+ledc_dev_t LEDC;
+
+struct SimPin {
+	gpio_mode_t mode;
+	bool pull_up;
+	int input;                // level driven with sim_gpio_input(), -1 for none
+	gpio_int_type_t intr_type;
+	gpio_isr_t handler;
+	void *handler_arg;
+};
+
+static SimPin pins[GPIO_NUM_MAX];
+static bool isr_service_installed;
+
+void sim_gpio_reset(void)
+{
+	memset((void *) &GPIO, 0, sizeof(GPIO));
+	memset((void *) &LEDC, 0, sizeof(LEDC));
+	for (int p = 0; p < GPIO_NUM_MAX; p++) {
+		pins[p].input = -1;
+	}
+}
+
+int sim_gpio_output(gpio_num_t pin)
+{
+	if (pin < 32) {
+		return (GPIO.out >> pin) & 1;
+	}
+	return (GPIO.out1.val >> (pin - 32)) & 1;
+}
+
+void sim_gpio_input(gpio_num_t pin, int level)
+{
+	SimPin *sim = &pins[pin];
+	int before = gpio_get_level(pin);
+	sim->input = level ? 1 : 0;
+	if (sim->handler == NULL || before == sim->input) {
+		return;
+	}
+	bool rising = sim->input == 1;
+	if (sim->intr_type == GPIO_INTR_ANYEDGE
+			|| (sim->intr_type == GPIO_INTR_POSEDGE && rising)
+			|| (sim->intr_type == GPIO_INTR_NEGEDGE && !rising)
+			|| (sim->intr_type == GPIO_INTR_HIGH_LEVEL && rising)
+			|| (sim->intr_type == GPIO_INTR_LOW_LEVEL && !rising)) {
+		sim->handler(sim->handler_arg);
+	}
+}
+
+extern "C" {
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+	for (int p = 0; p < GPIO_NUM_MAX; p++) {
+		if (config->pin_bit_mask & (1ULL << p)) {
+			pins[p].mode = config->mode;
+			pins[p].pull_up = config->pull_up_en == GPIO_PULLUP_ENABLE;
+			pins[p].intr_type = config->intr_type;
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level)
+{
+	if (pin < 32) {
+		GPIO.out = level ? (GPIO.out | (1u << pin)) : (GPIO.out & ~(1u << pin));
+	} else {
+		uint32_t bit = 1u << (pin - 32);
+		GPIO.out1.val = level ? (GPIO.out1.val | bit) : (GPIO.out1.val & ~bit);
+	}
+	return ESP_OK;
+}
+
+/*
+ * Inputs read what sim_gpio_input() drives, or the output latch while
+ * nothing drives them: pins idle high, as with a bus pull-up.
+ */
+int gpio_get_level(gpio_num_t pin)
+{
+	if (pins[pin].input >= 0) {
+		return pins[pin].input;
+	}
+	if (pins[pin].mode & GPIO_MODE_OUTPUT) {
+		return sim_gpio_output(pin);
+	}
+	return 1;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode)
+{
+	pins[pin].mode = mode;
+	return ESP_OK;
+}
+
+void gpio_pad_select_gpio(uint8_t pin)
+{
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+	if (isr_service_installed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	isr_service_installed = true;
+	return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t handler, void *arg)
+{
+	if (!isr_service_installed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	pins[pin].handler = handler;
+	pins[pin].handler_arg = arg;
+	return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+	pins[pin].handler = NULL;
+	pins[pin].handler_arg = NULL;
+	return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t type)
+{
+	pins[pin].intr_type = type;
+	return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t pin)
+{
+	return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t pin)
+{
+	return ESP_OK;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *config)
+{
+	return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *config)
+{
+	LEDC.channel_group[config->speed_mode].channel[config->channel].duty.duty = config->duty << 4;
+	return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty)
+{
+	LEDC.channel_group[mode].channel[channel].duty.duty = duty << 4;
+	return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+	LEDC.channel_group[mode].channel[channel].duty_rd.duty_read =
+			LEDC.channel_group[mode].channel[channel].duty.duty;
+	return ESP_OK;
+}
+
+esp_err_t ledc_stop(ledc_mode_t mode, ledc_channel_t channel, uint32_t idle_level)
+{
+	LEDC.channel_group[mode].channel[channel].duty_rd.duty_read = 0;
+	return ESP_OK;
+}
+
+uint32_t ledc_get_duty(ledc_mode_t mode, ledc_channel_t channel)
+{
+	return LEDC.channel_group[mode].channel[channel].duty_rd.duty_read >> 4;
+}
+
+}
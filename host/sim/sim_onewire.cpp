@@ -0,0 +1,309 @@
+/*
+ * SimOneWire.cpp - DS18B20s on a simulated 1-Wire bus behind the UART driver.
+ *
+ * The UART transport sends one character per time slot: at the reset baud
+ * rate a character is a reset pulse and comes back changed if anything
+ * answers with a presence pulse; at the slot baud rate 0x00 writes a 0 and
+ * 0xFF writes a 1 or reads a bit, coming back changed if a device holds the
+ * bus low.  Every device sees each slot and the bus is the wired AND of the
+ * master and every device driving it, so ROM search works as on a real bus.
+ */
+
+#include <string.h>
+#include "driver/uart.h"
+#include "sim.h"
+
+#define SIM_ONEWIRE_DEVICES 8
+#define SIM_ONEWIRE_RESET_BAUD 9600
+#define SIM_UART_BUFFER 256
+
+enum DeviceState {
+	DEVICE_IDLE,              // waiting for a reset
+	DEVICE_ROM_COMMAND,
+	DEVICE_MATCH_ROM,
+	DEVICE_SEARCH_ROM,
+	DEVICE_FUNCTION,
+	DEVICE_READ_SCRATCHPAD,
+	DEVICE_WRITE_SCRATCHPAD
+};
+
+struct SimDevice {
+	uint8_t rom[8];
+	uint8_t scratchpad[9];
+	int16_t raw;              // temperature in 1/16 C for the next conversion
+	DeviceState state;
+	int bit;                  // bit position within the current state
+	uint8_t shift;            // command byte being received
+	bool matched;
+	int search_step;          // 0 sends the ROM bit, 1 its complement, 2 reads
+};
+
+static SimDevice devices[SIM_ONEWIRE_DEVICES];
+static int device_count;
+static uint32_t error_one_in;
+static uint32_t slots;
+
+static uint32_t baud_rate[UART_NUM_MAX];
+static uint8_t rx_buffer[UART_NUM_MAX][SIM_UART_BUFFER];
+static int rx_length[UART_NUM_MAX];
+
+static uint8_t crc8(const uint8_t *data, int length)
+{
+	uint8_t crc = 0;
+	for (int i = 0; i < length; i++) {
+		uint8_t byte = data[i];
+		for (int b = 0; b < 8; b++) {
+			uint8_t mix = (crc ^ byte) & 0x01;
+			crc >>= 1;
+			if (mix) {
+				crc ^= 0x8C;
+			}
+			byte >>= 1;
+		}
+	}
+	return crc;
+}
+
+static int romBit(const SimDevice *device, int bit)
+{
+	return (device->rom[bit / 8] >> (bit % 8)) & 1;
+}
+
+/*
+ * Converts the set temperature at the configured resolution, leaving the
+ * undefined low bits as they would be on the part.
+ */
+static void convert(SimDevice *device)
+{
+	int resolution = 9 + ((device->scratchpad[4] >> 5) & 0x03);
+	int16_t raw = device->raw & ~((1 << (12 - resolution)) - 1);
+	device->scratchpad[0] = raw & 0xFF;
+	device->scratchpad[1] = (raw >> 8) & 0xFF;
+	device->scratchpad[8] = crc8(device->scratchpad, 8);
+}
+
+// what the device drives in this slot: 0 holds the bus low, 1 leaves it
+static int deviceOutput(const SimDevice *device)
+{
+	switch (device->state) {
+		case DEVICE_READ_SCRATCHPAD:
+			return (device->scratchpad[device->bit / 8] >> (device->bit % 8)) & 1;
+		case DEVICE_SEARCH_ROM:
+			if (device->search_step == 0) {
+				return romBit(device, device->bit);
+			}
+			if (device->search_step == 1) {
+				return !romBit(device, device->bit);
+			}
+			return 1;
+		default:
+			return 1;
+	}
+}
+
+// the level the bus settled at in this slot
+static void deviceSlot(SimDevice *device, int level)
+{
+	switch (device->state) {
+		case DEVICE_IDLE:
+			break;
+		case DEVICE_ROM_COMMAND:
+		case DEVICE_FUNCTION:
+			device->shift |= level << device->bit;
+			if (++device->bit < 8) {
+				break;
+			}
+			device->bit = 0;
+			if (device->state == DEVICE_ROM_COMMAND) {
+				switch (device->shift) {
+					case 0xCC: device->state = DEVICE_FUNCTION; break;
+					case 0x55: device->state = DEVICE_MATCH_ROM; device->matched = true; break;
+					case 0xF0: device->state = DEVICE_SEARCH_ROM; device->search_step = 0; break;
+					default: device->state = DEVICE_IDLE; break;
+				}
+			} else {
+				switch (device->shift) {
+					case 0x44: convert(device); device->state = DEVICE_IDLE; break;
+					case 0xBE: device->state = DEVICE_READ_SCRATCHPAD; break;
+					case 0x4E: device->state = DEVICE_WRITE_SCRATCHPAD; break;
+					default: device->state = DEVICE_IDLE; break;
+				}
+			}
+			device->shift = 0;
+			break;
+		case DEVICE_MATCH_ROM:
+			device->matched = device->matched && level == romBit(device, device->bit);
+			if (++device->bit == 64) {
+				device->bit = 0;
+				device->state = device->matched ? DEVICE_FUNCTION : DEVICE_IDLE;
+			}
+			break;
+		case DEVICE_SEARCH_ROM:
+			if (device->search_step < 2) {
+				device->search_step++;
+				break;
+			}
+			// the master's choice of branch; devices on the other one drop out
+			device->search_step = 0;
+			if (level != romBit(device, device->bit)) {
+				device->state = DEVICE_IDLE;
+			} else if (++device->bit == 64) {
+				device->state = DEVICE_IDLE;
+			}
+			break;
+		case DEVICE_READ_SCRATCHPAD:
+			if (++device->bit == 72) {
+				device->state = DEVICE_IDLE;
+			}
+			break;
+		case DEVICE_WRITE_SCRATCHPAD: {
+			// TH, TL and configuration; the low five configuration bits read as 1
+			uint8_t *byte = &device->scratchpad[2 + device->bit / 8];
+			uint8_t mask = 1 << (device->bit % 8);
+			*byte = level ? (*byte | mask) : (*byte & ~mask);
+			if (++device->bit == 24) {
+				device->scratchpad[4] = (device->scratchpad[4] & 0x60) | 0x1F;
+				device->scratchpad[8] = crc8(device->scratchpad, 8);
+				device->state = DEVICE_IDLE;
+			}
+			break;
+		}
+	}
+}
+
+// Runs one slot the master starts with the given character, returning the echo
+static uint8_t busSlot(uint8_t character, bool reset)
+{
+	slots++;
+	if (reset) {
+		for (int d = 0; d < device_count; d++) {
+			devices[d].state = DEVICE_ROM_COMMAND;
+			devices[d].bit = 0;
+			devices[d].shift = 0;
+		}
+		// a presence pulse overlaps the upper bits of the character
+		return device_count > 0 ? (character & 0x0F) | 0x80 : character;
+	}
+
+	int level = character == 0xFF ? 1 : 0;
+	for (int d = 0; d < device_count; d++) {
+		level &= deviceOutput(&devices[d]);
+	}
+	for (int d = 0; d < device_count; d++) {
+		deviceSlot(&devices[d], level);
+	}
+	if (character != 0xFF) {
+		return 0x00;
+	}
+	if (error_one_in > 0 && sim_random() % error_one_in == 0) {
+		level = !level;
+	}
+	return level ? 0xFF : 0xFE;
+}
+
+void sim_onewire_reset(void)
+{
+	device_count = 0;
+	error_one_in = 0;
+	slots = 0;
+	memset(rx_length, 0, sizeof(rx_length));
+}
+
+int sim_onewire_add(const uint8_t *rom, float celsius)
+{
+	if (device_count == SIM_ONEWIRE_DEVICES) {
+		return -1;
+	}
+	SimDevice *device = &devices[device_count];
+	memset(device, 0, sizeof(*device));
+	if (rom != NULL) {
+		memcpy(device->rom, rom, 8);
+	} else {
+		device->rom[0] = 0x28;    // DS18B20 family code
+		for (int i = 1; i < 7; i++) {
+			device->rom[i] = sim_random() & 0xFF;
+		}
+		device->rom[7] = crc8(device->rom, 7);
+	}
+	// power-up scratchpad: 85 C, TH 75, TL 70, 12 bit
+	static const uint8_t power_up[8] = {0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10};
+	memcpy(device->scratchpad, power_up, 8);
+	device->scratchpad[8] = crc8(device->scratchpad, 8);
+	device->state = DEVICE_IDLE;
+	sim_onewire_set_temperature(device_count, celsius);
+	return device_count++;
+}
+
+void sim_onewire_set_temperature(int device, float celsius)
+{
+	devices[device].raw = (int16_t) (celsius * 16 + (celsius < 0 ? -0.5f : 0.5f));
+}
+
+void sim_onewire_set_error_rate(uint32_t one_in)
+{
+	error_one_in = one_in;
+}
+
+uint32_t sim_onewire_slots(void)
+{
+	return slots;
+}
+
+/*
+ * UART driver.  Each character takes its ten bit times of simulated time.
+ */
+extern "C" {
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config)
+{
+	baud_rate[port] = config->baud_rate;
+	return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+	return ESP_OK;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size,
+		int queue_size, QueueHandle_t *queue, int intr_alloc_flags)
+{
+	rx_length[port] = 0;
+	return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t rate)
+{
+	baud_rate[port] = rate;
+	return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t port, const char *data, size_t size)
+{
+	bool reset = baud_rate[port] <= SIM_ONEWIRE_RESET_BAUD;
+	for (size_t i = 0; i < size; i++) {
+		uint8_t echo = busSlot((uint8_t) data[i], reset);
+		if (rx_length[port] < SIM_UART_BUFFER) {
+			rx_buffer[port][rx_length[port]++] = echo;
+		}
+	}
+	sim_run_until(sim_now_us() + (int64_t) size * 10 * 1000000 / baud_rate[port]);
+	return (int) size;
+}
+
+int uart_read_bytes(uart_port_t port, uint8_t *buffer, uint32_t length, TickType_t timeout)
+{
+	int count = rx_length[port] < (int) length ? rx_length[port] : (int) length;
+	memcpy(buffer, rx_buffer[port], count);
+	memmove(rx_buffer[port], rx_buffer[port] + count, rx_length[port] - count);
+	rx_length[port] -= count;
+	return count;
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+	rx_length[port] = 0;
+	return ESP_OK;
+}
+
+}
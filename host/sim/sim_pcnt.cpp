@@ -0,0 +1,134 @@
+/*
+ * SimPcnt.cpp - simulated pulse counter units.
+ *
+ * Counts come from sim_pcnt_count() rather than from pins; the unit's
+ * configured edge modes are not evaluated.  What is simulated is what the
+ * firmware relies on: the 16-bit counter, its reset at the limits with the
+ * latched limit status and pending interrupt bit, and the shared ISR.
+ */
+
+#include <string.h>
+#include "driver/pcnt.h"
+#include "soc/pcnt_struct.h"
+#include "sim.h"
+
+pcnt_dev_t PCNT;
+
+struct SimUnit {
+	int16_t h_lim;
+	int16_t l_lim;
+	bool h_lim_event;
+	bool l_lim_event;
+	bool paused;
+	int16_t count;
+};
+
+static SimUnit units[PCNT_UNIT_MAX];
+// kept across sim_reset(), like the registration that the firmware keeps
+static void (*isr_fn)(void *);
+static void *isr_arg;
+
+void sim_pcnt_reset(void)
+{
+	memset((void *) &PCNT, 0, sizeof(PCNT));
+	memset(units, 0, sizeof(units));
+}
+
+void sim_pcnt_count(pcnt_unit_t unit, int32_t delta)
+{
+	SimUnit &u = units[unit];
+	int32_t step = delta > 0 ? 1 : -1;
+	for (; delta != 0 && !u.paused; delta -= step) {
+		u.count += step;
+		bool high = u.h_lim_event && u.count == u.h_lim;
+		bool low = u.l_lim_event && u.count == u.l_lim;
+		if (!high && !low) {
+			continue;
+		}
+		u.count = 0;
+		PCNT.cnt_unit[unit].cnt_val = 0;
+		PCNT.status_unit[unit].h_lim_lat = high;
+		PCNT.status_unit[unit].l_lim_lat = low;
+		PCNT.int_raw.val |= 1UL << unit;
+		if (PCNT.int_ena.val & (1UL << unit)) {
+			PCNT.int_st.val |= 1UL << unit;
+			if (isr_fn != NULL) {
+				isr_fn(isr_arg);
+			}
+			// the ISR clears what it has served
+			PCNT.int_raw.val &= ~PCNT.int_clr.val;
+			PCNT.int_st.val &= ~PCNT.int_clr.val;
+			PCNT.int_clr.val = 0;
+		}
+	}
+	PCNT.cnt_unit[unit].cnt_val = (uint16_t) u.count;
+}
+
+esp_err_t pcnt_unit_config(const pcnt_config_t *config)
+{
+	if (config->unit >= PCNT_UNIT_MAX || config->channel >= PCNT_CHANNEL_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	units[config->unit].h_lim = config->counter_h_lim;
+	units[config->unit].l_lim = config->counter_l_lim;
+	return ESP_OK;
+}
+
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val)
+{
+	return filter_val < 1024 ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit)
+{
+	return ESP_OK;
+}
+
+esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t evt_type)
+{
+	if (evt_type == PCNT_EVT_H_LIM) {
+		units[unit].h_lim_event = true;
+	} else if (evt_type == PCNT_EVT_L_LIM) {
+		units[unit].l_lim_event = true;
+	}
+	return ESP_OK;
+}
+
+esp_err_t pcnt_counter_pause(pcnt_unit_t unit)
+{
+	units[unit].paused = true;
+	return ESP_OK;
+}
+
+esp_err_t pcnt_counter_resume(pcnt_unit_t unit)
+{
+	units[unit].paused = false;
+	return ESP_OK;
+}
+
+esp_err_t pcnt_counter_clear(pcnt_unit_t unit)
+{
+	units[unit].count = 0;
+	PCNT.cnt_unit[unit].cnt_val = 0;
+	return ESP_OK;
+}
+
+esp_err_t pcnt_intr_enable(pcnt_unit_t unit)
+{
+	PCNT.int_ena.val |= 1UL << unit;
+	return ESP_OK;
+}
+
+esp_err_t pcnt_isr_register(void (*fn)(void *), void *arg, int intr_alloc_flags,
+		pcnt_isr_handle_t *handle)
+{
+	if (isr_fn != NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	isr_fn = fn;
+	isr_arg = arg;
+	if (handle != NULL) {
+		*handle = (pcnt_isr_handle_t) &isr_fn;
+	}
+	return ESP_OK;
+}
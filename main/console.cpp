@@ -0,0 +1,110 @@
+/*
+ * Console.cpp - line commands on the UART0 serial console.
+ */
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "static_task.h"
+#include "console.h"
+
+#define CONSOLE_UART UART_NUM_0
+#define CONSOLE_RX_BUFFER 256
+
+static const char* LOG_TAG = "Console";
+
+struct ConsoleCommand {
+	const char *name;
+	const char *help;
+	console_handler_t handler;
+	void *arg;
+};
+
+static ConsoleCommand commands[CONSOLE_MAX_COMMANDS];
+static int command_count = 0;
+static StaticTask<CONSOLE_TASK_STACK_SIZE> console_task;
+
+bool console_register(const char *name, const char *help, console_handler_t handler, void *arg)
+{
+	if (command_count == CONSOLE_MAX_COMMANDS) {
+		ESP_LOGE(LOG_TAG, "No room for command %s", name);
+		return false;
+	}
+	ConsoleCommand *command = &commands[command_count++];
+	command->name = name;
+	command->help = help;
+	command->handler = handler;
+	command->arg = arg;
+	return true;
+}
+
+static void printHelp(int argc, char **argv, void *arg)
+{
+	for (int i = 0; i < command_count; i++) {
+		printf("  %-12s %s\n", commands[i].name, commands[i].help);
+	}
+}
+
+/*
+ * Splits the line in place and runs its command.
+ */
+static void runLine(char *line)
+{
+	char *argv[CONSOLE_MAX_ARGS];
+	int argc = 0;
+	char *save = NULL;
+	for (char *word = strtok_r(line, " \t", &save); word != NULL && argc < CONSOLE_MAX_ARGS;
+			word = strtok_r(NULL, " \t", &save)) {
+		argv[argc++] = word;
+	}
+	if (argc == 0) {
+		return;
+	}
+	for (int i = 0; i < command_count; i++) {
+		if (strcmp(argv[0], commands[i].name) == 0) {
+			commands[i].handler(argc, argv, commands[i].arg);
+			return;
+		}
+	}
+	printf("Unknown command %s, try help\n", argv[0]);
+}
+
+static void consoleTask(void *arg)
+{
+	char line[CONSOLE_MAX_LINE];
+	int length = 0;
+	while (1) {
+		uint8_t c;
+		if (uart_read_bytes(CONSOLE_UART, &c, 1, portMAX_DELAY) != 1) {
+			continue;
+		}
+		if (c == '\r' || c == '\n') {
+			printf("\n");
+			line[length] = '\0';
+			runLine(line);
+			length = 0;
+			printf("> ");
+		} else if ((c == '\b' || c == 0x7F) && length > 0) {
+			length--;
+			printf("\b \b");
+		} else if (c >= ' ' && c < 0x7F && length < CONSOLE_MAX_LINE - 1) {
+			line[length++] = c;
+			putchar(c);
+		}
+		fflush(stdout);
+	}
+}
+
+bool console_start(UBaseType_t priority, BaseType_t core)
+{
+	esp_err_t err = uart_driver_install(CONSOLE_UART, CONSOLE_RX_BUFFER, 0, 0, NULL, 0);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to install the UART driver: %d", err);
+		return false;
+	}
+	console_register("help", "lists the commands", printHelp, NULL);
+	return console_task.start(&consoleTask, "console", NULL, priority, core);
+}
@@ -0,0 +1,31 @@
+/*
+ * Console.h - line commands on the UART0 serial console.
+ *
+ * A low priority task reads lines from UART0 (echoing them, with
+ * backspace), splits them into words and runs the command named by the
+ * first one.  Commands are registered once at start-up into a fixed table;
+ * "help" lists them.  Handlers run in the console task and print with
+ * printf, so they should keep away from anything timing critical.
+ */
+
+// ensure this library description is only included once
+#ifndef Console_h
+#define Console_h
+
+#include "freertos/FreeRTOS.h"
+
+#define CONSOLE_MAX_COMMANDS 16
+#define CONSOLE_MAX_LINE 80
+#define CONSOLE_MAX_ARGS 8
+#define CONSOLE_TASK_STACK_SIZE 3072  // printf of floats
+
+// argv[0] is the command name.
+typedef void (*console_handler_t)(int argc, char **argv, void *arg);
+
+// Adds a command; returns false if the table is full.
+bool console_register(const char *name, const char *help, console_handler_t handler, void *arg);
+
+// Installs the UART0 driver and starts the console task.
+bool console_start(UBaseType_t priority, BaseType_t core);
+
+#endif
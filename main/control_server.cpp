@@ -0,0 +1,603 @@
+/*
+ * ControlServer.cpp - HTTP and WebSocket control API.
+ */
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+#include "esp_timer.h"
+#include "heater_controller.h"
+#include "telemetry.h"
+#include "control_server.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_TEXT 0x1
+#define WEBSOCKET_CLOSE 0x8
+#define WEBSOCKET_PING 0x9
+#define WEBSOCKET_PONG 0xA
+#define WEBSOCKET_FIN 0x80
+
+static const char* LOG_TAG = "ControlServer";
+
+static const char INDEX_TEXT[] =
+	"GET  /status     latest telemetry as JSON\n"
+	"GET  /telemetry  WebSocket stream of the same\n"
+	"POST /recipe     recipe text to pour next\n";
+
+/*
+ * Copies the value of header name out of a request head, without the
+ * leading blanks.  Header names are case insensitive.
+ */
+static bool headerValue(const char *head, const char *name, char *value, int size)
+{
+	size_t name_length = strlen(name);
+	const char *line = strstr(head, "\r\n");
+	while (line != NULL && line[2] != '\r') {
+		line += 2;
+		if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+			const char *start = line + name_length + 1;
+			while (*start == ' ' || *start == '\t') {
+				start++;
+			}
+			int length = 0;
+			while (start[length] != '\r' && start[length] != '\0' && length < size - 1) {
+				value[length] = start[length];
+				length++;
+			}
+			value[length] = '\0';
+			return true;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return false;
+}
+
+// Formats a temperature in 1/16 C as degrees with two decimals.
+static int formatSixteenths(char *out, int size, int32_t value)
+{
+	const char *sign = value < 0 ? "-" : "";
+	int32_t magnitude = abs(value);
+	return snprintf(out, size, "%s%d.%02d", sign, magnitude / 16, (magnitude % 16) * 100 / 16);
+}
+
+static bool wouldBlock(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+ControlServer::ControlServer(RecipeMailbox *recipes, int axis_count)
+{
+	this->recipes = recipes;
+	this->axis_count = axis_count;
+	this->listener = -1;
+	this->uploader = NULL;
+	this->recipe_length = 0;
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		this->clients[i].socket = -1;
+		this->clients[i].state = CLIENT_FREE;
+	}
+}
+
+bool ControlServer::start(uint16_t port, UBaseType_t priority, BaseType_t core)
+{
+	this->listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (this->listener < 0) {
+		ESP_LOGE(LOG_TAG, "Failed to create the listening socket: %d", errno);
+		return false;
+	}
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (bind(this->listener, (struct sockaddr *) &address, sizeof(address)) != 0
+			|| listen(this->listener, 2) != 0) {
+		ESP_LOGE(LOG_TAG, "Failed to listen on port %u: %d", port, errno);
+		close(this->listener);
+		this->listener = -1;
+		return false;
+	}
+	fcntl(this->listener, F_SETFL, O_NONBLOCK);
+
+	if (!this->server_task.start(&ControlServer::serverTask, "control", this, priority, core)) {
+		ESP_LOGE(LOG_TAG, "Failed to start the server task");
+		close(this->listener);
+		this->listener = -1;
+		return false;
+	}
+	ESP_LOGI(LOG_TAG, "Listening on port %u", port);
+	return true;
+}
+
+void ControlServer::serverTask(void *arg)
+{
+	((ControlServer *) arg)->serve();
+}
+
+/*
+ * Waits for any socket, or for the next telemetry frame to be due, and
+ * serves whatever is ready.  Requests that do not complete in time are
+ * dropped so a stuck client cannot keep its slot.
+ */
+void ControlServer::serve(void)
+{
+	const TickType_t period = CONTROL_STREAM_PERIOD_MS / portTICK_PERIOD_MS;
+	const TickType_t request_timeout = CONTROL_REQUEST_TIMEOUT_MS / portTICK_PERIOD_MS;
+	TickType_t next_frame = xTaskGetTickCount() + period;
+	while (1) {
+		fd_set readable, writable;
+		FD_ZERO(&readable);
+		FD_ZERO(&writable);
+		FD_SET(this->listener, &readable);
+		int highest = this->listener;
+		for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+			ControlClient *client = &this->clients[i];
+			if (client->state == CLIENT_FREE) {
+				continue;
+			}
+			FD_SET(client->socket, &readable);
+			if (client->out_sent < client->out_length) {
+				FD_SET(client->socket, &writable);
+			}
+			if (client->socket > highest) {
+				highest = client->socket;
+			}
+		}
+
+		TickType_t now = xTaskGetTickCount();
+		TickType_t wait = (int32_t) (next_frame - now) > 0 ? next_frame - now : 0;
+		struct timeval timeout;
+		timeout.tv_sec = wait * portTICK_PERIOD_MS / 1000;
+		timeout.tv_usec = (wait * portTICK_PERIOD_MS % 1000) * 1000;
+		if (select(highest + 1, &readable, &writable, NULL, &timeout) < 0) {
+			ESP_LOGE(LOG_TAG, "select failed: %d", errno);
+			vTaskDelay(period);
+			continue;
+		}
+
+		now = xTaskGetTickCount();
+		for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+			ControlClient *client = &this->clients[i];
+			if (client->state != CLIENT_FREE && FD_ISSET(client->socket, &writable)) {
+				this->flush(client);
+			}
+			if (client->state != CLIENT_FREE && FD_ISSET(client->socket, &readable)) {
+				this->receive(client);
+			}
+			if (client->state != CLIENT_FREE && client->state != CLIENT_STREAM
+					&& now - client->since > request_timeout) {
+				ESP_LOGW(LOG_TAG, "Dropping a client that timed out");
+				this->closeClient(client);
+			}
+		}
+		// after the clients, so slots they have just freed can be taken
+		if (FD_ISSET(this->listener, &readable)) {
+			this->acceptClient();
+		}
+
+		if ((int32_t) (now - next_frame) >= 0) {
+			this->stream();
+			next_frame += period;
+			if ((int32_t) (now - next_frame) >= 0) {
+				next_frame = now + period;
+			}
+		}
+	}
+}
+
+void ControlServer::acceptClient(void)
+{
+	int connection = accept(this->listener, NULL, NULL);
+	if (connection < 0) {
+		return;
+	}
+	ControlClient *client = NULL;
+	for (int i = 0; i < CONTROL_MAX_CLIENTS && client == NULL; i++) {
+		if (this->clients[i].state == CLIENT_FREE) {
+			client = &this->clients[i];
+		}
+	}
+	if (client == NULL) {
+		ESP_LOGW(LOG_TAG, "All %d client slots busy, refusing a connection", CONTROL_MAX_CLIENTS);
+		close(connection);
+		return;
+	}
+	fcntl(connection, F_SETFL, O_NONBLOCK);
+	int on = 1;
+	setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	client->socket = connection;
+	client->state = CLIENT_REQUEST;
+	client->since = xTaskGetTickCount();
+	client->in_length = 0;
+	client->body_left = 0;
+	client->out_length = 0;
+	client->out_sent = 0;
+}
+
+/*
+ * Reads what the socket has for the client's state.  in[] is kept NUL
+ * terminated while reading a request head, for the string functions.
+ */
+void ControlServer::receive(ControlClient *client)
+{
+	int received;
+	if (client->state == CLIENT_BODY) {
+		received = recv(client->socket, this->recipe_text + this->recipe_length,
+				client->body_left, 0);
+	} else if (client->state == CLIENT_REQUEST) {
+		received = recv(client->socket, client->in + client->in_length,
+				CONTROL_REQUEST_MAX - 1 - client->in_length, 0);
+	} else if (client->state == CLIENT_STREAM) {
+		received = recv(client->socket, client->in + client->in_length,
+				CONTROL_REQUEST_MAX - client->in_length, 0);
+	} else {
+		// anything after a request is ignored
+		char discard[32];
+		received = recv(client->socket, discard, sizeof(discard), 0);
+	}
+	if (received < 0 && wouldBlock()) {
+		return;
+	}
+	if (received <= 0) {
+		this->closeClient(client);
+		return;
+	}
+
+	switch (client->state) {
+		case CLIENT_BODY:
+			this->recipe_length += received;
+			client->body_left -= received;
+			if (client->body_left == 0) {
+				this->finishUpload(client);
+			}
+			break;
+		case CLIENT_REQUEST: {
+			client->in_length += received;
+			client->in[client->in_length] = '\0';
+			char *end = strstr(client->in, "\r\n\r\n");
+			if (end != NULL) {
+				this->handleRequest(client, end + 4 - client->in);
+			} else if (client->in_length == CONTROL_REQUEST_MAX - 1) {
+				this->respond(client, 431, "Request Header Fields Too Large", "text/plain",
+						"request too large\n");
+			}
+			break;
+		}
+		case CLIENT_STREAM:
+			client->in_length += received;
+			this->receiveFrames(client);
+			break;
+	}
+}
+
+void ControlServer::handleRequest(ControlClient *client, int head_length)
+{
+	char *method = client->in;
+	char *path = strchr(method, ' ');
+	char *version = path != NULL ? strchr(path + 1, ' ') : NULL;
+	if (version == NULL) {
+		this->respond(client, 400, "Bad Request", "text/plain", "bad request line\n");
+		return;
+	}
+	*path++ = '\0';
+	*version = '\0';
+	char *head = version + 1;
+
+	if (strcmp(path, "/recipe") == 0) {
+		char length[12];
+		if (strcmp(method, "POST") != 0) {
+			this->respond(client, 405, "Method Not Allowed", "text/plain", "use POST\n");
+		} else if (!headerValue(head, "Content-Length", length, sizeof(length))) {
+			this->respond(client, 411, "Length Required", "text/plain", "no Content-Length\n");
+		} else {
+			this->beginUpload(client, atoi(length), head_length);
+		}
+		return;
+	}
+	if (strcmp(method, "GET") != 0) {
+		this->respond(client, 405, "Method Not Allowed", "text/plain", "use GET\n");
+		return;
+	}
+	if (strcmp(path, "/") == 0) {
+		this->respond(client, 200, "OK", "text/plain", INDEX_TEXT);
+	} else if (strcmp(path, "/status") == 0) {
+		char json[CONTROL_FRAME_MAX];
+		if (this->formatTelemetry(json, sizeof(json)) > 0) {
+			this->respond(client, 200, "OK", "application/json", json);
+		} else {
+			this->respond(client, 500, "Internal Server Error", "text/plain", "no room\n");
+		}
+	} else if (strcmp(path, "/telemetry") == 0) {
+		char upgrade[16], key[32];
+		if (!headerValue(head, "Upgrade", upgrade, sizeof(upgrade))
+				|| strcasecmp(upgrade, "websocket") != 0
+				|| !headerValue(head, "Sec-WebSocket-Key", key, sizeof(key))) {
+			this->respond(client, 426, "Upgrade Required", "text/plain", "WebSocket only\n");
+		} else {
+			this->openStream(client, key);
+		}
+	} else {
+		this->respond(client, 404, "Not Found", "text/plain", "not found\n");
+	}
+}
+
+/*
+ * There is one recipe buffer, so one upload at a time.  Body bytes that
+ * came with the head are taken over first.
+ */
+void ControlServer::beginUpload(ControlClient *client, int content_length, int head_length)
+{
+	if (content_length <= 0 || content_length > CONTROL_RECIPE_MAX) {
+		this->respond(client, 413, "Payload Too Large", "text/plain", "recipe too long\n");
+		return;
+	}
+	if (this->uploader != NULL) {
+		this->respond(client, 503, "Service Unavailable", "text/plain", "another upload is running\n");
+		return;
+	}
+	int early = client->in_length - head_length;
+	if (early > content_length) {
+		early = content_length;
+	}
+	memcpy(this->recipe_text, client->in + head_length, early);
+	this->recipe_length = early;
+	this->uploader = client;
+	client->body_left = content_length - early;
+	client->state = CLIENT_BODY;
+	if (client->body_left == 0) {
+		this->finishUpload(client);
+	}
+}
+
+void ControlServer::finishUpload(ControlClient *client)
+{
+	this->recipe_text[this->recipe_length] = '\0';
+	this->uploader = NULL;
+	if (this->recipes->post(this->recipe_text, this->axis_count)) {
+		ESP_LOGI(LOG_TAG, "Recipe of %d bytes uploaded", this->recipe_length);
+		this->respond(client, 200, "OK", "text/plain", "recipe compiled, pouring next\n");
+	} else {
+		this->respond(client, 400, "Bad Request", "text/plain", "invalid recipe, see the log\n");
+	}
+}
+
+/*
+ * Answers the handshake with the key's SHA-1, with the WebSocket GUID
+ * appended, in base64.
+ */
+void ControlServer::openStream(ControlClient *client, const char *key)
+{
+	char keyed[sizeof(WEBSOCKET_GUID) + 32];
+	snprintf(keyed, sizeof(keyed), "%s" WEBSOCKET_GUID, key);
+	unsigned char digest[20];
+	mbedtls_sha1((const unsigned char *) keyed, strlen(keyed), digest);
+	unsigned char accept[32];
+	size_t accept_length = 0;
+	mbedtls_base64_encode(accept, sizeof(accept), &accept_length, digest, sizeof(digest));
+	accept[accept_length] = '\0';
+
+	client->out_length = snprintf((char *) client->out, CONTROL_RESPONSE_MAX,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+	client->out_sent = 0;
+	client->state = CLIENT_STREAM;
+	client->in_length = 0;
+	this->flush(client);
+}
+
+/*
+ * Handles the frames a stream client sends: pings are answered if there is
+ * room, a close ends the stream and anything else is ignored.  Client
+ * frames are always masked.
+ */
+void ControlServer::receiveFrames(ControlClient *client)
+{
+	while (client->in_length >= 2) {
+		uint8_t *in = (uint8_t *) client->in;
+		int opcode = in[0] & 0x0f;
+		int length = in[1] & 0x7f;
+		int head = 2;
+		if (!(in[1] & 0x80) || length == 127) {
+			this->closeClient(client);
+			return;
+		}
+		if (length == 126) {
+			if (client->in_length < 4) {
+				return;
+			}
+			length = (in[2] << 8) | in[3];
+			head = 4;
+		}
+		const uint8_t *mask = in + head;
+		head += 4;
+		if (head + length > CONTROL_REQUEST_MAX) {
+			this->closeClient(client);
+			return;
+		}
+		if (client->in_length < head + length) {
+			return;
+		}
+		uint8_t *payload = in + head;
+		for (int i = 0; i < length; i++) {
+			payload[i] ^= mask[i & 3];
+		}
+
+		if (opcode == WEBSOCKET_CLOSE) {
+			this->closeClient(client);
+			return;
+		}
+		if (opcode == WEBSOCKET_PING && length <= 125 && client->out_length == 0) {
+			client->out[0] = WEBSOCKET_FIN | WEBSOCKET_PONG;
+			client->out[1] = length;
+			memcpy(client->out + 2, payload, length);
+			client->out_length = 2 + length;
+			client->out_sent = 0;
+			this->flush(client);
+			if (client->state == CLIENT_FREE) {
+				return;
+			}
+		}
+		client->in_length -= head + length;
+		memmove(in, in + head + length, client->in_length);
+	}
+}
+
+/*
+ * Sends the current telemetry to every stream straight from the frame
+ * buffer.  Only what a socket does not take at once is copied, to that
+ * client's output; a client still holding output skips this frame.
+ */
+void ControlServer::stream(void)
+{
+	bool streaming = false;
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		streaming |= (this->clients[i].state == CLIENT_STREAM);
+	}
+	if (!streaming) {
+		return;
+	}
+
+	// the JSON goes after the longest header, and the header right before it
+	int length = this->formatTelemetry((char *) this->frame + 4, CONTROL_FRAME_MAX - 4);
+	if (length <= 0) {
+		return;
+	}
+	uint8_t *start;
+	if (length < 126) {
+		start = this->frame + 2;
+		start[1] = length;
+	} else {
+		start = this->frame;
+		start[1] = 126;
+		start[2] = length >> 8;
+		start[3] = length & 0xff;
+	}
+	start[0] = WEBSOCKET_FIN | WEBSOCKET_TEXT;
+	length += this->frame + 4 - start;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		ControlClient *client = &this->clients[i];
+		if (client->state != CLIENT_STREAM || client->out_length != 0) {
+			continue;
+		}
+		int sent = send(client->socket, start, length, MSG_DONTWAIT);
+		if (sent < 0 && !wouldBlock()) {
+			this->closeClient(client);
+			continue;
+		}
+		if (sent < 0) {
+			sent = 0;
+		}
+		if (sent < length) {
+			memcpy(client->out, start + sent, length - sent);
+			client->out_length = length - sent;
+			client->out_sent = 0;
+		}
+	}
+}
+
+/*
+ * Returns the length of the JSON, or 0 if it did not fit.
+ */
+int ControlServer::formatTelemetry(char *out, int size)
+{
+	MotionTelemetry motion = motion_telemetry.read();
+	HeaterTelemetry heater = heater_telemetry.read();
+	FlowTelemetry flow = flow_telemetry.read();
+
+	int length = snprintf(out, size, "{\"time_ms\":%u,\"position\":[",
+			(uint32_t) (esp_timer_get_time() / 1000));
+	for (int i = 0; i < this->axis_count && length < size; i++) {
+		length += snprintf(out + length, size - length, i > 0 ? ",%d" : "%d",
+				motion.position[i]);
+	}
+	if (length < size) {
+		length += snprintf(out + length, size - length,
+				"],\"steps_left\":%d,\"step_rate\":%u,\"temperature\":",
+				motion.steps_left,
+				motion.step_interval_us != 0 ? 1000000 / motion.step_interval_us : 0);
+	}
+	if (length < size) {
+		length += formatSixteenths(out + length, size - length, heater.temperature);
+	}
+	if (length < size) {
+		length += snprintf(out + length, size - length, ",\"setpoint\":");
+	}
+	if (length < size) {
+		length += formatSixteenths(out + length, size - length, heater.setpoint);
+	}
+	if (length < size) {
+		length += snprintf(out + length, size - length,
+				",\"heater_percent\":%u,\"sensor_ok\":%s",
+				heater.duty * 100 / HEATER_PWM_MAX_DUTY, heater.sensor_ok ? "true" : "false");
+	}
+	if (length < size) {
+		length += snprintf(out + length, size - length,
+				",\"weight_mg\":%d,\"flow_mg_s\":%d,\"flow_target_mg_s\":%d,\"scale_ok\":%s}",
+				flow.weight, flow.flow, flow.target, flow.sensor_ok ? "true" : "false");
+	}
+	return length < size ? length : 0;
+}
+
+/*
+ * Queues a whole response and closes the connection once it is sent.
+ */
+void ControlServer::respond(ControlClient *client, int status, const char *reason,
+		const char *type, const char *body)
+{
+	int length = snprintf((char *) client->out, CONTROL_RESPONSE_MAX,
+			"HTTP/1.1 %d %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: close\r\n\r\n%s", status, reason, type, (int) strlen(body), body);
+	if (length >= CONTROL_RESPONSE_MAX) {
+		ESP_LOGE(LOG_TAG, "Response %d too long", status);
+		this->closeClient(client);
+		return;
+	}
+	client->out_length = length;
+	client->out_sent = 0;
+	client->state = CLIENT_RESPONDED;
+	this->flush(client);
+}
+
+void ControlServer::flush(ControlClient *client)
+{
+	while (client->out_sent < client->out_length) {
+		int sent = send(client->socket, client->out + client->out_sent,
+				client->out_length - client->out_sent, MSG_DONTWAIT);
+		if (sent < 0 && wouldBlock()) {
+			return;
+		}
+		if (sent <= 0) {
+			this->closeClient(client);
+			return;
+		}
+		client->out_sent += sent;
+	}
+	client->out_length = 0;
+	client->out_sent = 0;
+	if (client->state == CLIENT_RESPONDED) {
+		this->closeClient(client);
+	}
+}
+
+void ControlServer::closeClient(ControlClient *client)
+{
+	if (this->uploader == client) {
+		this->uploader = NULL;
+	}
+	close(client->socket);
+	client->socket = -1;
+	client->state = CLIENT_FREE;
+}
@@ -0,0 +1,109 @@
+/*
+ * ControlServer.h - HTTP and WebSocket control API.
+ *
+ *   GET  /             what is served here
+ *   GET  /status       the latest telemetry once, as JSON
+ *   GET  /telemetry    WebSocket upgrade; then the same JSON as a text
+ *                      frame every CONTROL_STREAM_PERIOD_MS
+ *   POST /recipe       recipe text as the body (see recipe.h); it is
+ *                      compiled straight away and poured next
+ *
+ * One task serves every connection from a select() loop over raw lwIP
+ * sockets, with a fixed number of client slots; connections beyond them
+ * are closed at once.  Every buffer is part of the server object, so
+ * serving a request or a stream never allocates.  Telemetry is read from
+ * the shared seqlocked snapshots (see telemetry.h), which never hold up the
+ * step ISR or the heater, formatted once per period and sent to every
+ * stream from the same buffer.  Sockets are non-blocking: a client that
+ * cannot keep up misses frames instead of stalling the others.
+ *
+ * Run the task on the PRO CPU, below the heater's priority, so that however
+ * many dashboards are connected they only compete with Wi-Fi and the other
+ * reporting tasks, never with motion.
+ *
+ * Each response closes its connection; there is no keep-alive and no TLS,
+ * so keep the unit on a trusted network.
+ */
+
+// ensure this library description is only included once
+#ifndef ControlServer_h
+#define ControlServer_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "recipe.h"
+#include "static_task.h"
+
+#define CONTROL_MAX_CLIENTS CONFIG_POUR_BOT_CONTROL_CLIENTS   // set in menuconfig
+#define CONTROL_REQUEST_MAX 512         // request head, or WebSocket frames in
+#define CONTROL_RESPONSE_MAX 512        // output the socket has not taken yet
+#define CONTROL_FRAME_MAX 320           // telemetry frame, header included
+#define CONTROL_RECIPE_MAX 4096         // uploaded recipe text
+#define CONTROL_STREAM_PERIOD_MS 100
+#define CONTROL_REQUEST_TIMEOUT_MS 10000
+#define CONTROL_TASK_STACK_SIZE 4096
+
+// the listener, the clients and one spare to refuse connections with
+#if CONFIG_LWIP_MAX_SOCKETS < CONTROL_MAX_CLIENTS + 2
+#error "Raise LWIP_MAX_SOCKETS for CONFIG_POUR_BOT_CONTROL_CLIENTS connections"
+#endif
+
+enum ControlClientState {
+  CLIENT_FREE,
+  CLIENT_REQUEST,           // reading the request head
+  CLIENT_BODY,              // reading a recipe upload
+  CLIENT_RESPONDED,         // closes once the response is sent
+  CLIENT_STREAM             // WebSocket telemetry stream
+};
+
+struct ControlClient {
+  int socket;
+  uint8_t state;                    // a ControlClientState
+  TickType_t since;                 // when the request started
+  char in[CONTROL_REQUEST_MAX];
+  int in_length;
+  int body_left;                    // upload bytes still to come
+  uint8_t out[CONTROL_RESPONSE_MAX];
+  int out_length;
+  int out_sent;
+};
+
+class ControlServer {
+  public:
+    // Uploads are posted to recipes, compiled for axis_count axes, which is
+    // also how many positions are reported.
+    ControlServer(RecipeMailbox *recipes, int axis_count);
+
+    // Listens on port and starts the server task.
+    bool start(uint16_t port, UBaseType_t priority, BaseType_t core);
+
+  private:
+    static void serverTask(void *arg);
+    void serve(void);
+    void acceptClient(void);
+    void receive(ControlClient *client);
+    void handleRequest(ControlClient *client, int head_length);
+    void beginUpload(ControlClient *client, int content_length, int head_length);
+    void finishUpload(ControlClient *client);
+    void openStream(ControlClient *client, const char *key);
+    void receiveFrames(ControlClient *client);
+    void stream(void);
+    int formatTelemetry(char *out, int size);
+    void respond(ControlClient *client, int status, const char *reason,
+        const char *type, const char *body);
+    void flush(ControlClient *client);
+    void closeClient(ControlClient *client);
+
+    RecipeMailbox *recipes;
+    int axis_count;
+    int listener;
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+    ControlClient *uploader;                  // whose body fills recipe_text
+    int recipe_length;
+    char recipe_text[CONTROL_RECIPE_MAX + 1];
+    uint8_t frame[CONTROL_FRAME_MAX];         // shared by every stream
+    StaticTask<CONTROL_TASK_STACK_SIZE> server_task;
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * DeferredLog.cpp - binary log records, formatted later by a low priority task.
+ */
+
+#include <esp_log.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hrclock.h"
+#include "static_task.h"
+#include "telemetry.h"
+#include "deferred_log.h"
+
+static const char* LOG_TAG = "DeferredLog";
+
+#define DLOG_LAP(position) ((position) & ~(uint32_t) (DLOG_RING_LENGTH - 1))
+
+/*
+ * lap tells the record's state for the positions it holds in turn: it
+ * equals the lap, the position of the first record in that turn, while the
+ * record is free, the lap + 1 once written and the next lap once printed.
+ * That way the zeroed ring starts out free.
+ */
+struct DeferredLogRecord {
+	volatile uint32_t lap;
+	const char *tag;
+	const char *format;
+	uint32_t time_ms;
+	uint8_t level;
+	uint32_t args[DLOG_MAX_ARGS];
+};
+
+static DeferredLogRecord records[DLOG_RING_LENGTH];
+static volatile uint32_t head = 0;        // next position to claim, free running
+static uint32_t tail = 0;                 // next position to print, log task only
+static volatile uint32_t dropped = 0;
+static volatile esp_log_level_t level_enabled = (esp_log_level_t) CONFIG_LOG_DEFAULT_LEVEL;
+static StaticTask<DLOG_TASK_STACK_SIZE> log_task;
+
+/*
+ * Claims the record at the head with a compare-and-swap, S32C1I on the
+ * ESP32, which works across both cores and from interrupts.  A record
+ * still a lap behind has not been printed yet, i.e. the ring is full.
+ */
+bool IRAM_ATTR dlog_write(esp_log_level_t level, const char *tag, const char *format,
+		uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	if (level > level_enabled) {
+		return false;
+	}
+	uint32_t position = head;
+	DeferredLogRecord *record;
+	while (1) {
+		record = &records[position % DLOG_RING_LENGTH];
+		int32_t lag = (int32_t) (record->lap - DLOG_LAP(position));
+		if (lag == 0) {
+			uint32_t seen = __sync_val_compare_and_swap(&head, position, position + 1);
+			if (seen == position) {
+				break;
+			}
+			position = seen;
+		} else if (lag < 0) {
+			__sync_fetch_and_add(&dropped, 1);
+			return false;
+		} else {
+			// another writer claimed it first
+			position = head;
+		}
+	}
+	record->tag = tag;
+	record->format = format;
+	record->time_ms = (uint32_t) (hrclock_now_us() / 1000);
+	record->level = level;
+	record->args[0] = a0;
+	record->args[1] = a1;
+	record->args[2] = a2;
+	record->args[3] = a3;
+	TELEMETRY_BARRIER();
+	record->lap = DLOG_LAP(position) + 1;
+	return true;
+}
+
+void dlog_set_level(esp_log_level_t level)
+{
+	level_enabled = level;
+}
+
+uint32_t dlog_dropped(void)
+{
+	return dropped;
+}
+
+int dlog_flush(int max_records)
+{
+	static const char letters[] = "NEWIDV";
+	static uint32_t dropped_reported = 0;
+	char line[DLOG_LINE_LENGTH];
+	int count = 0;
+	while (count < max_records) {
+		DeferredLogRecord *record = &records[tail % DLOG_RING_LENGTH];
+		if (record->lap != DLOG_LAP(tail) + 1) {
+			// empty, or claimed but still being written
+			break;
+		}
+		TELEMETRY_BARRIER();
+		snprintf(line, sizeof(line), record->format, record->args[0], record->args[1],
+				record->args[2], record->args[3]);
+		esp_log_write((esp_log_level_t) record->level, record->tag, "%c (%u) %s: %s\n",
+				letters[record->level], record->time_ms, record->tag, line);
+		TELEMETRY_BARRIER();
+		record->lap = DLOG_LAP(tail) + DLOG_RING_LENGTH;
+		tail++;
+		count++;
+	}
+	uint32_t now_dropped = dropped;
+	if (now_dropped != dropped_reported) {
+		ESP_LOGW(LOG_TAG, "%u records dropped", now_dropped - dropped_reported);
+		dropped_reported = now_dropped;
+	}
+	return count;
+}
+
+static void logTask(void *arg)
+{
+	TickType_t last_wake = xTaskGetTickCount();
+	while (1) {
+		dlog_flush(DLOG_FLUSH_BURST);
+		vTaskDelayUntil(&last_wake, DLOG_FLUSH_PERIOD_MS / portTICK_PERIOD_MS);
+	}
+}
+
+bool dlog_start(UBaseType_t priority, BaseType_t core)
+{
+	return log_task.start(&logTask, "log", NULL, priority, core);
+}
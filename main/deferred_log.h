@@ -0,0 +1,69 @@
+/*
+ * DeferredLog.h - binary log records, formatted later by a low priority task.
+ *
+ * DLOGE()..DLOGV() take the place of ESP_LOGx() where formatting and
+ * writing to the UART on the spot would hurt timing: the step path, ISRs
+ * and the motion task.  A call only copies the tag and format pointers, a
+ * millisecond timestamp and up to DLOG_MAX_ARGS 32-bit arguments into a
+ * fixed ring of records; the log task formats and prints them with
+ * esp_log_write() in the usual "L (time) tag: message" form.
+ *
+ * Any number of tasks and ISRs, on either core, may log at once: a record
+ * is claimed by a compare-and-swap on the ring head and marked ready by its
+ * sequence number once written, so writers never block or take a lock.
+ * When the ring is full new records are dropped and counted, and the log
+ * task reports how many.  It prints at most DLOG_FLUSH_BURST records every
+ * DLOG_FLUSH_PERIOD_MS, so a flood of messages cannot hog the UART or the
+ * PRO CPU either.
+ *
+ * The format and tag must be string literals, or at least outlive the
+ * record.  Arguments are passed as 32-bit words: integers print with
+ * %d/%u/%x, pointers need a cast and %s only works on strings that are
+ * never freed.  Floats are not supported.
+ */
+
+// ensure this library description is only included once
+#ifndef DeferredLog_h
+#define DeferredLog_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define DLOG_RING_LENGTH CONFIG_POUR_BOT_LOG_RECORDS   // set in menuconfig
+#define DLOG_MAX_ARGS 4
+#define DLOG_LINE_LENGTH 128          // formatted message, longer ones are cut
+#define DLOG_FLUSH_PERIOD_MS 50
+#define DLOG_FLUSH_BURST 16           // records printed per period at most
+#define DLOG_TASK_STACK_SIZE 3072
+
+#if (DLOG_RING_LENGTH & (DLOG_RING_LENGTH - 1)) != 0
+#error "CONFIG_POUR_BOT_LOG_RECORDS must be a power of two"
+#endif
+
+// Queues a record if level is enabled; returns false if it was dropped.
+bool dlog_write(esp_log_level_t level, const char *tag, const char *format,
+    uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0);
+
+// Records above level are not queued.  Defaults to CONFIG_LOG_DEFAULT_LEVEL.
+void dlog_set_level(esp_log_level_t level);
+
+// Formats and prints up to max_records queued records now; returns how many.
+// Only one task may flush, normally the log task.
+int dlog_flush(int max_records);
+
+// Records dropped since boot because the ring was full.
+uint32_t dlog_dropped(void);
+
+// Starts the log task.
+bool dlog_start(UBaseType_t priority, BaseType_t core);
+
+#define DLOGE(tag, format, ...) dlog_write(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) dlog_write(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) dlog_write(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) dlog_write(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define DLOGV(tag, format, ...) dlog_write(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#endif
@@ -16,12 +16,44 @@
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "driver/gpio.h"
+#include "driver/uart.h"
 #include "rom/ets_sys.h"
+#include "ds18b20.h"
+
+// UART transport: each 1-Wire time slot is one UART character. A 0x00 at
+// 115200 baud holds the bus low for most of a slot (write 0); a 0xFF only
+// for the start bit (write 1 or read, and a sensor sending 0 shows up as a
+// changed echo). A 0xF0 at 9600 baud is the reset pulse.
+#define DS_UART_SLOT_BAUD 115200
+#define DS_UART_RESET_BAUD 9600
+#define DS_UART_TIMEOUT (20 / portTICK_PERIOD_MS)
+
+// Worst case conversion time in ms at 9, 10, 11 and 12 bit resolution
+static const TickType_t conversion_ms[4]={94,188,375,750};
+// Scratchpad reads per call before giving up
+#define DS_READ_ATTEMPTS 3
 
 int DS_GPIO;
 int init=0;
+// Highest resolution set since the last one for the whole bus, which the
+// conversion is timed for; 0 until one is set, sensors power up at 12 bits
+static int resolution=0;
+static int converting=0;
+static TickType_t conversion_start;
+static int uart_port=-1;      // UART_NUM_x when using the UART transport
+// Sends slots out of the UART and replaces them with what came back
+static int ds18b20_uart_slots(uint8_t *slots, int len){
+  uart_flush_input(uart_port);
+  uart_write_bytes(uart_port, (const char *)slots, len);
+  return uart_read_bytes(uart_port, slots, len, DS_UART_TIMEOUT)==len;
+}
 /// Sends one bit to bus
 void ds18b20_send(char bit){
+  if(uart_port>=0){
+    uint8_t slot=bit?0xFF:0x00;
+    ds18b20_uart_slots(&slot,1);
+    return;
+  }
   gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
   gpio_set_level(DS_GPIO,0);
   ets_delay_us(5);
@@ -32,6 +64,11 @@ void ds18b20_send(char bit){
 // Reads one bit from bus
 unsigned char ds18b20_read(void){
   unsigned char PRESENCE=0;
+  if(uart_port>=0){
+    uint8_t slot=0xFF;
+    if(!ds18b20_uart_slots(&slot,1)) return 1;
+    return slot==0xFF;
+  }
   gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
   gpio_set_level(DS_GPIO,0);
   ets_delay_us(2);
@@ -45,6 +82,12 @@ unsigned char ds18b20_read(void){
 void ds18b20_send_byte(char data){
   unsigned char i;
   unsigned char x;
+  if(uart_port>=0){
+    uint8_t slots[8];
+    for(i=0;i<8;i++) slots[i]=((data>>i)&0x01)?0xFF:0x00;
+    ds18b20_uart_slots(slots,8);
+    return;
+  }
   for(i=0;i<8;i++){
     x = data>>i;
     x &= 0x01;
@@ -56,6 +99,12 @@ void ds18b20_send_byte(char data){
 unsigned char ds18b20_read_byte(void){
   unsigned char i;
   unsigned char data = 0;
+  if(uart_port>=0){
+    uint8_t slots[8]={0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+    if(!ds18b20_uart_slots(slots,8)) return 0xFF;
+    for(i=0;i<8;i++) if(slots[i]==0xFF) data|=0x01<<i;
+    return data;
+  }
   for (i=0;i<8;i++)
   {
     if(ds18b20_read()) data|=0x01<<i;
@@ -66,6 +115,14 @@ unsigned char ds18b20_read_byte(void){
 // Sends reset pulse
 unsigned char ds18b20_RST_PULSE(void){
   unsigned char PRESENCE;
+  if(uart_port>=0){
+    uint8_t slot=0xF0;
+    uart_set_baudrate(uart_port, DS_UART_RESET_BAUD);
+    int echoed=ds18b20_uart_slots(&slot,1);
+    uart_set_baudrate(uart_port, DS_UART_SLOT_BAUD);
+    // a presence pulse pulls some of the high bits low; 0x00 is a shorted bus
+    return echoed && slot!=0xF0 && slot!=0x00;
+  }
   gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
   gpio_set_level(DS_GPIO,0);
   ets_delay_us(500);
@@ -77,34 +134,215 @@ unsigned char ds18b20_RST_PULSE(void){
   if(gpio_get_level(DS_GPIO)==1) PRESENCE=1; else PRESENCE=0;
   return PRESENCE;
 }
-// Returns temperature from sensor
-float ds18b20_get_temp(void) {
-  if(init==1){
-    unsigned char check;
-    char temp1=0, temp2=0;
-      check=ds18b20_RST_PULSE();
-      if(check==1)
-      {
-        ds18b20_send_byte(0xCC);
-        ds18b20_send_byte(0x44);
-        vTaskDelay(750 / portTICK_RATE_MS);
-        check=ds18b20_RST_PULSE();
-        ds18b20_send_byte(0xCC);
-        ds18b20_send_byte(0xBE);
-        temp1=ds18b20_read_byte();
-        temp2=ds18b20_read_byte();
-        check=ds18b20_RST_PULSE();
-        float temp=0;
-        temp=(float)(temp1+(temp2*256))/16;
-        return temp;
+// Starts a temperature conversion on every sensor on the bus at once
+esp_err_t ds18b20_start_conversion(void){
+  if(init!=1) return ESP_ERR_INVALID_STATE;
+  converting=0;
+  if(ds18b20_RST_PULSE()!=1) return ESP_ERR_NOT_FOUND;
+  ds18b20_send_byte(0xCC);
+  ds18b20_send_byte(0x44);
+  conversion_start=xTaskGetTickCount();
+  converting=1;
+  return ESP_OK;
+}
+// Returns 1 once the conversion started by ds18b20_start_conversion() is done,
+// until its result is read. Parasite powered sensors read as finished all
+// along, so rather than polling the bus this waits out the worst case
+// conversion time.
+int ds18b20_poll_ready(void){
+  if(!converting) return 0;
+  int bits=resolution ? resolution : 12;
+  if((xTaskGetTickCount()-conversion_start)*portTICK_PERIOD_MS>=conversion_ms[bits-9]) return 1;
+  return 0;
+}
+// Addresses one sensor with MATCH ROM, or every sensor with SKIP ROM when
+// addr is NULL
+static void ds18b20_select(const ds18b20_addr_t *addr){
+  if(addr==NULL){
+    ds18b20_send_byte(0xCC);
+    return;
+  }
+  ds18b20_send_byte(0x55);
+  for(int i=0;i<8;i++) ds18b20_send_byte(addr->rom[i]);
+}
+// Dallas/Maxim CRC8 (polynomial x^8 + x^5 + x^4 + 1), one table lookup per byte
+static const uint8_t crc8_table[256]={
+  0x00,0x5E,0xBC,0xE2,0x61,0x3F,0xDD,0x83,0xC2,0x9C,0x7E,0x20,0xA3,0xFD,0x1F,0x41,
+  0x9D,0xC3,0x21,0x7F,0xFC,0xA2,0x40,0x1E,0x5F,0x01,0xE3,0xBD,0x3E,0x60,0x82,0xDC,
+  0x23,0x7D,0x9F,0xC1,0x42,0x1C,0xFE,0xA0,0xE1,0xBF,0x5D,0x03,0x80,0xDE,0x3C,0x62,
+  0xBE,0xE0,0x02,0x5C,0xDF,0x81,0x63,0x3D,0x7C,0x22,0xC0,0x9E,0x1D,0x43,0xA1,0xFF,
+  0x46,0x18,0xFA,0xA4,0x27,0x79,0x9B,0xC5,0x84,0xDA,0x38,0x66,0xE5,0xBB,0x59,0x07,
+  0xDB,0x85,0x67,0x39,0xBA,0xE4,0x06,0x58,0x19,0x47,0xA5,0xFB,0x78,0x26,0xC4,0x9A,
+  0x65,0x3B,0xD9,0x87,0x04,0x5A,0xB8,0xE6,0xA7,0xF9,0x1B,0x45,0xC6,0x98,0x7A,0x24,
+  0xF8,0xA6,0x44,0x1A,0x99,0xC7,0x25,0x7B,0x3A,0x64,0x86,0xD8,0x5B,0x05,0xE7,0xB9,
+  0x8C,0xD2,0x30,0x6E,0xED,0xB3,0x51,0x0F,0x4E,0x10,0xF2,0xAC,0x2F,0x71,0x93,0xCD,
+  0x11,0x4F,0xAD,0xF3,0x70,0x2E,0xCC,0x92,0xD3,0x8D,0x6F,0x31,0xB2,0xEC,0x0E,0x50,
+  0xAF,0xF1,0x13,0x4D,0xCE,0x90,0x72,0x2C,0x6D,0x33,0xD1,0x8F,0x0C,0x52,0xB0,0xEE,
+  0x32,0x6C,0x8E,0xD0,0x53,0x0D,0xEF,0xB1,0xF0,0xAE,0x4C,0x12,0x91,0xCF,0x2D,0x73,
+  0xCA,0x94,0x76,0x28,0xAB,0xF5,0x17,0x49,0x08,0x56,0xB4,0xEA,0x69,0x37,0xD5,0x8B,
+  0x57,0x09,0xEB,0xB5,0x36,0x68,0x8A,0xD4,0x95,0xCB,0x29,0x77,0xF4,0xAA,0x48,0x16,
+  0xE9,0xB7,0x55,0x0B,0x88,0xD6,0x34,0x6A,0x2B,0x75,0x97,0xC9,0x4A,0x14,0xF6,0xA8,
+  0x74,0x2A,0xC8,0x96,0x15,0x4B,0xA9,0xF7,0xB6,0xE8,0x0A,0x54,0xD7,0x89,0x6B,0x35,
+};
+static uint8_t ds18b20_crc8(const uint8_t *data, int len){
+  uint8_t crc=0;
+  for(int i=0;i<len;i++) crc=crc8_table[crc^data[i]];
+  return crc;
+}
+// Reads a search bit and its complement. The UART times both slots in one
+// transaction; bit banging pads each read out to a whole slot.
+static void ds18b20_read_bit_pair(unsigned char *bit, unsigned char *complement){
+  if(uart_port>=0){
+    uint8_t slots[2]={0xFF,0xFF};
+    if(!ds18b20_uart_slots(slots,2)){
+      *bit=*complement=1;
+      return;
+    }
+    *bit=slots[0]==0xFF;
+    *complement=slots[1]==0xFF;
+    return;
+  }
+  *bit=ds18b20_read();
+  ets_delay_us(45);
+  *complement=ds18b20_read();
+  ets_delay_us(45);
+}
+// Finds the ROM codes of up to max sensors on the bus, returns how many
+// were found
+int ds18b20_search(ds18b20_addr_t *found, int max){
+  uint8_t rom[8]={0};
+  int last_discrepancy=0;
+  int count=0;
+  if(init!=1) return 0;
+  while(count<max){
+    if(ds18b20_RST_PULSE()!=1) break;
+    ds18b20_send_byte(0xF0);
+    int discrepancy=0;
+    for(int bit=1;bit<=64;bit++){
+      uint8_t mask=1<<((bit-1)%8);
+      uint8_t *byte=&rom[(bit-1)/8];
+      // every device sends its bit, then its complement
+      unsigned char b,cb;
+      ds18b20_read_bit_pair(&b,&cb);
+      if(b && cb) return count;   // nobody answered
+      unsigned char dir;
+      if(b!=cb) dir=b;
+      else{
+        // devices disagree: repeat the last pass' choice before the last
+        // branch point, take 1 at it and 0 after it
+        if(bit<last_discrepancy) dir=(*byte&mask)?1:0;
+        else dir=(bit==last_discrepancy);
+        if(dir==0) discrepancy=bit;
       }
-      else{return 0;}
-
+      if(dir) *byte|=mask; else *byte&=~mask;
+      ds18b20_send(dir);
+    }
+    if(ds18b20_crc8(rom,7)==rom[7]){
+      for(int i=0;i<8;i++) found[count].rom[i]=rom[i];
+      count++;
+    }
+    last_discrepancy=discrepancy;
+    if(last_discrepancy==0) break;
+  }
+  return count;
+}
+// Reads the full scratchpad of one sensor, retrying transactions that come
+// back corrupted
+static esp_err_t ds18b20_read_scratchpad(const ds18b20_addr_t *addr, uint8_t *scratchpad){
+  esp_err_t err=ESP_ERR_NOT_FOUND;
+  for(int attempt=0;attempt<DS_READ_ATTEMPTS;attempt++){
+    if(ds18b20_RST_PULSE()!=1){
+      err=ESP_ERR_NOT_FOUND;
+      continue;
+    }
+    ds18b20_select(addr);
+    ds18b20_send_byte(0xBE);
+    for(int i=0;i<9;i++) scratchpad[i]=ds18b20_read_byte();
+    // an all-zero read has a valid CRC too, but the configuration register
+    // always has its low five bits set
+    if(ds18b20_crc8(scratchpad,8)==scratchpad[8] && (scratchpad[4]&0x1F)==0x1F) return ESP_OK;
+    err=ESP_ERR_INVALID_CRC;
   }
-  else{return 0;}
+  return err;
+}
+// Reads the temperature of the last conversion from one sensor
+esp_err_t ds18b20_read_device(const ds18b20_addr_t *addr, float *temp){
+  uint8_t scratchpad[9];
+  if(init!=1) return ESP_ERR_INVALID_STATE;
+  converting=0;
+  esp_err_t err=ds18b20_read_scratchpad(addr,scratchpad);
+  if(err!=ESP_OK){
+    *temp=DS18B20_DISCONNECTED;
+    return err;
+  }
+  int16_t raw=(int16_t)(scratchpad[0]|(scratchpad[1]<<8));
+  // below 12 bits the low bits are undefined; this sensor's own resolution
+  // is in its configuration register
+  int bits=9+((scratchpad[4]>>5)&3);
+  raw&=~((1<<(12-bits))-1);
+  *temp=(float)raw/16;
+  return ESP_OK;
+}
+// Reads the temperature of the last conversion
+esp_err_t ds18b20_read_result(float *temp){
+  return ds18b20_read_device(NULL,temp);
+}
+// Sets the conversion resolution of one sensor to 9, 10, 11 or 12 bits. Only
+// the scratchpad is written, not the EEPROM, so this can be changed freely
+// and is lost on power loss.
+esp_err_t ds18b20_set_device_resolution(const ds18b20_addr_t *addr, int bits){
+  if(init!=1) return ESP_ERR_INVALID_STATE;
+  if(bits<9 || bits>12) return ESP_ERR_INVALID_ARG;
+  // keep the alarm registers, which share the write with the configuration
+  uint8_t scratchpad[9];
+  esp_err_t err=ds18b20_read_scratchpad(addr,scratchpad);
+  if(err!=ESP_OK) return err;
+  if(ds18b20_RST_PULSE()!=1) return ESP_ERR_NOT_FOUND;
+  ds18b20_select(addr);
+  ds18b20_send_byte(0x4E);
+  ds18b20_send_byte(scratchpad[2]);
+  ds18b20_send_byte(scratchpad[3]);
+  ds18b20_send_byte(0x1F|((bits-9)<<5));
+  ds18b20_RST_PULSE();
+  if(addr==NULL || bits>resolution) resolution=bits;
+  return ESP_OK;
+}
+// Sets the resolution of every sensor on the bus at once
+esp_err_t ds18b20_set_resolution(int bits){
+  return ds18b20_set_device_resolution(NULL,bits);
+}
+// Returns temperature from sensor, blocking for the conversion, or
+// DS18B20_DISCONNECTED if it could not be read
+float ds18b20_get_temp(void) {
+  float temp=DS18B20_DISCONNECTED;
+  if(ds18b20_start_conversion()!=ESP_OK) return DS18B20_DISCONNECTED;
+  while(!ds18b20_poll_ready()) vTaskDelay(10 / portTICK_PERIOD_MS);
+  ds18b20_read_result(&temp);
+  return temp;
 }
 void ds18b20_init(int GPIO){
   DS_GPIO = GPIO;
   gpio_pad_select_gpio(DS_GPIO);
   init=1;
 }
+// Runs the bus from a UART instead: TX and RX share the pin, which is
+// switched to open drain, so whole bytes are timed by the UART while the
+// calling task sleeps. Needs the usual external pull-up.
+esp_err_t ds18b20_init_uart(int GPIO, uart_port_t uart){
+  uart_config_t config={
+    .baud_rate=DS_UART_SLOT_BAUD,
+    .data_bits=UART_DATA_8_BITS,
+    .parity=UART_PARITY_DISABLE,
+    .stop_bits=UART_STOP_BITS_1,
+    .flow_ctrl=UART_HW_FLOWCTRL_DISABLE,
+  };
+  esp_err_t err=uart_param_config(uart, &config);
+  if(err==ESP_OK) err=uart_set_pin(uart, GPIO, GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+  if(err==ESP_OK) err=uart_driver_install(uart, UART_FIFO_LEN*2, 0, 0, NULL, 0);
+  if(err!=ESP_OK) return err;
+  gpio_set_direction(GPIO, GPIO_MODE_INPUT_OUTPUT_OD);
+  DS_GPIO = GPIO;
+  uart_port = uart;
+  init=1;
+  return ESP_OK;
+}
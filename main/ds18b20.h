@@ -15,7 +15,21 @@
 #ifndef DS18B20_H_  
 #define DS18B20_H_
 
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+
+// Temperature reported when a sensor cannot be read
+#define DS18B20_DISCONNECTED (-127.0f)
+
+// 64 bit ROM code of one sensor: family code, serial number, CRC
+typedef struct {
+  uint8_t rom[8];
+} ds18b20_addr_t;
+
+#ifdef __cplusplus
 extern "C" {
+#endif
 void ds18b20_send(char bit);
 unsigned char ds18b20_read(void);
 void ds18b20_send_byte(char data);
@@ -23,5 +37,28 @@ unsigned char ds18b20_read_byte(void);
 unsigned char ds18b20_RST_PULSE(void);
 float ds18b20_get_temp(void);
 void ds18b20_init(int GPIO);
+// Same bus, but with slots timed by a spare UART instead of busy waits.
+esp_err_t ds18b20_init_uart(int GPIO, uart_port_t uart);
+
+// Resolution of 9 to 12 bits; conversions take about 94, 188, 375 or 750 ms.
+esp_err_t ds18b20_set_resolution(int bits);
+
+// Non-blocking read: start a conversion, poll until it is ready, then
+// fetch the result.  Reads check the scratchpad CRC and retry; on failure
+// they return ESP_ERR_NOT_FOUND or ESP_ERR_INVALID_CRC and set the
+// temperature to DS18B20_DISCONNECTED.
+esp_err_t ds18b20_start_conversion(void);
+int ds18b20_poll_ready(void);
+esp_err_t ds18b20_read_result(float *temp);
+
+// Several sensors on one bus: find their ROM codes once, then start one
+// conversion for all of them and read each by address.  The conversion is
+// timed for the highest resolution set on any of them, so set one on every
+// sensor; ds18b20_set_resolution() sets all of them at once.
+int ds18b20_search(ds18b20_addr_t *found, int max);
+esp_err_t ds18b20_set_device_resolution(const ds18b20_addr_t *addr, int bits);
+esp_err_t ds18b20_read_device(const ds18b20_addr_t *addr, float *temp);
+#ifdef __cplusplus
 }
 #endif
+#endif
@@ -0,0 +1,71 @@
+/*
+ * FlowController.cpp - closed-loop pour rate from the load cell.
+ */
+
+#include <math.h>
+#include "motion_coordinator.h"
+#include "telemetry.h"
+#include "flow_controller.h"
+
+FlowController::FlowController(MotionCoordinator *motion)
+{
+	this->motion = motion;
+	this->target = 0;
+	this->restart = true;
+	this->rate_scale = MOTION_RATE_FULL;
+	this->pid.setOutputLimits(MOTION_RATE_MIN, MOTION_RATE_FULL);
+}
+
+/*
+ * Converts the gains to fixed point for flows in mg/s, the rate scale and
+ * the load cell's sample period.
+ */
+void FlowController::setTunings(float kp, float ki)
+{
+	const float scale = (float) MOTION_RATE_FULL / 1000.0f * (1 << PID_SHIFT);
+	const float period_s = 1.0f / LOADCELL_SAMPLE_RATE;
+	this->pid.setGains((int32_t) lroundf(kp * scale), (int32_t) lroundf(ki * period_s * scale), 0);
+}
+
+void FlowController::attach(LoadCell *cell)
+{
+	cell->setCallback(&FlowController::onSample, this);
+}
+
+void FlowController::setTarget(float grams_per_second)
+{
+	this->target = (int32_t) lroundf(grams_per_second * 1000);
+	this->restart = true;
+}
+
+void FlowController::onSample(const LoadCellSample &sample, void *arg)
+{
+	((FlowController *) arg)->update(sample);
+}
+
+/*
+ * One control step per sample.  The output is the rate scale itself, not
+ * a correction to it, so the integral is preloaded with the full rate
+ * whenever the loop starts over.
+ */
+void FlowController::update(const LoadCellSample &sample)
+{
+	int32_t target = this->target;
+	if (this->restart || target == 0 || !sample.ok) {
+		this->restart = false;
+		this->pid.preload(MOTION_RATE_FULL);
+		this->rate_scale = MOTION_RATE_FULL;
+	}
+	if (target != 0 && sample.ok && this->motion->isRunning()) {
+		this->rate_scale = (uint32_t) this->pid.update(target, sample.flow);
+	}
+	this->motion->setRateScale(this->rate_scale);
+
+	FlowTelemetry state;
+	state.weight = sample.weight;
+	state.flow = sample.flow;
+	state.target = target;
+	state.rate_scale = this->rate_scale;
+	state.sensor_ok = sample.ok;
+	flow_telemetry.write(state);
+}
@@ -0,0 +1,56 @@
+/*
+ * FlowController.h - closed-loop pour rate from the load cell.
+ *
+ * Poured open loop, how much water lands in the cup for a given spout
+ * move drifts with the water level and temperature.  With a target set,
+ * every load cell sample runs a PI step from the measured flow to the
+ * MotionCoordinator's rate scale (see setRateScale()), so the spout slows
+ * down whenever water comes faster than the target.  A recipe's speed is
+ * therefore the fastest the spout may go: pour at a generous speed and let
+ * the loop hold the flow.
+ *
+ * The loop only runs while the spout moves and keeps its state across the
+ * pauses between moves, so each pulse of a pour starts at the rate the
+ * last one ended on.  A new target starts it again from the full rate.
+ * With no target, or while the load cell is not answering, the spout runs
+ * at the planned rate.
+ *
+ * All of this runs on the load cell task.  Every sample's state is
+ * published to flow_telemetry (see telemetry.h).
+ */
+
+// ensure this library description is only included once
+#ifndef FlowController_h
+#define FlowController_h
+
+#include <stdint.h>
+#include "load_cell.h"
+#include "pid_controller.h"
+
+class MotionCoordinator;
+
+class FlowController {
+  public:
+    explicit FlowController(MotionCoordinator *motion);
+
+    // Gains in rate fraction (0..1) per g/s and per g of flow error; set
+    // before attach().
+    void setTunings(float kp, float ki);
+    // Feeds the loop from cell's samples; call before starting the cell.
+    void attach(LoadCell *cell);
+
+    // Flow to hold in g/s, 0 to pour open loop.  Safe from any task.
+    void setTarget(float grams_per_second);
+
+  private:
+    static void onSample(const LoadCellSample &sample, void *arg);
+    void update(const LoadCellSample &sample);
+
+    MotionCoordinator *motion;
+    PidController pid;
+    volatile int32_t target;        // mg/s, 0 for open loop
+    volatile bool restart;          // target changed since the last sample
+    uint32_t rate_scale;            // last applied, MOTION_RATE_FULL for none
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * HeaterController.cpp - closed-loop kettle temperature control.
+ */
+
+#include <esp_log.h>
+#include <math.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/ledc.h"
+#include "ds18b20.h"
+#include "heater_controller.h"
+
+static const char* LOG_TAG = "HeaterController";
+
+HeaterController::HeaterController(int ssr_pin, ledc_timer_t timer, ledc_channel_t channel)
+{
+	this->channel = channel;
+	this->has_sensor_addr = false;
+	this->target = 0;
+	this->enabled = false;
+	this->periods = 0;
+	this->measured = (int32_t) (DS18B20_DISCONNECTED * 16);
+	this->duty = 0;
+	this->missed_reads = 0;
+	this->pid.setOutputLimits(0, HEATER_PWM_MAX_DUTY);
+
+	ledc_timer_config_t timer_conf;
+	memset(&timer_conf, 0, sizeof(timer_conf));
+	timer_conf.speed_mode = LEDC_HIGH_SPEED_MODE;
+	timer_conf.duty_resolution = LEDC_TIMER_10_BIT;
+	timer_conf.timer_num = timer;
+	timer_conf.freq_hz = HEATER_PWM_FREQ_HZ;
+	if (ledc_timer_config(&timer_conf) != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to configure LEDC timer %d", timer);
+	}
+
+	ledc_channel_config_t channel_conf;
+	memset(&channel_conf, 0, sizeof(channel_conf));
+	channel_conf.gpio_num = ssr_pin;
+	channel_conf.speed_mode = LEDC_HIGH_SPEED_MODE;
+	channel_conf.channel = channel;
+	channel_conf.intr_type = LEDC_INTR_DISABLE;
+	channel_conf.timer_sel = timer;
+	channel_conf.duty = 0;
+	channel_conf.hpoint = 0;
+	ledc_channel_config(&channel_conf);
+}
+
+/*
+ * Converts the gains to fixed point for the sensor's 1/16 C units, the
+ * duty range and the control period.
+ */
+void HeaterController::setTunings(float kp, float ki, float kd)
+{
+	const float scale = (float) HEATER_PWM_MAX_DUTY / 16.0f * (1 << PID_SHIFT);
+	const float period_s = HEATER_CONTROL_PERIOD_MS / 1000.0f;
+	this->pid.setGains((int32_t) lroundf(kp * scale),
+			(int32_t) lroundf(ki * period_s * scale),
+			(int32_t) lroundf(kd / period_s * scale));
+}
+
+void HeaterController::setSensor(const ds18b20_addr_t *addr)
+{
+	this->has_sensor_addr = (addr != NULL);
+	if (addr != NULL) {
+		this->sensor_addr = *addr;
+	}
+}
+
+void HeaterController::setTarget(float celsius)
+{
+	this->target = (int32_t) lroundf(celsius * 16);
+	this->enabled = true;
+}
+
+/*
+ * The control loop checks enabled once per period, so the second period
+ * that ends after it is cleared has certainly switched the SSR off.
+ */
+bool HeaterController::switchOff(TickType_t timeout)
+{
+	this->enabled = false;
+	uint32_t seen = this->periods;
+	TickType_t waited = 0;
+	while (this->periods - seen < 2) {
+		if (waited >= timeout) {
+			return false;
+		}
+		vTaskDelay(HEATER_CONTROL_PERIOD_MS / portTICK_PERIOD_MS);
+		waited += HEATER_CONTROL_PERIOD_MS / portTICK_PERIOD_MS;
+	}
+	return true;
+}
+
+bool HeaterController::start(UBaseType_t priority, BaseType_t core)
+{
+	if (this->control_task.task() != NULL) {
+		return true;
+	}
+	// the broadcast form reads the scratchpad back, which only works with
+	// one sensor on the bus
+	esp_err_t err = this->has_sensor_addr
+			? ds18b20_set_device_resolution(&this->sensor_addr, HEATER_SENSOR_RESOLUTION)
+			: ds18b20_set_resolution(HEATER_SENSOR_RESOLUTION);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to set the probe to %d bit: %d", HEATER_SENSOR_RESOLUTION, err);
+	}
+	return this->control_task.start(&HeaterController::task, "heater", this, priority, core);
+}
+
+void HeaterController::task(void *arg)
+{
+	((HeaterController *) arg)->run();
+}
+
+/*
+ * The control loop.  vTaskDelayUntil keeps the period fixed no matter how
+ * long the bus transactions take, which the PID gains depend on.
+ */
+void HeaterController::run(void)
+{
+	const ds18b20_addr_t *addr = this->has_sensor_addr ? &this->sensor_addr : NULL;
+	TickType_t wake = xTaskGetTickCount();
+
+	ds18b20_start_conversion();
+	while (1) {
+		vTaskDelayUntil(&wake, HEATER_CONTROL_PERIOD_MS / portTICK_PERIOD_MS);
+
+		float celsius;
+		bool enabled = this->enabled;
+		esp_err_t err = ds18b20_read_device(addr, &celsius);
+		ds18b20_start_conversion();
+
+		if (err != ESP_OK) {
+			if (++this->missed_reads == HEATER_MAX_MISSED_READS) {
+				ESP_LOGE(LOG_TAG, "Kettle probe lost, heater off");
+				this->pid.reset();
+				this->setDuty(0);
+			}
+		} else {
+			if (this->missed_reads >= HEATER_MAX_MISSED_READS) {
+				ESP_LOGI(LOG_TAG, "Kettle probe back");
+			}
+			this->missed_reads = 0;
+
+			// readings are exact multiples of 1/16 C
+			this->measured = (int32_t) lroundf(celsius * 16);
+			if (enabled) {
+				this->setDuty(this->pid.update(this->target, this->measured));
+			}
+		}
+		if (!enabled && this->duty != 0) {
+			this->pid.reset();
+			this->setDuty(0);
+		}
+
+		HeaterTelemetry state;
+		state.temperature = this->measured;
+		state.setpoint = this->target;
+		state.duty = this->duty;
+		state.sensor_ok = (this->missed_reads == 0);
+		heater_telemetry.write(state);
+		heater_samples.push(state);
+		this->periods = this->periods + 1;
+	}
+}
+
+void HeaterController::setDuty(uint32_t duty)
+{
+	this->duty = duty;
+	ledc_set_duty(LEDC_HIGH_SPEED_MODE, this->channel, duty);
+	ledc_update_duty(LEDC_HIGH_SPEED_MODE, this->channel);
+}
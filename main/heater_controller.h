@@ -0,0 +1,89 @@
+/*
+ * HeaterController.h - closed-loop kettle temperature control.
+ *
+ * A task runs a fixed-rate loop: broadcast a DS18B20 conversion, sleep
+ * until the period is over (the conversion finishes while the task is
+ * blocked), read the kettle probe, run the PID step and update the SSR duty.
+ * The SSR is driven by a slow LEDC PWM, so a zero-crossing SSR simply sees
+ * a number of mains half cycles on per PWM period.
+ *
+ * The sensor is read at 10 bit (0.125 C, 188 ms per conversion) so the loop
+ * can run at 5 Hz.  If the probe cannot be read for several periods in a
+ * row the heater is switched off until readings come back.  switchOff()
+ * keeps it off, e.g. before the unit sleeps, until the next setTarget().
+ *
+ * Every period's state is published to heater_telemetry and queued on
+ * heater_samples (see telemetry.h) for other tasks.
+ */
+
+// ensure this library description is only included once
+#ifndef HeaterController_h
+#define HeaterController_h
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/ledc.h"
+#include "ds18b20.h"
+#include "pid_controller.h"
+#include "static_task.h"
+#include "telemetry.h"
+
+#define HEATER_CONTROL_PERIOD_MS 200
+#define HEATER_SENSOR_RESOLUTION 10
+#define HEATER_PWM_FREQ_HZ 2
+#define HEATER_PWM_MAX_DUTY 1023        // 10 bit duty
+#define HEATER_MAX_MISSED_READS 5
+#define HEATER_TASK_STACK_SIZE 2048
+
+class HeaterController {
+  public:
+    // The DS18B20 bus must already be set up with ds18b20_init*().
+    HeaterController(int ssr_pin, ledc_timer_t timer, ledc_channel_t channel);
+
+    // Gains in duty fraction (0..1) per C, per C*s and per C/s.
+    void setTunings(float kp, float ki, float kd);
+    // Probe to control from, or NULL for the only sensor on the bus.  Set
+    // before start(), which sets its resolution.
+    void setSensor(const ds18b20_addr_t *addr);
+    // Turns the heater on, aiming for celsius.
+    void setTarget(float celsius);
+    // Turns the heater off and waits up to timeout for the control loop to
+    // have cut the SSR.  Returns false if it did not in time.
+    bool switchOff(TickType_t timeout);
+    bool isOff(void) const { return !this->enabled; }
+    // Turns the heater back on at the last target, e.g. after switchOff().
+    void switchOn(void) { this->enabled = true; }
+    // True once the probe has not been read for HEATER_MAX_MISSED_READS
+    // periods in a row, with the heater held off.
+    bool probeLost(void) const { return this->missed_reads >= HEATER_MAX_MISSED_READS; }
+
+    // Starts the control task on the given core.  Returns false if it could
+    // not be created.
+    bool start(UBaseType_t priority, BaseType_t core);
+
+    // Latest kettle temperature, DS18B20_DISCONNECTED before the first read.
+    float temperature(void) const { return this->measured / 16.0f; }
+    // Current heater power as a fraction of full power.
+    float power(void) const { return (float) this->duty / HEATER_PWM_MAX_DUTY; }
+
+  private:
+    static void task(void *arg);
+    void run(void);
+    void setDuty(uint32_t duty);
+
+    ledc_channel_t channel;
+    bool has_sensor_addr;
+    ds18b20_addr_t sensor_addr;
+
+    PidController pid;
+    volatile int32_t target;         // setpoint in 1/16 C
+    volatile bool enabled;           // false after switchOff()
+    volatile uint32_t periods;       // control periods run
+    volatile int32_t measured;       // last reading in 1/16 C
+    volatile uint32_t duty;          // SSR duty in LEDC counts
+    volatile int missed_reads;
+    StaticTask<HEATER_TASK_STACK_SIZE> control_task;
+};
+
+#endif
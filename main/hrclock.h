@@ -0,0 +1,47 @@
+/*
+ * hrclock.h - 64-bit monotonic timestamps for the motion and sensor code.
+ *
+ * hrclock_now_us() is the system-wide microsecond clock behind esp_timer.
+ * It is 64 bits wide, so it does not wrap for the life of the device, and it
+ * is safe to call from IRAM interrupt handlers.
+ *
+ * hrclock_cycles() reads the CPU cycle counter (CCOUNT) directly.  It has
+ * 1/CPU-MHz resolution but wraps every ~18 s at 240 MHz and is per core,
+ * so it is only meant for measuring short intervals on one core.
+ */
+#ifndef HRCLOCK_H_
+#define HRCLOCK_H_
+
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#define HRCLOCK_CYCLES_PER_US CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+
+// Microseconds since boot.
+static inline int64_t IRAM_ATTR hrclock_now_us(void)
+{
+  return esp_timer_get_time();
+}
+
+// Raw CPU cycle counter of the calling core.
+static inline uint32_t IRAM_ATTR hrclock_cycles(void)
+{
+#ifdef __XTENSA__
+  uint32_t ccount;
+  __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+  return ccount;
+#else
+  // host build: derived from the simulated clock
+  return (uint32_t) (esp_timer_get_time() * HRCLOCK_CYCLES_PER_US);
+#endif
+}
+
+// Converts a cycle count difference into microseconds.
+static inline uint32_t IRAM_ATTR hrclock_cycles_to_us(uint32_t cycles)
+{
+  return cycles / HRCLOCK_CYCLES_PER_US;
+}
+
+#endif
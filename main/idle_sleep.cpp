@@ -0,0 +1,60 @@
+/*
+ * IdleSleep.cpp - light sleep while the unit waits for the next pour.
+ */
+
+#include <esp_log.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "rom/uart.h"
+#include "idle_sleep.h"
+
+static const char* LOG_TAG = "IdleSleep";
+
+static gpio_num_t wake_pin = GPIO_NUM_MAX;
+static int wake_level = 0;
+
+void idle_sleep_set_wake_pin(int pin, int active_level)
+{
+	if (pin < 0) {
+		wake_pin = GPIO_NUM_MAX;
+		return;
+	}
+	wake_pin = (gpio_num_t) pin;
+	wake_level = active_level;
+	gpio_set_direction(wake_pin, GPIO_MODE_INPUT);
+	gpio_set_pull_mode(wake_pin, active_level ? GPIO_PULLDOWN_ONLY : GPIO_PULLUP_ONLY);
+}
+
+bool idle_sleep(uint32_t ms)
+{
+	if (ms == 0) {
+		return false;
+	}
+	esp_sleep_enable_timer_wakeup((uint64_t) ms * 1000);
+	if (wake_pin != GPIO_NUM_MAX) {
+		gpio_wakeup_enable(wake_pin, wake_level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+		esp_sleep_enable_gpio_wakeup();
+	}
+
+	// the UART stops with the APB clock; let the last log lines out first
+	uart_tx_wait_idle(CONFIG_CONSOLE_UART_NUM);
+	int64_t started = esp_timer_get_time();
+	esp_err_t err = esp_light_sleep_start();
+
+	if (wake_pin != GPIO_NUM_MAX) {
+		gpio_wakeup_disable(wake_pin);
+	}
+	if (err != ESP_OK) {
+		ESP_LOGW(LOG_TAG, "Light sleep refused: %d, waiting awake", err);
+		vTaskDelay(ms / portTICK_PERIOD_MS);
+		return false;
+	}
+	bool woken = (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO);
+	ESP_LOGD(LOG_TAG, "Slept %u ms%s", (uint32_t) ((esp_timer_get_time() - started) / 1000),
+			woken ? ", woken by the pin" : "");
+	return woken;
+}
@@ -0,0 +1,30 @@
+/*
+ * IdleSleep.h - light sleep while the unit waits for the next pour.
+ *
+ * idle_sleep() puts the whole chip in light sleep until a timeout or the
+ * wake pin, e.g. a "pour now" button, reads its active level.  Both CPUs,
+ * every task and the step and LEDC timers stop, RAM and the GPIO output
+ * levels are kept, and everything carries on where it was afterwards.  So
+ * the caller must first make sure nothing needs to run meanwhile: motors
+ * stopped and released, the heater switched off.
+ *
+ * The FreeRTOS tick count does not advance while asleep, only esp_timer time
+ * does.  The console cannot wake the unit; characters typed while it sleeps
+ * are lost.  If light sleep is not possible, e.g. with Wi-Fi running, it
+ * falls back to vTaskDelay().
+ */
+
+// ensure this library description is only included once
+#ifndef IdleSleep_h
+#define IdleSleep_h
+
+#include <stdint.h>
+
+// GPIO that ends idle_sleep() when it reads active_level, or -1 for none.
+// The pin is made an input, pulled towards the inactive level.
+void idle_sleep_set_wake_pin(int pin, int active_level);
+
+// Sleeps for up to ms; returns true if the wake pin ended it early.
+bool idle_sleep(uint32_t ms);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * LoadCell.cpp - weight and flow from a load cell on an HX711.
+ */
+
+#include <esp_log.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include "driver/gpio.h"
+#include "rom/ets_sys.h"
+#include "hrclock.h"
+#include "load_cell.h"
+
+#define HX711_GAIN_PULSES 1             // after the 24 data bits: channel A, gain 128
+#define HX711_MAX 0x7fffff              // reading when the input is out of range
+#define HX711_MIN (-0x800000)
+
+static const char* LOG_TAG = "LoadCell";
+
+// bit banging the conversion out must not be interrupted
+static portMUX_TYPE read_mux = portMUX_INITIALIZER_UNLOCKED;
+
+LoadCell::LoadCell(int dout_pin, int sck_pin)
+{
+	this->dout_pin = dout_pin;
+	this->sck_pin = sck_pin;
+	this->counts_per_gram = 1.0f;
+	this->callback = NULL;
+	this->callback_arg = NULL;
+	this->waiter = NULL;
+	this->history_count = 0;
+	this->history_next = 0;
+	this->estimate = 0;
+	this->rate = 0;
+	this->offset = 0;
+	this->tare_requested = true;
+	this->sensor_ok = false;
+	this->weight_mg = 0;
+	this->flow_mg_s = 0;
+	this->tared_counts = 0;
+}
+
+void LoadCell::setScale(float counts_per_gram)
+{
+	if (counts_per_gram == 0) {
+		ESP_LOGE(LOG_TAG, "Scale of 0 counts per gram ignored");
+		return;
+	}
+	this->counts_per_gram = counts_per_gram;
+}
+
+void LoadCell::setCallback(LoadCellCallback callback, void *arg)
+{
+	this->callback = callback;
+	this->callback_arg = arg;
+}
+
+/*
+ * SCK idles low, which also wakes the HX711 if it was powered down.  The
+ * data ready edge stays disabled until the task waits for it.
+ */
+bool LoadCell::start(UBaseType_t priority, BaseType_t core)
+{
+	if (this->sample_task.task() != NULL) {
+		return true;
+	}
+	gpio_config_t io_conf;
+	io_conf.intr_type = GPIO_INTR_DISABLE;
+	io_conf.mode = GPIO_MODE_OUTPUT;
+	io_conf.pin_bit_mask = (1ULL<<this->sck_pin);
+	io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+	io_conf.pull_up_en = GPIO_PULLUP_DISABLE;
+	gpio_config(&io_conf);
+	gpio_set_level((gpio_num_t) this->sck_pin, 0);
+
+	io_conf.intr_type = GPIO_INTR_NEGEDGE;
+	io_conf.mode = GPIO_MODE_INPUT;
+	io_conf.pin_bit_mask = (1ULL<<this->dout_pin);
+	gpio_config(&io_conf);
+	gpio_intr_disable((gpio_num_t) this->dout_pin);
+
+	// the service may already be installed by a limit switch
+	esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+	if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+		ESP_LOGE(LOG_TAG, "Failed to install GPIO ISR service: %d", err);
+		return false;
+	}
+	err = gpio_isr_handler_add((gpio_num_t) this->dout_pin, &LoadCell::onDataReady, this);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to add data ready handler: %d", err);
+		return false;
+	}
+	return this->sample_task.start(&LoadCell::task, "loadcell", this, priority, core);
+}
+
+void LoadCell::task(void *arg)
+{
+	((LoadCell *) arg)->run();
+}
+
+/*
+ * DOUT falling: a conversion is ready.  Only wakes the task, which may not
+ * have stored its handle yet on the very first edge.
+ */
+void IRAM_ATTR LoadCell::onDataReady(void *arg)
+{
+	TaskHandle_t waiter = ((LoadCell *) arg)->waiter;
+	if (waiter == NULL) {
+		return;
+	}
+	BaseType_t higher_priority_woken = pdFALSE;
+	vTaskNotifyGiveFromISR(waiter, &higher_priority_woken);
+	if (higher_priority_woken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+/*
+ * The sampling loop.  The edge interrupt is only enabled while waiting, as
+ * DOUT toggles with every bit clocked out.  DOUT is checked after every
+ * wake-up and every short timeout, so neither an edge that came before
+ * the interrupt was enabled nor a stray wake-up is mistaken for anything.
+ */
+void LoadCell::run(void)
+{
+	const gpio_num_t dout = (gpio_num_t) this->dout_pin;
+	const TickType_t poll = 3 * 1000 / LOADCELL_SAMPLE_RATE / portTICK_PERIOD_MS + 1;
+	const int64_t timeout_us = LOADCELL_TIMEOUT_MS * 1000LL;
+	this->waiter = xTaskGetCurrentTaskHandle();
+	int64_t last_sample = hrclock_now_us();
+
+	while (1) {
+		gpio_intr_enable(dout);
+		if (gpio_get_level(dout) != 0) {
+			ulTaskNotifyTake(pdTRUE, poll);
+		}
+		gpio_intr_disable(dout);
+
+		int64_t now = hrclock_now_us();
+		if (gpio_get_level(dout) != 0) {
+			if (this->sensor_ok && now - last_sample > timeout_us) {
+				ESP_LOGE(LOG_TAG, "HX711 not answering");
+				this->sensor_ok = false;
+				if (this->callback != NULL) {
+					LoadCellSample sample = { this->weight_mg, 0, false };
+					this->callback(sample, this->callback_arg);
+				}
+			}
+			continue;
+		}
+
+		int32_t raw = this->readConversion();
+		bool gap = now - last_sample > timeout_us;
+		float dt = (now - last_sample) / 1e6f;
+		last_sample = now;
+		if (raw == HX711_MAX || raw == HX711_MIN) {
+			continue;
+		}
+		if (!this->sensor_ok || gap) {
+			// start afresh rather than track across the gap, e.g. a light sleep
+			if (!this->sensor_ok) {
+				ESP_LOGI(LOG_TAG, "HX711 answering");
+			}
+			this->history_count = 0;
+			this->sensor_ok = true;
+		}
+		this->filter(raw, dt);
+
+		if (this->callback != NULL) {
+			LoadCellSample sample = { this->weight_mg, this->flow_mg_s, true };
+			this->callback(sample, this->callback_arg);
+		}
+	}
+}
+
+/*
+ * Clocks out the 24 bit two's complement reading, MSB first, plus the
+ * pulses that select the next conversion.  DOUT changes on the rising edge
+ * of SCK and is read while SCK is high.  About 50 us with interrupts off.
+ */
+int32_t LoadCell::readConversion(void)
+{
+	const gpio_num_t dout = (gpio_num_t) this->dout_pin;
+	const gpio_num_t sck = (gpio_num_t) this->sck_pin;
+	uint32_t value = 0;
+
+	portENTER_CRITICAL(&read_mux);
+	for (int i = 0; i < 24 + HX711_GAIN_PULSES; i++) {
+		gpio_set_level(sck, 1);
+		ets_delay_us(1);
+		if (i < 24) {
+			value = (value << 1) | (gpio_get_level(dout) ? 1 : 0);
+		}
+		gpio_set_level(sck, 0);
+		ets_delay_us(1);
+	}
+	portEXIT_CRITICAL(&read_mux);
+
+	// sign extend from 24 bits
+	return (int32_t) (value << 8) >> 8;
+}
+
+/*
+ * Median of three into an alpha-beta tracker: predict the weight from the
+ * last rate, then move weight and rate towards the reading by fixed shares
+ * of the residual.  dt is measured, as the HX711 runs off its own
+ * oscillator.  The first readings after a start or gap seed the tracker.
+ */
+void LoadCell::filter(int32_t raw, float dt)
+{
+	this->history[this->history_next] = raw;
+	this->history_next = (this->history_next + 1) % 3;
+	if (this->history_count < 3) {
+		this->history_count++;
+		this->estimate = raw;
+		this->rate = 0;
+		return;
+	}
+
+	int32_t a = this->history[0], b = this->history[1], c = this->history[2];
+	int32_t median = a > b ? (b > c ? b : (a > c ? c : a)) : (a > c ? a : (b > c ? c : b));
+
+	float predicted = this->estimate + this->rate * dt;
+	float residual = median - predicted;
+	this->estimate = predicted + LOADCELL_ALPHA * residual;
+	if (dt > 0) {
+		this->rate += LOADCELL_BETA * residual / dt;
+	}
+
+	if (this->tare_requested) {
+		this->offset = this->estimate;
+		this->tare_requested = false;
+	}
+	float counts_per_gram = this->counts_per_gram;
+	this->tared_counts = (int32_t) lroundf(this->estimate - this->offset);
+	this->weight_mg = (int32_t) lroundf((this->estimate - this->offset) * 1000.0f / counts_per_gram);
+	this->flow_mg_s = (int32_t) lroundf(this->rate * 1000.0f / counts_per_gram);
+}
@@ -0,0 +1,102 @@
+/*
+ * LoadCell.h - weight and flow from a load cell on an HX711.
+ *
+ * The HX711 runs at 80 samples/s (RATE tied high) on channel A with a gain
+ * of 128.  Its DOUT pin falls when a conversion is ready; that edge wakes a
+ * dedicated task, which clocks the 24 bits out with interrupts off on its
+ * core (SCK held high for more than 60 us powers the chip down), and then
+ * filters the stream one sample at a time:
+ *
+ *  - a median of the last three readings drops single spikes, e.g. from
+ *    the stream hitting the cup;
+ *  - an alpha-beta tracker follows weight and its rate of change together,
+ *    so the flow comes out of the same filter as the weight, without
+ *    differentiating noisy readings.
+ *
+ * Each filtered sample goes to an optional callback on the same task, so a
+ * controller sees it within microseconds of the conversion.  If DOUT does
+ * not fall for LOADCELL_TIMEOUT_MS the samples are marked bad until it
+ * does again.
+ *
+ * The cell is zeroed with tare() and scaled with setScale() in raw counts
+ * per gram, negative if the bridge is wired the other way round.
+ */
+
+// ensure this library description is only included once
+#ifndef LoadCell_h
+#define LoadCell_h
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "static_task.h"
+
+#define LOADCELL_SAMPLE_RATE 80         // samples/s with RATE high
+#define LOADCELL_TIMEOUT_MS 200         // no conversion for this long: sensor lost
+#define LOADCELL_ALPHA 0.1f             // share of each residual taken into the weight
+#define LOADCELL_BETA 0.005f            // and into the flow
+#define LOADCELL_TASK_STACK_SIZE 2048
+
+// One filtered sample.
+struct LoadCellSample {
+  int32_t weight;             // mg above the tare
+  int32_t flow;               // mg/s, positive while the weight goes up
+  bool ok;                    // false while the HX711 is not answering
+};
+
+typedef void (*LoadCellCallback)(const LoadCellSample &sample, void *arg);
+
+class LoadCell {
+  public:
+    LoadCell(int dout_pin, int sck_pin);
+
+    // Raw counts for one gram (see above).
+    void setScale(float counts_per_gram);
+    // Called from the load cell task after every sample; set before start().
+    void setCallback(LoadCellCallback callback, void *arg);
+
+    // Sets up the pins and the data ready interrupt and starts the task.
+    // Returns false if any of it failed.
+    bool start(UBaseType_t priority, BaseType_t core);
+
+    // The next sample becomes zero.
+    void tare(void) { this->tare_requested = true; }
+
+    // Latest filtered values; counts() is above the tare, unscaled, for
+    // working out the scale with a known weight.
+    float weight(void) const { return this->weight_mg / 1000.0f; }
+    float flow(void) const { return this->flow_mg_s / 1000.0f; }
+    int32_t counts(void) const { return this->tared_counts; }
+    bool isOk(void) const { return this->sensor_ok; }
+
+  private:
+    static void task(void *arg);
+    static void onDataReady(void *arg);
+    void run(void);
+    int32_t readConversion(void);
+    void filter(int32_t raw, float dt);
+
+    int dout_pin;
+    int sck_pin;
+    volatile float counts_per_gram;
+    LoadCellCallback callback;
+    void *callback_arg;
+    TaskHandle_t volatile waiter;   // the load cell task, once it runs
+
+    // filter state, only touched by the task
+    int32_t history[3];             // last raw readings, for the median
+    int history_count;              // how many of them are valid
+    int history_next;               // where the next one goes
+    float estimate;                 // filtered counts
+    float rate;                     // filtered counts/s
+    float offset;                   // counts at the tare
+
+    volatile bool tare_requested;
+    volatile bool sensor_ok;
+    volatile int32_t weight_mg;
+    volatile int32_t flow_mg_s;
+    volatile int32_t tared_counts;
+    StaticTask<LOADCELL_TASK_STACK_SIZE> sample_task;
+};
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * MotionCoordinator.cpp - drives several Steppers as one coordinated move.
+ */
+
+#include <esp_log.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "soc/gpio_struct.h"
+#include "hrclock.h"
+#include "motion_coordinator.h"
+
+static const char* LOG_TAG = "MotionCoordinator";
+
+MotionCoordinator::MotionCoordinator()
+{
+	this->axis_count = 0;
+	this->step_delay = 0;
+	this->acceleration = 0;
+	this->jerk = 0;
+	this->junction_jump = 0;
+	this->rate_stretch = MOTION_RATE_FULL;
+	this->last_queued = NULL;
+	memset(this->planned_position, 0, sizeof(this->planned_position));
+	vPortCPUInitializeMutex(&this->plan_mux);
+	this->active = false;
+	this->major_steps = 0;
+	this->entry_index = 0;
+	this->exit_index = 0;
+	this->cruise_index = 0;
+	this->steps_left = 0;
+	this->steps_done = 0;
+	this->telemetry = NULL;
+}
+
+/*
+ * Adds a motor to the coordinated axes.
+ */
+int MotionCoordinator::addAxis(Stepper *stepper)
+{
+	if (this->axis_count == MOTION_COORDINATOR_MAX_AXES) {
+		ESP_LOGE(LOG_TAG, "Already driving %d axes", MOTION_COORDINATOR_MAX_AXES);
+		return -1;
+	}
+	if (stepper->pwm_duties != NULL) {
+		ESP_LOGE(LOG_TAG, "Microstepping axes cannot be coordinated");
+		return -1;
+	}
+	stepper->coordinator_owned = true;
+	this->axes[this->axis_count] = stepper;
+	return this->axis_count++;
+}
+
+/*
+ * Sets the speed of the longest axis in steps per second
+ */
+void MotionCoordinator::setMaxSpeed(long steps_per_second)
+{
+	this->step_delay = 1000L * 1000L / steps_per_second;
+	this->updateProfile();
+}
+
+void MotionCoordinator::setAcceleration(long steps_per_second_2)
+{
+	this->acceleration = steps_per_second_2;
+	this->updateProfile();
+}
+
+void MotionCoordinator::setJerk(long steps_per_second_3)
+{
+	this->jerk = steps_per_second_3;
+	this->updateProfile();
+}
+
+/*
+ * Sets how abruptly any one axis may change speed where two segments
+ * meet.  The planner slows the junction down until no axis jumps by more.
+ */
+void MotionCoordinator::setJunctionJump(long steps_per_second)
+{
+	this->junction_jump = (float) steps_per_second;
+}
+
+/*
+ * The ISR multiplies by the inverse, so a tick costs a 32 x 32 bit multiply
+ * rather than a division.  A single word write, so no lock is needed.
+ */
+void MotionCoordinator::setRateScale(uint32_t scale)
+{
+	if (scale > MOTION_RATE_FULL) {
+		scale = MOTION_RATE_FULL;
+	} else if (scale < MOTION_RATE_MIN) {
+		scale = MOTION_RATE_MIN;
+	}
+	this->rate_stretch = (uint32_t) (((uint64_t) MOTION_RATE_FULL << MOTION_RATE_SHIFT) / scale);
+}
+
+void MotionCoordinator::updateProfile(void)
+{
+	if (this->completion.isRunning()) {
+		ESP_LOGW(LOG_TAG, "Profile change ignored while moving");
+		return;
+	}
+	this->profile.configure(this->step_delay, this->acceleration, this->jerk);
+}
+
+/*
+ * Moves every axis by its entry in steps and blocks until they are done.
+ */
+void MotionCoordinator::move(const int *steps)
+{
+	if (this->moveAsync(steps)) {
+		this->waitForCompletion(portMAX_DELAY);
+	}
+}
+
+/*
+ * Starts a single coordinated move and returns immediately.
+ *
+ * Returns false if a move is already running, an axis is busy on its own,
+ * or no timer is available.
+ */
+bool MotionCoordinator::moveAsync(const int *steps)
+{
+	if (this->completion.isRunning()) {
+		ESP_LOGW(LOG_TAG, "Move already in progress");
+		return false;
+	}
+	return this->queueMove(steps, 0);
+}
+
+/*
+ * Appends a segment to the motion queue, replans the junction speeds of
+ * everything not yet started and kicks off the step timer if it was idle.
+ */
+bool MotionCoordinator::queueMove(const int *steps, long steps_per_second)
+{
+	if (this->queue.full()) {
+		return false;
+	}
+	if (!this->timer.attach(&MotionCoordinator::onStepTimer, this)) {
+		ESP_LOGE(LOG_TAG, "No step timer available, not moving");
+		return false;
+	}
+
+	for (int i = 0; i < this->axis_count; i++) {
+		if (this->axes[i]->isRunning()) {
+			ESP_LOGW(LOG_TAG, "Axis %d is moving on its own", i);
+			return false;
+		}
+		if (this->axes[i]->stalled()) {
+			ESP_LOGW(LOG_TAG, "Axis %d has stalled", i);
+			return false;
+		}
+	}
+
+	MotionSegment *segment = this->queue.back();
+	uint32_t major = 0;
+	for (int i = 0; i < MOTION_MAX_AXES; i++) {
+		segment->steps[i] = (i < this->axis_count) ? steps[i] : 0;
+		uint32_t distance = abs(segment->steps[i]);
+		if (distance > major) {
+			major = distance;
+		}
+	}
+	if (major == 0) {
+		return true;
+	}
+
+	// soft limits apply to where each axis will be once everything queued
+	// so far has run; with nothing queued, that is where it is now
+	if (!this->active) {
+		for (int i = 0; i < this->axis_count; i++) {
+			this->planned_position[i] = this->axes[i]->currentPosition();
+		}
+	}
+	for (int i = 0; i < this->axis_count; i++) {
+		if (!this->axes[i]->withinSoftLimits(this->planned_position[i] + segment->steps[i])) {
+			ESP_LOGW(LOG_TAG, "Axis %d would leave its soft limits", i);
+			return false;
+		}
+	}
+	segment->length = major;
+
+	uint32_t delay = this->step_delay;
+	if (steps_per_second > 0 && 1000000L / steps_per_second > (long) delay) {
+		delay = 1000000L / steps_per_second;
+	}
+	segment->cruise_index = this->profile.indexForDelay(delay);
+
+	// junction limit: no axis may change speed by more than junction_jump
+	// (in steps/s) where this segment meets the previous one
+	segment->max_entry_index = 0;
+	MotionSegment *previous = this->last_queued;
+	if (previous != NULL) {
+		float limit = HUGE_VALF;
+		for (int i = 0; i < this->axis_count; i++) {
+			// per-axis speeds as a fraction of the longest axis' speed
+			float change = fabsf((float) previous->steps[i] / previous->length
+					- (float) segment->steps[i] / segment->length);
+			if (change > 0 && this->junction_jump / change < limit) {
+				limit = this->junction_jump / change;
+			}
+		}
+		uint32_t index = previous->cruise_index < segment->cruise_index
+				? previous->cruise_index : segment->cruise_index;
+		if (limit < 1.0f) {
+			index = 0;
+		} else if (limit < 1000000.0f) {
+			uint32_t limit_index = this->profile.indexForDelay((uint32_t) (1000000.0f / limit));
+			if (limit_index < index) {
+				index = limit_index;
+			}
+		}
+		segment->max_entry_index = index;
+	}
+	segment->entry_index = 0;
+
+	portENTER_CRITICAL(&this->plan_mux);
+	this->queue.push();
+	this->last_queued = segment;
+	for (int i = 0; i < this->axis_count; i++) {
+		this->planned_position[i] += segment->steps[i];
+	}
+	bool start = !this->active;
+	this->active = true;
+	this->replan();
+	portEXIT_CRITICAL(&this->plan_mux);
+
+	if (start) {
+		// powers up released coils and restarts their hold timeouts, which
+		// hold off until the queue runs dry; the first step comes a whole
+		// ramp delay later, so they have settled
+		for (int i = 0; i < this->axis_count; i++) {
+			this->axes[i]->coordinated = true;
+			this->axes[i]->energize();
+		}
+		// the ISR was idle, so nothing else touches the current segment
+		this->completion.start();
+		this->beginSegment(false);
+		this->timer.start(this->currentDelay());
+	}
+	return true;
+}
+
+/*
+ * Look-ahead planning, called with plan_mux held.  The entry speed of every
+ * segment not yet started is raised as far as allowed:
+ *  - backwards: each entry must leave room to slow down to the next entry
+ *    (or to rest after the last segment) within the segment's length;
+ *  - forwards: each entry must be reachable by speeding up from the
+ *    previous entry within the previous segment's length.
+ * The exit of the segment being executed may still be raised as long as it
+ * has not started slowing down for the old one.
+ */
+void MotionCoordinator::replan(void)
+{
+	uint32_t head = this->queue.headPosition();
+	uint32_t tail = this->queue.tailPosition();
+	uint32_t first;
+	bool update_exit = false;
+	if (this->steps_left > 0) {
+		uint32_t index = this->entry_index + this->steps_done;
+		if (this->cruise_index < index) {
+			index = this->cruise_index;
+		}
+		update_exit = this->exit_index + this->steps_left - 1 >= index;
+		first = tail + (update_exit ? 1 : 2);
+	} else if (this->queue.size() > 1) {
+		// the tail has just finished and the ISR is about to pop it
+		first = tail + 2;
+	} else {
+		// a fresh start begins from rest
+		this->queue.at(tail)->entry_index = 0;
+		first = tail + 1;
+	}
+	int32_t count = (int32_t) (head - first);
+
+	uint32_t next_entry = 0;
+	for (int32_t i = count - 1; i >= 0; i--) {
+		MotionSegment *segment = this->queue.at(first + i);
+		uint32_t entry = next_entry + segment->length;
+		if (entry > segment->max_entry_index) {
+			entry = segment->max_entry_index;
+		}
+		segment->entry_index = entry;
+		next_entry = entry;
+	}
+	for (int32_t i = 0; i < count; i++) {
+		MotionSegment *previous = this->queue.at(first + i - 1);
+		MotionSegment *segment = this->queue.at(first + i);
+		uint32_t reachable = previous->entry_index + previous->length;
+		if (segment->entry_index > reachable) {
+			segment->entry_index = reachable;
+		}
+	}
+	if (update_exit && count > 0) {
+		this->exit_index = this->queue.at(first)->entry_index;
+	}
+}
+
+/*
+ * Loads the segment at the front of the queue into the Bresenham state,
+ * first popping the one just finished if finished is set.  Returns false,
+ * and marks the coordinator idle, when the queue has run dry.
+ */
+bool IRAM_ATTR MotionCoordinator::beginSegment(bool finished)
+{
+	portENTER_CRITICAL_ISR(&this->plan_mux);
+	if (finished) {
+		this->queue.pop();
+	}
+	if (this->queue.empty()) {
+		this->active = false;
+		this->last_queued = NULL;
+		portEXIT_CRITICAL_ISR(&this->plan_mux);
+		return false;
+	}
+	MotionSegment *segment = this->queue.front();
+	this->entry_index = segment->entry_index;
+	this->exit_index = (this->queue.size() > 1)
+			? this->queue.at(this->queue.tailPosition() + 1)->entry_index : 0;
+	// from here on replan() treats this segment as executing
+	this->steps_left = segment->length;
+	portEXIT_CRITICAL_ISR(&this->plan_mux);
+
+	this->cruise_index = segment->cruise_index;
+	this->major_steps = segment->length;
+	this->steps_done = 0;
+	for (int i = 0; i < this->axis_count; i++) {
+		int32_t steps = segment->steps[i];
+		if (steps > 0) { this->axes[i]->direction = 1; }
+		if (steps < 0) { this->axes[i]->direction = 0; }
+		this->distance[i] = abs(steps);
+		this->error[i] = this->major_steps / 2;
+	}
+	return true;
+}
+
+/*
+ * Drops the segment being executed and everything queued behind it.
+ */
+void IRAM_ATTR MotionCoordinator::abortQueue(void)
+{
+	portENTER_CRITICAL_ISR(&this->plan_mux);
+	this->queue.discard();
+	this->active = false;
+	this->last_queued = NULL;
+	this->steps_left = 0;
+	portEXIT_CRITICAL_ISR(&this->plan_mux);
+}
+
+int MotionCoordinator::stalledAxis(void) const
+{
+	for (int i = 0; i < this->axis_count; i++) {
+		if (this->axes[i]->stalled()) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Interval before the next tick: accelerate from the entry speed, hold the
+ * cruise speed and decelerate to the exit speed, whichever is slowest,
+ * stretched by the rate scale.
+ */
+uint32_t IRAM_ATTR MotionCoordinator::currentDelay(void) const
+{
+	uint32_t index = this->entry_index + this->steps_done;
+	uint32_t to_exit = this->exit_index + this->steps_left - 1;
+	if (to_exit < index) {
+		index = to_exit;
+	}
+	if (this->cruise_index < index) {
+		index = this->cruise_index;
+	}
+	return (uint32_t) (((uint64_t) this->profile.delayAt(index) * this->rate_stretch)
+			>> MOTION_RATE_SHIFT);
+}
+
+/*
+ * Step timer callback, runs in ISR context.
+ */
+uint32_t IRAM_ATTR MotionCoordinator::onStepTimer(void *arg)
+{
+	return ((MotionCoordinator *) arg)->isrStep();
+}
+
+/*
+ * Takes one tick of the current segment: steps every axis whose Bresenham
+ * error term says so, then writes all of their coils at once.  Moves on to
+ * the next queued segment without a pause when this one is done.
+ */
+uint32_t IRAM_ATTR MotionCoordinator::isrStep(void)
+{
+	int64_t now = hrclock_now_us();
+	uint32_t set_low = 0, clear_low = 0, set_high = 0, clear_high = 0;
+	bool stalled = false;
+
+	for (int i = 0; i < this->axis_count; i++) {
+		this->error[i] -= this->distance[i];
+		if (this->error[i] < 0) {
+			this->error[i] += this->major_steps;
+			Stepper *axis = this->axes[i];
+			const CoilPattern *pattern = axis->takeCoordinatedStep(now);
+			set_low |= pattern->set_low;
+			clear_low |= pattern->clear_low;
+			set_high |= pattern->set_high;
+			clear_high |= pattern->clear_high;
+			if (axis->feedback != NULL && !axis->checkFeedback()) {
+				stalled = true;
+			}
+		}
+	}
+
+	GPIO.out_w1tc = clear_low;
+	GPIO.out_w1ts = set_low;
+	if (set_high | clear_high) {
+		GPIO.out1_w1tc.val = clear_high;
+		GPIO.out1_w1ts.val = set_high;
+	}
+
+	this->steps_left--;
+	this->steps_done++;
+	uint32_t next = 0;
+	if (stalled) {
+		this->abortQueue();
+	} else if (this->steps_left > 0 || this->beginSegment(true)) {
+		next = this->currentDelay();
+	}
+
+	if (this->telemetry != NULL) {
+		MotionTelemetry state;
+		state.steps_left = this->steps_left;
+		state.step_interval_us = next;
+		state.last_step_time = now;
+		for (int i = 0; i < MOTION_MAX_AXES; i++) {
+			state.position[i] = i < this->axis_count ? this->axes[i]->position : 0;
+		}
+		this->telemetry->write(state);
+	}
+
+	if (next == 0) {
+		for (int i = 0; i < this->axis_count; i++) {
+			this->axes[i]->coordinated = false;
+		}
+		this->completion.finishFromISR();
+	}
+	return next;
+}
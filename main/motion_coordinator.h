@@ -0,0 +1,136 @@
+/*
+ * MotionCoordinator.h - drives several Steppers as one coordinated move.
+ *
+ * All axes are paced by a single StepTimer.  Each tick steps the axis with
+ * the longest move, and a Bresenham error term per axis decides whether
+ * each other axis steps on the same tick.  That way every axis starts and
+ * finishes together and its average speed is in proportion to its distance.
+ * The coil masks of all axes that step on a tick are merged and written in
+ * one GPIO register update.
+ *
+ * Moves are segments in a MotionQueue that the step ISR works through back
+ * to back.  Whenever a segment is queued, the planner looks ahead over every
+ * segment that has not started yet and plans the speed at each junction as
+ * high as the segments on either side, the junction limit and the distance
+ * left to stop allow.  Consecutive segments in the same direction therefore
+ * run through without slowing down.
+ *
+ * The acceleration ramp applies to the longest axis; the others follow it
+ * in proportion.  Axes must use on/off coil sequences (not MICROSTEP modes)
+ * and must not be moved on their own while a coordinated move runs.
+ *
+ * Each axis keeps counting its absolute position, and segments that would
+ * take an axis past its soft limits are refused when queued.  Limit
+ * switches only stop an axis' own moves and home(), not coordinated moves.
+ * An axis with encoder feedback that stalls stops every axis at once and
+ * throws away the rest of the queue; nothing more is queued until the
+ * axis is synchronised with its encoder again.
+ *
+ * setRateScale() slows every step down by the same factor from the next
+ * tick on, e.g. for the flow controller, without replanning: going slower
+ * than planned never needs more room to stop, so it can change at any
+ * time, but it is never allowed to go faster.
+ */
+
+// ensure this library description is only included once
+#ifndef MotionCoordinator_h
+#define MotionCoordinator_h
+
+#include <stdint.h>
+#include "stepper.h"
+#include "step_timer.h"
+#include "motion_profile.h"
+#include "motion_queue.h"
+#include "move_completion.h"
+#include "telemetry.h"
+
+#define MOTION_COORDINATOR_MAX_AXES MOTION_MAX_AXES
+// Binary point of the rate scale, and how far it may slow the planned rate.
+#define MOTION_RATE_SHIFT 16
+#define MOTION_RATE_FULL (1UL << MOTION_RATE_SHIFT)
+#define MOTION_RATE_MIN (MOTION_RATE_FULL / 16)
+
+class MotionCoordinator {
+  public:
+    MotionCoordinator();
+
+    // Adds a motor, returning its axis index or -1 if it cannot be added.
+    int addAxis(Stepper *stepper);
+    int axisCount(void) const { return this->axis_count; }
+
+    // speed, acceleration and jerk of the longest axis, in its steps:
+    void setMaxSpeed(long steps_per_second);
+    void setAcceleration(long steps_per_second_2);
+    void setJerk(long steps_per_second_3);
+    // largest sudden speed change any axis may see at a junction between
+    // segments, in steps/s; 0 only blends segments in exactly the same direction:
+    void setJunctionJump(long steps_per_second);
+    // every step rate times scale / MOTION_RATE_FULL, clamped to
+    // MOTION_RATE_MIN..MOTION_RATE_FULL; safe to call while moving:
+    void setRateScale(uint32_t scale);
+
+    // steps[i] is the signed distance for axis i; blocks until done:
+    void move(const int *steps);
+
+    // non-blocking mover methods:
+    bool moveAsync(const int *steps);
+    bool isRunning(void) const { return this->completion.isRunning(); }
+    bool waitForCompletion(TickType_t timeout) { return this->completion.wait(timeout); }
+    void setCompletionEventGroup(EventGroupHandle_t group, EventBits_t bits) {
+      this->completion.setEventGroup(group, bits);
+    }
+
+    // Appends a segment to the motion queue and starts it if idle.  The
+    // longest axis cruises at up to steps_per_second (0 for the max speed).
+    // Returns false if the queue is full.
+    bool queueMove(const int *steps, long steps_per_second);
+    uint32_t queueSpace(void) const { return MOTION_QUEUE_LENGTH - this->queue.size(); }
+    // index of the first axis that has stalled, or -1:
+    int stalledAxis(void) const;
+
+    // snapshot the step ISR updates after every tick, or NULL for none:
+    void setTelemetry(MotionTelemetrySnapshot *snapshot) { this->telemetry = snapshot; }
+    // step timing instrumentation, or NULL for none; set while stopped:
+    void setTimingTrace(StepTimingTrace *trace) { this->timer.setTrace(trace); }
+
+  private:
+    static uint32_t onStepTimer(void *arg);
+    uint32_t isrStep(void);
+    bool beginSegment(bool finished);
+    void abortQueue(void);
+    uint32_t currentDelay(void) const;
+    void replan(void);
+    void updateProfile(void);
+
+    Stepper *axes[MOTION_COORDINATOR_MAX_AXES];
+    int axis_count;
+
+    uint32_t step_delay;      // cruise delay between steps of the longest axis, in us
+    long acceleration;        // steps/s^2 of the longest axis, 0 for constant speed
+    long jerk;                // steps/s^3 of the longest axis, 0 for trapezoidal ramps
+    float junction_jump;      // steps/s an axis may jump at a junction
+    volatile uint32_t rate_stretch; // step delay multiplier, Q16, 1/rate scale
+
+    MotionQueue queue;              // planned segments, popped by the ISR
+    MotionSegment *last_queued;     // most recently pushed segment, for junctions
+    int32_t planned_position[MOTION_COORDINATOR_MAX_AXES]; // axis positions at the end of the queue
+    portMUX_TYPE plan_mux;          // guards entry speeds and active between planner and ISR
+    bool active;                    // ISR is working through the queue
+
+    // the segment being executed:
+    int32_t distance[MOTION_COORDINATOR_MAX_AXES]; // |steps| per axis
+    int32_t error[MOTION_COORDINATOR_MAX_AXES];    // Bresenham error terms
+    int32_t major_steps;      // steps of the longest axis
+    uint32_t entry_index;     // ramp index at the first step
+    uint32_t exit_index;      // ramp index at the last step
+    uint32_t cruise_index;    // ramp index cap
+
+    StepTimer timer;                  // paces every axis from one alarm ISR
+    MotionProfile profile;            // step intervals of the longest axis
+    volatile uint32_t steps_left;     // ticks remaining in the current segment
+    volatile uint32_t steps_done;     // ticks taken so far in the current segment
+    MoveCompletion completion;        // wakes waiters when the queue runs dry
+    MotionTelemetrySnapshot *telemetry; // optional published state
+};
+
+#endif
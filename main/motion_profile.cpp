@@ -0,0 +1,125 @@
+/*
+ * MotionProfile.cpp - precomputed acceleration ramps for stepper moves.
+ */
+
+#include <esp_log.h>
+#include <math.h>
+#include "deferred_log.h"
+#include "motion_profile.h"
+
+// Integration step used to tabulate S-curve ramps, in seconds.
+#define MOTION_PROFILE_SCURVE_DT 20e-6f
+
+static const char* LOG_TAG = "MotionProfile";
+
+MotionProfile::MotionProfile()
+{
+	this->ramp_length = 0;
+	this->cruise_delay = 0;
+}
+
+/*
+ * Tabulates the step intervals from standstill up to cruise speed.
+ */
+void MotionProfile::configure(uint32_t cruise_delay, long acceleration, long jerk)
+{
+	this->cruise_delay = cruise_delay;
+	this->ramp_length = 0;
+	if (acceleration <= 0 || cruise_delay == 0) {
+		// no ramp, every step is taken at cruise speed
+		return;
+	}
+
+	const float accel = (float) acceleration;
+	const float max_speed = 1000000.0f / (float) cruise_delay; // steps/s
+	bool ramp_done = false;
+
+	if (jerk <= 0) {
+		// constant acceleration: step n is reached at t = sqrt(2n / a)
+		float last_time = 0;
+		for (uint32_t n = 1; !ramp_done && n <= MOTION_PROFILE_TABLE_SIZE; n++) {
+			float time = sqrtf(2.0f * (float) n / accel);
+			ramp_done = !this->appendRampStep(time - last_time);
+			last_time = time;
+		}
+	} else {
+		// jerk limited: ramp the acceleration up, hold it, then ramp it back
+		// down so that it reaches zero exactly at cruise speed
+		const float j = (float) jerk;
+		float peak = accel;
+		if (peak * peak > max_speed * j) {
+			// cruise speed is reached before the acceleration limit
+			peak = sqrtf(max_speed * j);
+		}
+		const float jerk_time = peak / j;
+		const float hold_time = (max_speed - peak * peak / j) / peak;
+		const float end_time = 2.0f * jerk_time + hold_time;
+
+		float t = 0, a = 0, v = 0, x = 0;
+		float last_time = 0;
+		float next_position = 1.0f;
+		while (!ramp_done && t < end_time) {
+			float t_next = t + MOTION_PROFILE_SCURVE_DT;
+			float a_next;
+			if (t_next < jerk_time)
+				a_next = j * t_next;
+			else if (t_next < jerk_time + hold_time)
+				a_next = peak;
+			else
+				a_next = fmaxf(0.0f, peak - j * (t_next - jerk_time - hold_time));
+			float v_next = v + 0.5f * (a + a_next) * MOTION_PROFILE_SCURVE_DT;
+			float x_next = x + 0.5f * (v + v_next) * MOTION_PROFILE_SCURVE_DT;
+
+			// record every step boundary crossed during this slice
+			while (!ramp_done && x_next >= next_position) {
+				float crossing = t + MOTION_PROFILE_SCURVE_DT * (next_position - x) / (x_next - x);
+				ramp_done = !this->appendRampStep(crossing - last_time);
+				last_time = crossing;
+				next_position += 1.0f;
+			}
+			t = t_next;
+			a = a_next;
+			v = v_next;
+			x = x_next;
+		}
+	}
+
+	if (this->ramp_length == MOTION_PROFILE_TABLE_SIZE) {
+		// ran out of table before reaching cruise speed
+		this->cruise_delay = this->table[MOTION_PROFILE_TABLE_SIZE - 1];
+		ESP_LOGW(LOG_TAG, "Ramp longer than %d steps, cruise delay capped to %u us",
+				MOTION_PROFILE_TABLE_SIZE, this->cruise_delay);
+	}
+	DLOGD(LOG_TAG, "Ramp of %u steps, first delay %u us", this->ramp_length, this->delayAt(0));
+}
+
+/*
+ * Finds the ramp index of a speed by bisecting the (decreasing) table.
+ */
+uint32_t MotionProfile::indexForDelay(uint32_t delay) const
+{
+	uint32_t low = 0, high = this->ramp_length;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (this->table[mid] <= delay) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+/*
+ * Appends one step interval to the ramp.  Returns false once the ramp has
+ * reached cruise speed or the table is full.
+ */
+bool MotionProfile::appendRampStep(float interval_s)
+{
+	uint32_t interval = (uint32_t) (interval_s * 1000000.0f + 0.5f);
+	if (interval <= this->cruise_delay) {
+		return false;
+	}
+	this->table[this->ramp_length++] = interval;
+	return this->ramp_length < MOTION_PROFILE_TABLE_SIZE;
+}
@@ -0,0 +1,65 @@
+/*
+ * MotionProfile.h - precomputed acceleration ramps for stepper moves.
+ *
+ * configure() tabulates the interval between consecutive steps while
+ * accelerating from standstill up to the cruise speed, either with constant
+ * acceleration (trapezoidal profile) or with limited jerk (S-curve).  All
+ * floating point work happens there, in task context.  The step ISR only
+ * indexes the table: a move uses entry min(steps taken, steps remaining), so
+ * deceleration mirrors the acceleration ramp.
+ *
+ * Indices are "ramp steps", i.e. how many steps from standstill it takes to
+ * reach a given speed.  A move entered at ramp index n is already travelling
+ * at the speed of table entry n.
+ */
+
+// ensure this library description is only included once
+#ifndef MotionProfile_h
+#define MotionProfile_h
+
+#include <stdint.h>
+#include "esp_attr.h"
+
+// Longest ramp we can tabulate, in steps.  Ramps which need more steps than
+// this have their cruise speed capped to the last entry.
+#define MOTION_PROFILE_TABLE_SIZE 256
+
+class MotionProfile {
+  public:
+    MotionProfile();
+
+    // Rebuilds the ramp table.  cruise_delay is the step interval in us at
+    // full speed, acceleration is in steps/s^2 (0 for none) and jerk in
+    // steps/s^3 (0 for a plain trapezoidal ramp).
+    void configure(uint32_t cruise_delay, long acceleration, long jerk);
+
+    // Number of steps it takes to reach cruise speed from standstill.
+    uint32_t rampLength(void) const { return this->ramp_length; }
+    // Step interval in us once the ramp is done.
+    uint32_t cruiseDelay(void) const { return this->cruise_delay; }
+
+    // Step interval in us at the given ramp index.
+    inline uint32_t IRAM_ATTR delayAt(uint32_t index) const {
+      return index < this->ramp_length ? this->table[index] : this->cruise_delay;
+    }
+
+    // Lowest ramp index whose interval is at most delay, i.e. the index of
+    // the speed 1000000 / delay steps/s, capped at rampLength().
+    uint32_t indexForDelay(uint32_t delay) const;
+
+    // Interval before the next step of a symmetric move, given how many steps
+    // have been taken and how many remain (including the next one).
+    inline uint32_t IRAM_ATTR delayFor(uint32_t steps_done, uint32_t steps_left) const {
+      uint32_t to_stop = steps_left - 1;
+      return this->delayAt(steps_done < to_stop ? steps_done : to_stop);
+    }
+
+  private:
+    bool appendRampStep(float interval_s);
+
+    uint32_t table[MOTION_PROFILE_TABLE_SIZE]; // step intervals in us
+    uint32_t ramp_length;     // used entries of table
+    uint32_t cruise_delay;    // interval in us after the ramp
+};
+
+#endif
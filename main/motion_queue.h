@@ -0,0 +1,73 @@
+/*
+ * MotionQueue.h - ring buffer of planned motion segments.
+ *
+ * A single producer task pushes segments and a single consumer, the step
+ * ISR, pops them.  head is only written by the producer and tail only by
+ * the consumer, so pushing and popping need no lock.
+ *
+ * Speeds in a segment are ramp indices into the MotionProfile of the
+ * longest axis (see motion_profile.h): index n is the speed reached after
+ * accelerating for n steps from standstill.  Accelerating over L steps
+ * raises the index by L and decelerating lowers it by L, which keeps
+ * look-ahead planning to integer additions and min().
+ */
+
+// ensure this library description is only included once
+#ifndef MotionQueue_h
+#define MotionQueue_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+#define MOTION_MAX_AXES 4
+
+// Number of segments that can be queued, set in menuconfig.
+#define MOTION_QUEUE_LENGTH CONFIG_POUR_BOT_MOTION_QUEUE_LENGTH
+#if (MOTION_QUEUE_LENGTH & (MOTION_QUEUE_LENGTH - 1)) != 0
+#error "CONFIG_POUR_BOT_MOTION_QUEUE_LENGTH must be a power of two"
+#endif
+
+struct MotionSegment {
+  int32_t steps[MOTION_MAX_AXES]; // signed distance per axis
+  uint32_t length;                // steps of the longest axis
+  uint32_t cruise_index;          // ramp index of the segment's speed
+  uint32_t max_entry_index;       // junction limit with the previous segment
+  volatile uint32_t entry_index;  // planned speed at the start of the segment
+};
+
+class MotionQueue {
+  public:
+    MotionQueue() : head(0), tail(0) {}
+
+    bool empty(void) const { return this->head == this->tail; }
+    bool full(void) const { return this->head - this->tail == MOTION_QUEUE_LENGTH; }
+    uint32_t size(void) const { return this->head - this->tail; }
+
+    // producer side:
+    // the slot to fill in before push(), valid while !full()
+    MotionSegment *back(void) { return &this->segments[this->head & (MOTION_QUEUE_LENGTH - 1)]; }
+    void push(void) { this->head = this->head + 1; }
+
+    // consumer side:
+    inline MotionSegment * IRAM_ATTR front(void) {
+      return &this->segments[this->tail & (MOTION_QUEUE_LENGTH - 1)];
+    }
+    inline void IRAM_ATTR pop(void) { this->tail = this->tail + 1; }
+    // drops everything queued
+    inline void IRAM_ATTR discard(void) { this->tail = this->head; }
+
+    // position-based access for the planner; position runs from tail to head
+    uint32_t headPosition(void) const { return this->head; }
+    uint32_t tailPosition(void) const { return this->tail; }
+    inline MotionSegment * IRAM_ATTR at(uint32_t position) {
+      return &this->segments[position & (MOTION_QUEUE_LENGTH - 1)];
+    }
+
+  private:
+    MotionSegment segments[MOTION_QUEUE_LENGTH];
+    volatile uint32_t head;   // next position to push, free running
+    volatile uint32_t tail;   // next position to pop, free running
+};
+
+#endif
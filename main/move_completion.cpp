@@ -0,0 +1,89 @@
+/*
+ * MoveCompletion.cpp - hands "move finished" from a step ISR to waiting tasks.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_attr.h"
+#include "move_completion.h"
+
+MoveCompletion::MoveCompletion()
+{
+	this->running = false;
+	this->waiting_task = NULL;
+	this->done_group = NULL;  // no completion event group
+	this->done_bits = 0;
+	vPortCPUInitializeMutex(&this->mux);
+}
+
+void MoveCompletion::start(void)
+{
+	if (this->done_group != NULL) {
+		xEventGroupClearBits(this->done_group, this->done_bits);
+	}
+	this->running = true;
+}
+
+/*
+ * Blocks until the current move finishes or timeout ticks pass.
+ * Returns true if the move is done.
+ */
+bool MoveCompletion::wait(TickType_t timeout)
+{
+	portENTER_CRITICAL(&this->mux);
+	if (!this->running) {
+		portEXIT_CRITICAL(&this->mux);
+		return true;
+	}
+	this->waiting_task = xTaskGetCurrentTaskHandle();
+	portEXIT_CRITICAL(&this->mux);
+
+	if (ulTaskNotifyTake(pdTRUE, timeout) > 0) {
+		return true;
+	}
+
+	// timed out; stop the ISR from notifying us later
+	portENTER_CRITICAL(&this->mux);
+	this->waiting_task = NULL;
+	bool done = !this->running;
+	portEXIT_CRITICAL(&this->mux);
+	if (done) {
+		// the move completed right after the timeout, drop its notification
+		ulTaskNotifyTake(pdTRUE, 0);
+	}
+	return done;
+}
+
+/*
+ * Sets bits in group every time a move completes.  The bits are cleared
+ * again when the next move starts.
+ */
+void MoveCompletion::setEventGroup(EventGroupHandle_t group, EventBits_t bits)
+{
+	this->done_group = group;
+	this->done_bits = bits;
+}
+
+/*
+ * Marks the move done and wakes whoever is waiting for it.
+ */
+void IRAM_ATTR MoveCompletion::finishFromISR(void)
+{
+	portENTER_CRITICAL_ISR(&this->mux);
+	this->running = false;
+	TaskHandle_t waiter = this->waiting_task;
+	this->waiting_task = NULL;
+	portEXIT_CRITICAL_ISR(&this->mux);
+
+	BaseType_t higher_priority_woken = pdFALSE;
+	if (waiter != NULL) {
+		vTaskNotifyGiveFromISR(waiter, &higher_priority_woken);
+	}
+	if (this->done_group != NULL) {
+		xEventGroupSetBitsFromISR(this->done_group, this->done_bits, &higher_priority_woken);
+	}
+	if (higher_priority_woken) {
+		portYIELD_FROM_ISR();
+	}
+}
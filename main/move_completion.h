@@ -0,0 +1,43 @@
+/*
+ * MoveCompletion.h - hands "move finished" from a step ISR to waiting tasks.
+ *
+ * One task may block in wait() at a time; it is woken with a direct task
+ * notification.  An optional event group gets bits set too, for any number
+ * of other tasks.  The running flag and the waiting task are exchanged with
+ * the ISR under a spinlock, so a wait() that times out just as the move ends
+ * never leaves a stale notification behind.
+ */
+
+// ensure this library description is only included once
+#ifndef MoveCompletion_h
+#define MoveCompletion_h
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+class MoveCompletion {
+  public:
+    MoveCompletion();
+
+    // Marks a move as running and clears the event group bits.
+    void start(void);
+    bool isRunning(void) const { return this->running; }
+    // Blocks until the move finishes or timeout ticks pass.  Returns true if
+    // no move is running.
+    bool wait(TickType_t timeout);
+    // Bits to set in group whenever a move completes, or NULL to disable.
+    void setEventGroup(EventGroupHandle_t group, EventBits_t bits);
+
+    // Called from the step ISR after the last step.
+    void finishFromISR(void);
+
+  private:
+    volatile bool running;            // true from start() until finishFromISR()
+    TaskHandle_t waiting_task;        // task blocked in wait(), if any
+    EventGroupHandle_t done_group;    // optional completion event group
+    EventBits_t done_bits;
+    portMUX_TYPE mux;                 // guards running/waiting_task handoff with the ISR
+};
+
+#endif
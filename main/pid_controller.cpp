@@ -0,0 +1,82 @@
+/*
+ * PidController.cpp - fixed-point PID loop.
+ */
+
+#include "pid_controller.h"
+
+PidController::PidController()
+{
+	this->kp = 0;
+	this->ki = 0;
+	this->kd = 0;
+	this->output_min = 0;
+	this->output_max = 0;
+	this->reset();
+}
+
+void PidController::setGains(int32_t kp, int32_t ki, int32_t kd)
+{
+	this->kp = kp;
+	this->ki = ki;
+	this->kd = kd;
+}
+
+void PidController::setOutputLimits(int32_t min, int32_t max)
+{
+	this->output_min = min;
+	this->output_max = max;
+}
+
+void PidController::reset(void)
+{
+	this->integral = 0;
+	this->last_measurement = 0;
+	this->primed = false;
+}
+
+void PidController::preload(int32_t output)
+{
+	this->reset();
+	this->integral = (int64_t) output << PID_SHIFT;
+}
+
+/*
+ * Computes the output for one sample.  Everything is kept in output units
+ * shifted left by PID_SHIFT until the final rounding.
+ */
+int32_t PidController::update(int32_t setpoint, int32_t measurement)
+{
+	int64_t limit_min = (int64_t) this->output_min << PID_SHIFT;
+	int64_t limit_max = (int64_t) this->output_max << PID_SHIFT;
+	int32_t error = setpoint - measurement;
+
+	int64_t proportional = (int64_t) this->kp * error;
+	int64_t derivative = 0;
+	if (this->primed) {
+		derivative = -(int64_t) this->kd * (measurement - this->last_measurement);
+	}
+	this->last_measurement = measurement;
+	this->primed = true;
+
+	// conditional integration: hold the integral while saturated, unless
+	// the error would bring the output back into range
+	int64_t step = (int64_t) this->ki * error;
+	int64_t trial = proportional + this->integral + step + derivative;
+	bool saturated = (trial > limit_max && error > 0) || (trial < limit_min && error < 0);
+	if (!saturated) {
+		this->integral += step;
+	}
+	if (this->integral > limit_max) {
+		this->integral = limit_max;
+	} else if (this->integral < limit_min) {
+		this->integral = limit_min;
+	}
+
+	int64_t output = proportional + this->integral + derivative;
+	if (output > limit_max) {
+		output = limit_max;
+	} else if (output < limit_min) {
+		output = limit_min;
+	}
+	return (int32_t) ((output + (1 << (PID_SHIFT - 1))) >> PID_SHIFT);
+}
@@ -0,0 +1,56 @@
+/*
+ * PidController.h - fixed-point PID loop.
+ *
+ * Measurements, setpoints and outputs are plain integers in whatever units
+ * the caller uses (the heater feeds raw 1/16 C sensor readings and gets
+ * LEDC duty counts back).  Gains are Q16.16 fixed point and already include
+ * the sample period, so update() is integer-only and must be called at a
+ * fixed rate.
+ *
+ * The derivative acts on the measurement, not the error, so setpoint
+ * changes do not kick the output.  The integral only accumulates while the
+ * output is not saturated in the direction the error pushes it, and is
+ * clamped to the output range, which keeps it from winding up during the
+ * long full-power warm-up.
+ */
+
+// ensure this library description is only included once
+#ifndef PidController_h
+#define PidController_h
+
+#include <stdint.h>
+
+// Binary point of the gains.
+#define PID_SHIFT 16
+
+class PidController {
+  public:
+    PidController();
+
+    // Gains in output units per input unit, times 2^PID_SHIFT.  ki is per
+    // sample and kd per change over one sample.
+    void setGains(int32_t kp, int32_t ki, int32_t kd);
+    void setOutputLimits(int32_t min, int32_t max);
+
+    // Forgets the integral and the previous measurement.
+    void reset(void);
+    // Same, but starts the integral at output, so a loop whose output is an
+    // absolute level (not a correction) picks up from there.
+    void preload(int32_t output);
+
+    // One control step.  Returns the new output, within the limits.
+    int32_t update(int32_t setpoint, int32_t measurement);
+
+  private:
+    int32_t kp;
+    int32_t ki;
+    int32_t kd;
+    int32_t output_min;
+    int32_t output_max;
+
+    int64_t integral;           // integral term, in output units << PID_SHIFT
+    int32_t last_measurement;
+    bool primed;                // last_measurement is valid
+};
+
+#endif
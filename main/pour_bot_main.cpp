@@ -8,12 +8,30 @@
 */
 
 #include <esp_log.h>
+#include <stdlib.h>
 #include <string>
+#include <string.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "stepper.h"
-//#include "ds18b20.h"
+#include "motion_coordinator.h"
+#include "recipe.h"
+#include "ds18b20.h"
+#include "heater_controller.h"
+#include "load_cell.h"
+#include "flow_controller.h"
+#include "telemetry.h"
+#include "step_timing_trace.h"
+#include "console.h"
+#include "task_diagnostics.h"
+#include "deferred_log.h"
+#include "idle_sleep.h"
+#include "wifi_station.h"
+#include "control_server.h"
+#include "settings_store.h"
+#include "static_task.h"
 
 static char tag[]="pour-bot";
 
@@ -21,42 +39,409 @@ extern "C" {
 	void app_main(void);
 }
 
-const int DS_PIN = 18;
+// Defaults for the calibration, until one is saved with the "cal" console
+// command (see settings_store.h).
+const int DS_PIN = 4;
+const int SSR_PIN = 25;
 const int STEPS = 513;
+const int MOTOR_PINS[4] = { 16, 17, 18, 19 };
+const int32_t MAX_SPEED = 80L * STEPS / 60;    // 80 RPM
+const int32_t ACCELERATION = 1000;
+const float HEATER_KP = 0.2f, HEATER_KI = 0.002f, HEATER_KD = 2.0f;
+// HX711 load cell under the cup for flow controlled pours; DOUT -1 if none
+// is fitted.
+const int SCALE_DOUT_PIN = -1;
+const int SCALE_SCK_PIN = 26;
+const float SCALE_COUNTS_PER_GRAM = 420.0f;
+const float FLOW_KP = 0.05f, FLOW_KI = 0.1f;
 
-void mainTask(void *pvParameters){
-//	Stepper stepper(32, 16, 17, 18, 19);
-//
-//	while (1) {
-//		printf("forward\n");
-//		stepper.step(32);
-//		vTaskDelay(500);
-//		printf("backward\n");
-//		stepper.step(-200);
-//		vTaskDelay(500);
-//	}
-//  ds18b20_init(DS_PIN);
-//
-//  while (1) {
-//    printf("Temperature: %0.1f\n",ds18b20_get_temp());
-//    vTaskDelay(1000 / portTICK_PERIOD_MS);
-//  }
+const float BREW_TEMPERATURE = 93.0f;
+
+// Between pours the coils are released and the unit light-sleeps, heater
+// off, until the next pour is due or the BOOT button is pressed.
+const int WAKE_PIN = 0;
+const uint32_t POUR_INTERVAL_MS = 60000;
+const uint32_t COIL_HOLD_MS = 500;        // full holding torque after each move
+
+// Optional encoder on the spout shaft for stall detection; pin A -1 if none
+// is fitted.  Counts per revolution are four times its lines.
+const int ENCODER_PIN_A = -1;
+const int ENCODER_PIN_B = 33;
+const int32_t ENCODER_COUNTS = 2048;
+const int32_t STALL_STEPS = 4;           // steps the shaft may lag the coils
+
+// Network to join for the control API (see control_server.h); an empty SSID
+// leaves Wi-Fi off, so the unit can light-sleep between pours.
+const char WIFI_SSID[] = "";
+const char WIFI_PASSWORD[] = "";
+const uint16_t SERVER_PORT = 80;
+const int SPOUT_AXES = 1;
+
+/*
+ * Task layout.  The motion task owns the APP CPU: its step timer interrupt
+ * is allocated on the core that starts the first move, so step timing never
+ * competes with Wi-Fi, which the IDF runs on the PRO CPU.  Sensing, control
+ * and reporting share the PRO CPU.
+ */
+const BaseType_t MOTION_CORE = 1;
+const BaseType_t CONTROL_CORE = 0;
+
+const UBaseType_t MOTION_PRIORITY = 10;
+const UBaseType_t LOADCELL_PRIORITY = 7;
+const UBaseType_t HEATER_PRIORITY = 6;
+const UBaseType_t SERVER_PRIORITY = 3;
+const UBaseType_t MONITOR_PRIORITY = 2;
+const UBaseType_t CONSOLE_PRIORITY = 1;
+const UBaseType_t DIAGNOSTICS_PRIORITY = 1;
+const UBaseType_t LOG_PRIORITY = 1;
+
+const uint32_t MOTION_STACK_SIZE = 3072;
+const uint32_t MONITOR_STACK_SIZE = 3072;   // printf of floats
+
+// The spout only has one axis, so pulses are sweeps across the bed.
+static const char POUR_RECIPE[] =
+	"temp 93\n"
+	"heat\n"
+	"# bloom\n"
+	"sweep 513 1 @200\n"
+	"wait 30000\n"
+	"# main pour in pulses\n"
+	"sweep 513 3\n"
+	"wait 5000\n"
+	"sweep 513 3\n"
+	"wait 5000\n"
+	"sweep 513 2\n";
+
+// Timing of every spout step, dumped by the "jitter" console command.
+static StepTimingTrace spout_timing;
+
+// CPU share and stack headroom of every task, shown by the "tasks" command.
+static TaskDiagnostics diagnostics;
+
+// Recipes uploaded over the network, poured instead of POUR_RECIPE.
+static RecipeMailbox recipes;
+static ControlServer server(&recipes, SPOUT_AXES);
+static bool remote_control = false;
+
+// Loaded once in app_main, before any task starts; "cal" changes it for the
+// next boot.
+static SettingsStore settings;
+static Calibration calibration;
+
+// Held by the motion task for the whole of a pour.  Writing to NVS stalls
+// the flash cache, and with it the step ISR's timing, so the console only
+// changes the settings while it can take this at once.
+static SemaphoreHandle_t pour_lock;
+static StaticSemaphore_t pour_lock_memory;
+
+// Set up in app_main if the calibration has one; started by the motion task.
+static LoadCell *load_cell = NULL;
+
+static StaticTask<MOTION_STACK_SIZE> motion_task;
+static StaticTask<MONITOR_STACK_SIZE> monitor_task;
+
+// Everything the motion task drives is laid out at link time with it: the
+// coordinator holds the motion segment pool and the ramp table.  The
+// spout motor and encoder need the loaded calibration, so they are
+// function statics in the task, constructed once it has been loaded.
+static MotionCoordinator spout;
+static FlowController flow(&spout);
+
+void motionTask(void *pvParameters){
+	HeaterController *heater = (HeaterController *) pvParameters;
+	const int8_t *pins = calibration.motor_pins;
+	// static storage, see above
+	static Stepper stepper(calibration.steps_per_revolution, pins[0], pins[1], pins[2], pins[3]);
+	stepper.setHoldTimeout(COIL_HOLD_MS);
+
+	static QuadratureEncoder encoder(PCNT_UNIT_0, ENCODER_PIN_A, ENCODER_PIN_B, ENCODER_COUNTS);
+	if (ENCODER_PIN_A >= 0 && encoder.begin()) {
+		stepper.setFeedback(&encoder, STALL_STEPS);
+	}
+
+	spout.addAxis(&stepper);
+	spout.setTelemetry(&motion_telemetry);
+	spout.setTimingTrace(&spout_timing);
+	spout.setMaxSpeed(calibration.max_speed);
+	spout.setAcceleration(calibration.acceleration);
+
+	// the last one compiled comes straight from flash
+	static RecipeProgram program;
+	const uint32_t builtin = SettingsStore::hashText(POUR_RECIPE);
+	if (!settings.loadRecipe(&program, builtin, spout.axisCount())) {
+		if (!program.compile(POUR_RECIPE, spout.axisCount())) {
+			vTaskDelete(NULL);
+		}
+		settings.saveRecipe(program, builtin);
+	}
+	static RecipeRunner runner(&spout, heater);
+
+	// the load cell task runs the flow loop, so it starts once the loop is attached
+	if (load_cell != NULL) {
+		flow.setTunings(calibration.flow_kp, calibration.flow_ki);
+		flow.attach(load_cell);
+		if (load_cell->start(LOADCELL_PRIORITY, CONTROL_CORE)) {
+			runner.setFlowController(&flow);
+		}
+	}
+
+	while (1) {
+		xSemaphoreTake(pour_lock, portMAX_DELAY);
+		DLOGI(tag, "pouring");
+		if (!runner.run(program) && stepper.stalled()) {
+			// carry on from where the spout actually is
+			stepper.syncToFeedback();
+		}
+
+		stepper.release();
+		xSemaphoreGive(pour_lock);
+		bool heater_off = heater->switchOff(1000 / portTICK_PERIOD_MS);
+		if (remote_control) {
+			// Wi-Fi keeps the chip awake anyway; an upload pours at once
+			if (recipes.take(&program, POUR_INTERVAL_MS / portTICK_PERIOD_MS)) {
+				settings.saveRecipe(program, 0);
+			}
+		} else if (heater_off) {
+			idle_sleep(POUR_INTERVAL_MS);
+		} else {
+			vTaskDelay(POUR_INTERVAL_MS / portTICK_PERIOD_MS);
+		}
+	}
+}
+
+/*
+ * Reports what the other tasks publish.  Nothing here can hold up the
+ * publishers: snapshots are seqlocked and the sample ring is lock-free.
+ */
+void monitorTask(void *pvParameters){
+	while (1) {
+		HeaterTelemetry sample;
+		int32_t low = INT32_MAX, high = INT32_MIN;
+		while (heater_samples.pop(&sample)) {
+			if (sample.temperature < low) { low = sample.temperature; }
+			if (sample.temperature > high) { high = sample.temperature; }
+		}
+		HeaterTelemetry heater = heater_telemetry.read();
+		MotionTelemetry motion = motion_telemetry.read();
+
+		if (low <= high) {
+			printf("Temperature: %0.2f (%0.2f..%0.2f) -> %0.2f, heater %u%%\n",
+					heater.temperature / 16.0f, low / 16.0f, high / 16.0f,
+					heater.setpoint / 16.0f, heater.duty * 100 / HEATER_PWM_MAX_DUTY);
+		}
+		if (motion.step_interval_us != 0) {
+			printf("Spout: %d steps left in segment at %u steps/s\n", motion.steps_left,
+					1000000 / motion.step_interval_us);
+		}
+		FlowTelemetry flow = flow_telemetry.read();
+		if (flow.sensor_ok && flow.target != 0) {
+			printf("Cup: %0.1f g at %0.2f g/s -> %0.2f g/s, spout at %u%%\n",
+					flow.weight / 1000.0f, flow.flow / 1000.0f, flow.target / 1000.0f,
+					flow.rate_scale * 100 >> MOTION_RATE_SHIFT);
+		}
+		vTaskDelay(1000 / portTICK_PERIOD_MS);
+	}
+}
+
+static void jitterCommand(int argc, char **argv, void *arg){
+	StepTimingTrace *trace = (StepTimingTrace *) arg;
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		trace->reset();
+		return;
+	}
+	trace->dump();
 }
 
+static void tasksCommand(int argc, char **argv, void *arg){
+	((TaskDiagnostics *) arg)->print();
+}
+
+static void defaultCalibration(Calibration *c){
+	memset(c, 0, sizeof(*c));
+	c->steps_per_revolution = STEPS;
+	for (int i = 0; i < 4; i++) {
+		c->motor_pins[i] = MOTOR_PINS[i];
+	}
+	c->max_speed = MAX_SPEED;
+	c->acceleration = ACCELERATION;
+	c->sensor_pin = DS_PIN;
+	c->heater_pin = SSR_PIN;
+	c->kp = HEATER_KP;
+	c->ki = HEATER_KI;
+	c->kd = HEATER_KD;
+	c->scale_dout_pin = SCALE_DOUT_PIN;
+	c->scale_sck_pin = SCALE_SCK_PIN;
+	c->scale_counts_per_gram = SCALE_COUNTS_PER_GRAM;
+	c->flow_kp = FLOW_KP;
+	c->flow_ki = FLOW_KI;
+}
+
+static void printCalibration(const Calibration &c){
+	printf("steps %d\npins %d %d %d %d\nspeed %d\naccel %d\nds %d\nssr %d\npid %g %g %g\n",
+			c.steps_per_revolution, c.motor_pins[0], c.motor_pins[1], c.motor_pins[2],
+			c.motor_pins[3], c.max_speed, c.acceleration, c.sensor_pin, c.heater_pin,
+			c.kp, c.ki, c.kd);
+	printf("scale %d %d %g\nflow %g %g\n", c.scale_dout_pin, c.scale_sck_pin,
+			c.scale_counts_per_gram, c.flow_kp, c.flow_ki);
+	for (int i = 0; i < c.sensor_count; i++) {
+		const uint8_t *rom = c.sensors[i].rom;
+		printf("sensor %02x%02x%02x%02x%02x%02x%02x%02x\n",
+				rom[0], rom[1], rom[2], rom[3], rom[4], rom[5], rom[6], rom[7]);
+	}
+}
+
+/*
+ * Takes pour_lock for a console change, or says why not.
+ */
+static bool lockForChange(void){
+	if (xSemaphoreTake(pour_lock, 0) != pdTRUE) {
+		printf("Pouring, try again once it is done\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Shows what is on the load cell.  "scale tare" zeroes it; "scale <grams>"
+ * with that much on it works out its scale, which takes effect at once and
+ * is saved; not while pouring.
+ */
+static void scaleCommand(int argc, char **argv, void *arg){
+	LoadCell *cell = (LoadCell *) arg;
+	if (argc == 1) {
+		printf("%0.1f g, %0.2f g/s%s\n", cell->weight(), cell->flow(),
+				cell->isOk() ? "" : " (not answering)");
+		return;
+	}
+	if (strcmp(argv[1], "tare") == 0) {
+		cell->tare();
+		return;
+	}
+	float grams = strtof(argv[1], NULL);
+	if (grams <= 0 || cell->counts() == 0) {
+		printf("scale [tare | <grams on it>]\n");
+		return;
+	}
+	if (!lockForChange()) {
+		return;
+	}
+	calibration.scale_counts_per_gram = cell->counts() / grams;
+	cell->setScale(calibration.scale_counts_per_gram);
+	if (settings.saveCalibration(calibration)) {
+		printf("Saved %g counts per gram\n", calibration.scale_counts_per_gram);
+	}
+	xSemaphoreGive(pour_lock);
+}
+
+/*
+ * Changes and saves one calibration value at a time, between pours; they
+ * take effect at the next boot.
+ */
+static void calibrationCommand(int argc, char **argv, void *arg){
+	Calibration *c = (Calibration *) arg;
+	if (argc == 1) {
+		printCalibration(*c);
+		return;
+	}
+	const char *field = argv[1];
+	if (strcmp(field, "reset") == 0) {
+		if (lockForChange()) {
+			settings.erase();
+			xSemaphoreGive(pour_lock);
+			printf("Calibration and recipe erased, defaults after a reset\n");
+		}
+		return;
+	}
+	Calibration changed = *c;
+	if (strcmp(field, "sensors") == 0) {
+		changed.sensor_count = 0;
+	} else if (strcmp(field, "pins") == 0 && argc == 6) {
+		for (int i = 0; i < 4; i++) {
+			changed.motor_pins[i] = atoi(argv[2 + i]);
+		}
+	} else if (strcmp(field, "pid") == 0 && argc == 5) {
+		changed.kp = strtof(argv[2], NULL);
+		changed.ki = strtof(argv[3], NULL);
+		changed.kd = strtof(argv[4], NULL);
+	} else if (strcmp(field, "scale") == 0 && argc == 4) {
+		changed.scale_dout_pin = atoi(argv[2]);
+		changed.scale_sck_pin = atoi(argv[3]);
+	} else if (strcmp(field, "flow") == 0 && argc == 4) {
+		changed.flow_kp = strtof(argv[2], NULL);
+		changed.flow_ki = strtof(argv[3], NULL);
+	} else if (argc == 3 && strcmp(field, "steps") == 0) {
+		changed.steps_per_revolution = atoi(argv[2]);
+	} else if (argc == 3 && strcmp(field, "speed") == 0) {
+		changed.max_speed = atoi(argv[2]);
+	} else if (argc == 3 && strcmp(field, "accel") == 0) {
+		changed.acceleration = atoi(argv[2]);
+	} else if (argc == 3 && strcmp(field, "ds") == 0) {
+		changed.sensor_pin = atoi(argv[2]);
+	} else if (argc == 3 && strcmp(field, "ssr") == 0) {
+		changed.heater_pin = atoi(argv[2]);
+	} else {
+		printf("cal [steps|speed|accel|ds|ssr <n> | pins <a> <b> <c> <d> | pid <kp> <ki> <kd>"
+				" | scale <dout> <sck> | flow <kp> <ki> | sensors | reset]\n");
+		return;
+	}
+	if (!lockForChange()) {
+		return;
+	}
+	if (settings.saveCalibration(changed)) {
+		*c = changed;
+		printf("Saved, takes effect after a reset\n");
+	}
+	xSemaphoreGive(pour_lock);
+}
 
 void app_main(void)
 {
-	Stepper stepper(STEPS, 16, 17, 18, 19);
-	stepper.setSpeed(40);
+	defaultCalibration(&calibration);
+	if (settings.open()) {
+		settings.loadCalibration(&calibration);
+	}
+	static HeaterController heater(calibration.heater_pin, LEDC_TIMER_1, LEDC_CHANNEL_4);
+	pour_lock = xSemaphoreCreateMutexStatic(&pour_lock_memory);
 
-	while (1) {
-		printf("forward\n");
-		stepper.step(STEPS);
-		vTaskDelay(500);
-		printf("backward\n");
-		stepper.step(-STEPS);
-		vTaskDelay(500);
+	dlog_start(LOG_PRIORITY, CONTROL_CORE);
+	idle_sleep_set_wake_pin(WAKE_PIN, 0);
+	ds18b20_init_uart(calibration.sensor_pin, UART_NUM_1);
+	if (calibration.sensor_count == 0) {
+		// searched once, then addressed from the stored ROM codes
+		calibration.sensor_count = ds18b20_search(calibration.sensors, SETTINGS_MAX_SENSORS);
+		if (calibration.sensor_count > 0) {
+			settings.saveCalibration(calibration);
+		}
+	}
+	if (calibration.sensor_count > 0) {
+		heater.setSensor(&calibration.sensors[0]);
+	}
+	heater.setTunings(calibration.kp, calibration.ki, calibration.kd);
+	heater.setTarget(BREW_TEMPERATURE);
+
+	if (calibration.scale_dout_pin >= 0) {
+		static LoadCell scale(calibration.scale_dout_pin, calibration.scale_sck_pin);
+		scale.setScale(calibration.scale_counts_per_gram);
+		load_cell = &scale;
 	}
-//	xTaskCreatePinnedToCore(&mainTask, "mainTask", 2048, NULL, 5, NULL, 0);
-}
 
+	if (WIFI_SSID[0] != '\0' && wifi_station_start(WIFI_SSID, WIFI_PASSWORD)) {
+		remote_control = server.start(SERVER_PORT, SERVER_PRIORITY, CONTROL_CORE);
+	}
+	motion_task.start(&motionTask, "motion", &heater, MOTION_PRIORITY, MOTION_CORE);
+	heater.start(HEATER_PRIORITY, CONTROL_CORE);
+	monitor_task.start(&monitorTask, "monitor", NULL, MONITOR_PRIORITY, CONTROL_CORE);
+
+	console_register("jitter", "step timing histogram; \"jitter reset\" clears it",
+			jitterCommand, &spout_timing);
+	console_register("tasks", "CPU share and stack headroom of every task",
+			tasksCommand, &diagnostics);
+	console_register("cal", "show or change the stored calibration",
+			calibrationCommand, &calibration);
+	if (load_cell != NULL) {
+		console_register("scale", "weight and flow on the load cell; tare or calibrate it",
+				scaleCommand, load_cell);
+	}
+	diagnostics.start(DIAGNOSTICS_PRIORITY, CONTROL_CORE);
+	console_start(CONSOLE_PRIORITY, CONTROL_CORE);
+}
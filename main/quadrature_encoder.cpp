@@ -0,0 +1,133 @@
+/*
+ * QuadratureEncoder.cpp - shaft position from a quadrature encoder on PCNT.
+ */
+
+#include <esp_log.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include "driver/pcnt.h"
+#include "soc/pcnt_struct.h"
+#include "quadrature_encoder.h"
+
+static const char* LOG_TAG = "QuadratureEncoder";
+
+// Which QuadratureEncoder, if any, owns each PCNT unit.
+static QuadratureEncoder *unit_owner[PCNT_UNIT_MAX];
+static pcnt_isr_handle_t isr_handle;
+
+QuadratureEncoder::QuadratureEncoder(pcnt_unit_t unit, int pin_a, int pin_b,
+		int32_t counts_per_revolution)
+{
+	this->unit = unit;
+	this->pin_a = pin_a;
+	this->pin_b = pin_b;
+	this->counts_per_revolution = counts_per_revolution;
+	this->wraps = 0;
+}
+
+/*
+ * Channel 0 counts edges of A, in the direction B's level gives; channel 1
+ * counts edges of B the opposite way round, which together decode x4.
+ */
+bool QuadratureEncoder::begin(uint16_t filter_cycles)
+{
+	pcnt_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.unit = this->unit;
+	config.counter_h_lim = ENCODER_LIMIT;
+	config.counter_l_lim = -ENCODER_LIMIT;
+	config.lctrl_mode = PCNT_MODE_REVERSE;
+	config.hctrl_mode = PCNT_MODE_KEEP;
+
+	config.channel = PCNT_CHANNEL_0;
+	config.pulse_gpio_num = this->pin_a;
+	config.ctrl_gpio_num = this->pin_b;
+	config.pos_mode = PCNT_COUNT_DEC;
+	config.neg_mode = PCNT_COUNT_INC;
+	if (pcnt_unit_config(&config) != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to configure PCNT unit %d", this->unit);
+		return false;
+	}
+	config.channel = PCNT_CHANNEL_1;
+	config.pulse_gpio_num = this->pin_b;
+	config.ctrl_gpio_num = this->pin_a;
+	config.pos_mode = PCNT_COUNT_INC;
+	config.neg_mode = PCNT_COUNT_DEC;
+	pcnt_unit_config(&config);
+
+	pcnt_set_filter_value(this->unit, filter_cycles);
+	pcnt_filter_enable(this->unit);
+	pcnt_event_enable(this->unit, PCNT_EVT_H_LIM);
+	pcnt_event_enable(this->unit, PCNT_EVT_L_LIM);
+	pcnt_counter_pause(this->unit);
+	pcnt_counter_clear(this->unit);
+	this->wraps = 0;
+
+	unit_owner[this->unit] = this;
+	if (isr_handle == NULL) {
+		esp_err_t err = pcnt_isr_register(&QuadratureEncoder::onCounterLimit, NULL,
+				ESP_INTR_FLAG_IRAM, &isr_handle);
+		if (err != ESP_OK) {
+			ESP_LOGE(LOG_TAG, "Failed to register PCNT ISR: %d", err);
+			return false;
+		}
+	}
+	pcnt_intr_enable(this->unit);
+	pcnt_counter_resume(this->unit);
+	return true;
+}
+
+/*
+ * The counter resets to 0 as it reaches either limit.  If that has
+ * happened and the interrupt has not been served yet, the counter being
+ * near 0 rather than near the limit tells that wraps is one short.
+ */
+int32_t IRAM_ATTR QuadratureEncoder::count(void) const
+{
+	int32_t total, counter;
+	uint32_t pending;
+	bool high;
+	do {
+		total = this->wraps;
+		counter = (int16_t) PCNT.cnt_unit[this->unit].cnt_val;
+		pending = PCNT.int_st.val & (1UL << this->unit);
+		high = PCNT.status_unit[this->unit].h_lim_lat;
+	} while (total != this->wraps);
+
+	if (pending) {
+		if (high && counter < ENCODER_LIMIT / 2) {
+			total += ENCODER_LIMIT;
+		} else if (!high && counter > -ENCODER_LIMIT / 2) {
+			total -= ENCODER_LIMIT;
+		}
+	}
+	return total + counter;
+}
+
+void QuadratureEncoder::clear(void)
+{
+	pcnt_counter_pause(this->unit);
+	pcnt_counter_clear(this->unit);
+	this->wraps = 0;
+	pcnt_counter_resume(this->unit);
+}
+
+/*
+ * Shared by every unit; adds each wrap to its encoder's total.
+ */
+void IRAM_ATTR QuadratureEncoder::onCounterLimit(void *arg)
+{
+	uint32_t status = PCNT.int_st.val;
+	for (int u = 0; u < PCNT_UNIT_MAX; u++) {
+		if (!(status & (1UL << u))) {
+			continue;
+		}
+		bool high = PCNT.status_unit[u].h_lim_lat;
+		PCNT.int_clr.val = 1UL << u;
+		QuadratureEncoder *encoder = unit_owner[u];
+		if (encoder != NULL) {
+			encoder->wraps = encoder->wraps + (high ? ENCODER_LIMIT : -ENCODER_LIMIT);
+		}
+	}
+}
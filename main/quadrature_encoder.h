@@ -0,0 +1,49 @@
+/*
+ * QuadratureEncoder.h - shaft position from a quadrature encoder on PCNT.
+ *
+ * Both channels of one pulse counter unit decode the A/B signals on every
+ * edge (x4), so counts_per_revolution is four times the encoder's lines.
+ * The hardware counter is 16 bits; it is set to wrap at +/-ENCODER_LIMIT,
+ * and the unit's interrupt adds each wrap to a 32-bit total.  count()
+ * combines the two consistently, also while a wrap interrupt is still
+ * pending, so it can be called from the step ISR.
+ *
+ * Swap the A and B pins if the count runs the opposite way to the motor.
+ */
+
+// ensure this library description is only included once
+#ifndef QuadratureEncoder_h
+#define QuadratureEncoder_h
+
+#include <stdint.h>
+#include "esp_attr.h"
+#include "driver/pcnt.h"
+
+#define ENCODER_LIMIT 16384                 // counter wraps to 0 at +/- this
+#define ENCODER_DEFAULT_FILTER 100          // APB cycles, 1.25 us
+
+class QuadratureEncoder {
+  public:
+    QuadratureEncoder(pcnt_unit_t unit, int pin_a, int pin_b, int32_t counts_per_revolution);
+
+    // Configures the unit and starts counting from 0.  Pulses shorter than
+    // filter_cycles APB cycles (up to 1023) are ignored as glitches.
+    bool begin(uint16_t filter_cycles = ENCODER_DEFAULT_FILTER);
+
+    // Counts since begin() or the last clear(); safe from ISRs.
+    int32_t count(void) const;
+    void clear(void);
+
+    int32_t countsPerRevolution(void) const { return this->counts_per_revolution; }
+
+  private:
+    static void onCounterLimit(void *arg);
+
+    pcnt_unit_t unit;
+    int pin_a;
+    int pin_b;
+    int32_t counts_per_revolution;
+    volatile int32_t wraps;       // sum of every counter wrap, in counts
+};
+
+#endif
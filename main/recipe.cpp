@@ -0,0 +1,350 @@
+/*
+ * Recipe.cpp - pour recipes compiled to motion segments and setpoint events.
+ */
+
+#include <esp_log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "motion_coordinator.h"
+#include "heater_controller.h"
+#include "flow_controller.h"
+#include "telemetry.h"
+#include "recipe.h"
+
+#define RECIPE_MAX_LINE 96
+
+static const char* LOG_TAG = "Recipe";
+
+RecipeProgram::RecipeProgram()
+{
+	this->count = 0;
+	this->axis_count = 0;
+	memset(this->position, 0, sizeof(this->position));
+}
+
+/*
+ * Compiles the whole recipe, line by line, into the event array.
+ */
+bool RecipeProgram::compile(const char *text, int axis_count)
+{
+	this->count = 0;
+	this->axis_count = axis_count;
+	memset(this->position, 0, sizeof(this->position));
+
+	int line_number = 1;
+	while (*text != '\0') {
+		const char *end = strchr(text, '\n');
+		size_t length = end ? (size_t) (end - text) : strlen(text);
+		char line[RECIPE_MAX_LINE];
+		if (length >= sizeof(line)) {
+			ESP_LOGE(LOG_TAG, "Line %d is too long", line_number);
+			return false;
+		}
+		memcpy(line, text, length);
+		line[length] = '\0';
+		if (!this->compileLine(line)) {
+			ESP_LOGE(LOG_TAG, "Line %d: cannot compile \"%.*s\"", line_number,
+					(int) length, text);
+			return false;
+		}
+		text += length;
+		if (*text == '\n') {
+			text++;
+		}
+		line_number++;
+	}
+	ESP_LOGI(LOG_TAG, "Compiled %d events", this->count);
+	return true;
+}
+
+/*
+ * Compiles one command.  Distances are tracked as absolute positions so
+ * rounding in spirals does not drift and center knows where to go.
+ */
+bool RecipeProgram::compileLine(char *line)
+{
+	char *comment = strchr(line, '#');
+	if (comment != NULL) {
+		*comment = '\0';
+	}
+
+	// split into words, pulling out an optional @speed
+	char *words[MOTION_MAX_AXES + 2];
+	int word_count = 0;
+	int32_t speed = 0;
+	char *save = NULL;
+	for (char *word = strtok_r(line, " \t\r", &save); word != NULL;
+			word = strtok_r(NULL, " \t\r", &save)) {
+		if (word[0] == '@') {
+			speed = atoi(word + 1);
+			if (speed <= 0) {
+				return false;
+			}
+		} else if (word_count < (int) (sizeof(words) / sizeof(words[0]))) {
+			words[word_count++] = word;
+		} else {
+			return false;
+		}
+	}
+	if (word_count == 0) {
+		return true;
+	}
+
+	const char *command = words[0];
+	int args = word_count - 1;
+	int32_t target[MOTION_MAX_AXES];
+	memcpy(target, this->position, sizeof(target));
+
+	if (strcmp(command, "temp") == 0 && args == 1) {
+		return this->addEvent(RECIPE_SETPOINT, lroundf(strtof(words[1], NULL) * 16));
+	}
+	if (strcmp(command, "heat") == 0 && args == 0) {
+		return this->addEvent(RECIPE_WAIT_TEMPERATURE, 0);
+	}
+	if (strcmp(command, "flow") == 0 && args == 1) {
+		float flow = strtof(words[1], NULL);
+		return flow >= 0 && this->addEvent(RECIPE_FLOW, lroundf(flow * 1000));
+	}
+	if (strcmp(command, "wait") == 0 && args == 1) {
+		int ms = atoi(words[1]);
+		return ms >= 0 && ms <= RECIPE_MAX_WAIT_MS && this->addEvent(RECIPE_WAIT, ms);
+	}
+	if (strcmp(command, "move") == 0 && args >= 1 && args <= this->axis_count) {
+		for (int i = 0; i < args; i++) {
+			int32_t distance = atoi(words[i + 1]);
+			if (abs(distance) > RECIPE_MAX_DISTANCE) {
+				return false;
+			}
+			target[i] += distance;
+		}
+		return this->addMove(target, speed);
+	}
+	if (strcmp(command, "center") == 0 && args == 0) {
+		memset(target, 0, sizeof(target));
+		return this->addMove(target, speed);
+	}
+	if (strcmp(command, "sweep") == 0 && args == 2 && this->axis_count >= 1) {
+		int32_t amplitude = atoi(words[1]);
+		int sweeps = atoi(words[2]);
+		// each sweep is two events, so more could never fit
+		if (amplitude == 0 || abs(amplitude) > RECIPE_MAX_DISTANCE
+				|| sweeps <= 0 || sweeps > RECIPE_MAX_EVENTS / 2) {
+			return false;
+		}
+		for (int i = 0; i < sweeps; i++) {
+			target[0] = this->position[0] + amplitude;
+			if (!this->addMove(target, speed)) {
+				return false;
+			}
+			target[0] = this->position[0] - amplitude;
+			if (!this->addMove(target, speed)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	if (strcmp(command, "spiral") == 0 && args == 3 && this->axis_count >= 2) {
+		float radius = strtof(words[1], NULL);
+		float turns = strtof(words[2], NULL);
+		int per_turn = atoi(words[3]);
+		// written so that NaN fails too
+		if (!(radius > 0 && radius <= RECIPE_MAX_DISTANCE) || !(turns > 0) || per_turn <= 0
+				|| !(turns * per_turn <= RECIPE_MAX_EVENTS)) {
+			return false;
+		}
+		int segments = (int) lroundf(turns * per_turn);
+		if (segments <= 0) {
+			return false;
+		}
+		int32_t origin_x = this->position[0];
+		int32_t origin_y = this->position[1];
+		for (int k = 1; k <= segments; k++) {
+			float fraction = (float) k / segments;
+			float angle = 2.0f * (float) M_PI * turns * fraction;
+			target[0] = origin_x + lroundf(radius * fraction * cosf(angle));
+			target[1] = origin_y + lroundf(radius * fraction * sinf(angle));
+			if (!this->addMove(target, speed)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+bool RecipeProgram::addMove(const int32_t *target, int32_t speed)
+{
+	if (this->count == RECIPE_MAX_EVENTS) {
+		ESP_LOGE(LOG_TAG, "More than %d events", RECIPE_MAX_EVENTS);
+		return false;
+	}
+	RecipeEvent *event = &this->events[this->count];
+	bool moves = false;
+	for (int i = 0; i < MOTION_MAX_AXES; i++) {
+		event->steps[i] = target[i] - this->position[i];
+		moves = moves || event->steps[i] != 0;
+	}
+	if (!moves) {
+		return true;
+	}
+	event->kind = RECIPE_MOVE;
+	event->value = speed;
+	memcpy(this->position, target, sizeof(this->position));
+	this->count++;
+	return true;
+}
+
+bool RecipeProgram::addEvent(uint8_t kind, int32_t value)
+{
+	if (this->count == RECIPE_MAX_EVENTS) {
+		ESP_LOGE(LOG_TAG, "More than %d events", RECIPE_MAX_EVENTS);
+		return false;
+	}
+	RecipeEvent *event = &this->events[this->count++];
+	event->kind = kind;
+	event->value = value;
+	memset(event->steps, 0, sizeof(event->steps));
+	return true;
+}
+
+RecipeMailbox::RecipeMailbox()
+{
+	this->pending = false;
+	this->lock = xSemaphoreCreateMutexStatic(&this->lock_memory);
+	this->posted = xSemaphoreCreateBinaryStatic(&this->posted_memory);
+}
+
+bool RecipeMailbox::post(const char *text, int axis_count)
+{
+	xSemaphoreTake(this->lock, portMAX_DELAY);
+	this->pending = this->program.compile(text, axis_count);
+	bool compiled = this->pending;
+	xSemaphoreGive(this->lock);
+	if (compiled) {
+		xSemaphoreGive(this->posted);
+	}
+	return compiled;
+}
+
+/*
+ * The semaphore only wakes the taker; pending tells whether the program
+ * is still valid, as a later post() may have failed to compile.
+ */
+bool RecipeMailbox::take(RecipeProgram *program, TickType_t timeout)
+{
+	if (xSemaphoreTake(this->posted, timeout) != pdTRUE) {
+		return false;
+	}
+	xSemaphoreTake(this->lock, portMAX_DELAY);
+	bool taken = this->pending;
+	if (taken) {
+		*program = this->program;
+		this->pending = false;
+	}
+	xSemaphoreGive(this->lock);
+	return taken;
+}
+
+RecipeRunner::RecipeRunner(MotionCoordinator *motion, HeaterController *heater)
+{
+	this->motion = motion;
+	this->heater = heater;
+	this->flow = NULL;
+}
+
+/*
+ * Walks the program.  Moves are queued as far ahead as the motion queue
+ * allows; any other event first lets the queued moves finish.
+ */
+bool RecipeRunner::run(const RecipeProgram &program)
+{
+	if (this->flow != NULL) {
+		this->flow->setTarget(0);
+	}
+	for (int i = 0; i < program.length(); i++) {
+		const RecipeEvent &event = program.event(i);
+		if (event.kind == RECIPE_MOVE) {
+			if (!this->queueMove(event)) {
+				return false;
+			}
+			continue;
+		}
+
+		this->motion->waitForCompletion(portMAX_DELAY);
+		if (this->motion->stalledAxis() >= 0) {
+			ESP_LOGE(LOG_TAG, "Axis %d stalled, recipe abandoned", this->motion->stalledAxis());
+			return false;
+		}
+		switch (event.kind) {
+			case RECIPE_SETPOINT:
+				if (this->heater != NULL) {
+					this->heater->setTarget(event.value / 16.0f);
+				}
+				break;
+			case RECIPE_FLOW:
+				if (this->flow != NULL) {
+					this->flow->setTarget(event.value / 1000.0f);
+				}
+				break;
+			case RECIPE_WAIT:
+				vTaskDelay(event.value / portTICK_PERIOD_MS);
+				break;
+			case RECIPE_WAIT_TEMPERATURE:
+				if (this->heater != NULL && !this->waitForTemperature()) {
+					return false;
+				}
+				break;
+		}
+	}
+	this->motion->waitForCompletion(portMAX_DELAY);
+	return this->motion->stalledAxis() < 0;
+}
+
+/*
+ * The heater is switched off between pours, so "heat" switches it back on
+ * first.  Gives up if the probe is lost or the kettle takes too long.
+ */
+bool RecipeRunner::waitForTemperature(void)
+{
+	this->heater->switchOn();
+	TickType_t started = xTaskGetTickCount();
+	while (1) {
+		HeaterTelemetry state = heater_telemetry.read();
+		if (state.sensor_ok
+				&& abs(state.temperature - state.setpoint) <= RECIPE_TEMPERATURE_BAND) {
+			return true;
+		}
+		if (this->heater->probeLost()) {
+			ESP_LOGE(LOG_TAG, "Kettle probe lost, recipe abandoned");
+			return false;
+		}
+		if (xTaskGetTickCount() - started >= RECIPE_HEAT_TIMEOUT_MS / portTICK_PERIOD_MS) {
+			ESP_LOGE(LOG_TAG, "Kettle not at the setpoint after %d s, recipe abandoned",
+					RECIPE_HEAT_TIMEOUT_MS / 1000);
+			return false;
+		}
+		vTaskDelay(HEATER_CONTROL_PERIOD_MS / portTICK_PERIOD_MS);
+	}
+}
+
+/*
+ * Queues one move, sleeping while the motion queue is full.
+ */
+bool RecipeRunner::queueMove(const RecipeEvent &event)
+{
+	int steps[MOTION_MAX_AXES];
+	for (int i = 0; i < MOTION_MAX_AXES; i++) {
+		steps[i] = event.steps[i];
+	}
+	while (this->motion->queueSpace() == 0) {
+		vTaskDelay(1);
+	}
+	if (!this->motion->queueMove(steps, event.value)) {
+		ESP_LOGE(LOG_TAG, "Motion coordinator refused a move");
+		return false;
+	}
+	return true;
+}
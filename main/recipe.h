@@ -0,0 +1,151 @@
+/*
+ * Recipe.h - pour recipes compiled to motion segments and setpoint events.
+ *
+ * A recipe is plain text, one command per line, '#' starts a comment:
+ *
+ *   temp <celsius>                     kettle setpoint
+ *   heat                               switch the heater on and wait until the
+ *                                      kettle is at the setpoint
+ *   move <a> [<b> ...] [@<speed>]      relative move, one distance per axis
+ *   sweep <steps> <count> [@<speed>]   count back and forth sweeps of axis 0
+ *   spiral <radius> <turns> <segments per turn> [@<speed>]
+ *                                      Archimedean spiral out from the current
+ *                                      point on axes 0 and 1
+ *   center [@<speed>]                  back to where the recipe started
+ *   wait <ms>                          pause once the spout has stopped
+ *   flow <grams per second>            hold this flow into the cup from the
+ *                                      next move on, 0 to pour open loop
+ *                                      (needs a load cell, see
+ *                                      flow_controller.h)
+ *
+ * Speeds are in steps/s of the longest axis; without one the coordinator's
+ * max speed is used.  Under a flow target they are the fastest the spout
+ * may go.  Every run starts open loop.  For example a bloom and two pulses:
+ *
+ *   temp 93
+ *   heat
+ *   spiral 120 2 16 @300
+ *   center
+ *   wait 30000
+ *   spiral 300 4 24
+ *   center
+ *   wait 10000
+ *   spiral 300 4 24
+ *   center
+ *
+ * RecipeProgram::compile() does all parsing and the spiral trigonometry up
+ * front into a fixed array of RecipeEvents.  RecipeRunner then only walks
+ * that array: moves go straight into the MotionCoordinator queue, so the
+ * planner blends them, and everything else waits for the spout to stop
+ * first so the program runs in order.  Nothing is parsed or allocated
+ * while pouring.
+ *
+ * RecipeMailbox hands recipes from another task, e.g. uploaded over the
+ * network, to the one that pours: post() compiles them into the mailbox and
+ * take() copies the newest out between pours.
+ */
+
+// ensure this library description is only included once
+#ifndef Recipe_h
+#define Recipe_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "motion_queue.h"
+
+class MotionCoordinator;
+class HeaterController;
+class FlowController;
+
+#define RECIPE_MAX_EVENTS CONFIG_POUR_BOT_RECIPE_MAX_EVENTS   // set in menuconfig
+// How close to the setpoint "heat" waits for, in 1/16 C
+#define RECIPE_TEMPERATURE_BAND 8
+// How long "heat" waits before the recipe is abandoned
+#define RECIPE_HEAT_TIMEOUT_MS (15 * 60 * 1000)
+// Longest "wait", and furthest any distance in a recipe may go, in steps
+#define RECIPE_MAX_WAIT_MS (10 * 60 * 1000)
+#define RECIPE_MAX_DISTANCE 100000
+
+enum RecipeEventKind {
+  RECIPE_MOVE,              // steps[] at value steps/s (0 for max speed)
+  RECIPE_SETPOINT,          // value is the kettle target in 1/16 C
+  RECIPE_WAIT,              // value is a pause in ms
+  RECIPE_WAIT_TEMPERATURE,  // wait until the kettle is within the band
+  RECIPE_FLOW               // value is the flow target in mg/s
+};
+
+struct RecipeEvent {
+  uint8_t kind;                     // a RecipeEventKind
+  int32_t value;
+  int32_t steps[MOTION_MAX_AXES];
+};
+
+class RecipeProgram {
+  public:
+    RecipeProgram();
+
+    // Compiles recipe text for a coordinator with axis_count axes.  Returns
+    // false, logging the line, if the recipe is invalid or too long.
+    bool compile(const char *text, int axis_count);
+
+    int length(void) const { return this->count; }
+    const RecipeEvent &event(int index) const { return this->events[index]; }
+
+  private:
+    friend class SettingsStore;
+
+    bool compileLine(char *line);
+    bool addMove(const int32_t *target, int32_t speed);
+    bool addEvent(uint8_t kind, int32_t value);
+
+    RecipeEvent events[RECIPE_MAX_EVENTS];
+    int count;
+    int axis_count;
+    int32_t position[MOTION_MAX_AXES];  // where the spout is while compiling
+};
+
+class RecipeMailbox {
+  public:
+    RecipeMailbox();
+
+    // Compiles text, replacing any program not taken yet.  Returns false if
+    // the recipe is invalid; nothing is pending then.
+    bool post(const char *text, int axis_count);
+
+    // Waits up to timeout for a posted program and copies it to *program.
+    // Returns false, leaving *program as it was, if none arrived.
+    bool take(RecipeProgram *program, TickType_t timeout);
+
+  private:
+    RecipeProgram program;
+    bool pending;               // program is compiled and not taken yet
+    SemaphoreHandle_t lock;     // guards program and pending
+    SemaphoreHandle_t posted;   // given by each successful post()
+    StaticSemaphore_t lock_memory;
+    StaticSemaphore_t posted_memory;
+};
+
+class RecipeRunner {
+  public:
+    RecipeRunner(MotionCoordinator *motion, HeaterController *heater);
+
+    // Runs a compiled program to the end, blocking the calling task.
+    // Returns false if a move was refused, an axis stalled, or the kettle
+    // did not reach the setpoint.
+    bool run(const RecipeProgram &program);
+
+    // Where flow targets go, or NULL (the default) to ignore them.
+    void setFlowController(FlowController *flow) { this->flow = flow; }
+
+  private:
+    bool queueMove(const RecipeEvent &event);
+    bool waitForTemperature(void);
+
+    MotionCoordinator *motion;
+    HeaterController *heater;
+    FlowController *flow;
+};
+
+#endif
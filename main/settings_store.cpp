@@ -0,0 +1,192 @@
+/*
+ * SettingsStore.cpp - calibration and the compiled recipe, kept in NVS.
+ */
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "settings_store.h"
+
+#define SETTINGS_NAMESPACE "pour_bot"
+
+static const char* LOG_TAG = "SettingsStore";
+
+struct StoredCalibration {
+  uint16_t version;
+  uint16_t size;
+  Calibration calibration;
+};
+
+struct StoredRecipe {
+  uint16_t version;
+  uint16_t event_size;        // sizeof(RecipeEvent) when it was written
+  uint16_t count;
+  uint8_t axis_count;
+  uint32_t source_hash;
+};
+
+SettingsStore::SettingsStore()
+{
+	this->handle = 0;
+	this->opened = false;
+}
+
+bool SettingsStore::open(void)
+{
+	if (this->opened) {
+		return true;
+	}
+	esp_err_t err = nvs_flash_init();
+	if (err == ESP_ERR_NVS_NO_FREE_PAGES) {
+		ESP_LOGW(LOG_TAG, "Erasing NVS: %d", err);
+		nvs_flash_erase();
+		err = nvs_flash_init();
+	}
+	if (err == ESP_OK) {
+		err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &this->handle);
+	}
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to open NVS: %d", err);
+		return false;
+	}
+	this->opened = true;
+	return true;
+}
+
+bool SettingsStore::loadCalibration(Calibration *calibration)
+{
+	StoredCalibration stored;
+	if (!this->loadBlob("calibration", &stored, sizeof(stored))
+			|| stored.version != SETTINGS_VERSION || stored.size != sizeof(Calibration)) {
+		return false;
+	}
+	*calibration = stored.calibration;
+	return true;
+}
+
+bool SettingsStore::saveCalibration(const Calibration &calibration)
+{
+	StoredCalibration stored;
+	memset(&stored, 0, sizeof(stored));
+	stored.version = SETTINGS_VERSION;
+	stored.size = sizeof(Calibration);
+	stored.calibration = calibration;
+	return this->saveBlob("calibration", &stored, sizeof(stored))
+			&& nvs_commit(this->handle) == ESP_OK;
+}
+
+/*
+ * The events are read straight into the program.  It is only valid once
+ * every chunk has been, so a failure leaves it empty.
+ */
+bool SettingsStore::loadRecipe(RecipeProgram *program, uint32_t source_hash, int axis_count)
+{
+	StoredRecipe stored;
+	if (!this->loadBlob("recipe", &stored, sizeof(stored))
+			|| stored.version != SETTINGS_VERSION || stored.event_size != sizeof(RecipeEvent)
+			|| stored.count > RECIPE_MAX_EVENTS || stored.axis_count != axis_count
+			|| (stored.source_hash != 0 && stored.source_hash != source_hash)) {
+		return false;
+	}
+	for (int first = 0; first < stored.count; first += SETTINGS_RECIPE_CHUNK) {
+		char key[16];
+		snprintf(key, sizeof(key), "recipe%d", first / SETTINGS_RECIPE_CHUNK);
+		int count = stored.count - first;
+		if (count > SETTINGS_RECIPE_CHUNK) {
+			count = SETTINGS_RECIPE_CHUNK;
+		}
+		if (!this->loadBlob(key, &program->events[first], count * sizeof(RecipeEvent))) {
+			program->count = 0;
+			return false;
+		}
+	}
+	program->count = stored.count;
+	program->axis_count = stored.axis_count;
+	ESP_LOGI(LOG_TAG, "Loaded a recipe of %d events", stored.count);
+	return true;
+}
+
+/*
+ * The header is erased first and written last, so losing power in between
+ * leaves no recipe rather than a mix of two.
+ */
+bool SettingsStore::saveRecipe(const RecipeProgram &program, uint32_t source_hash)
+{
+	if (!this->opened) {
+		return false;
+	}
+	nvs_erase_key(this->handle, "recipe");
+	for (int first = 0; first < program.count; first += SETTINGS_RECIPE_CHUNK) {
+		char key[16];
+		snprintf(key, sizeof(key), "recipe%d", first / SETTINGS_RECIPE_CHUNK);
+		int count = program.count - first;
+		if (count > SETTINGS_RECIPE_CHUNK) {
+			count = SETTINGS_RECIPE_CHUNK;
+		}
+		if (!this->saveBlob(key, &program.events[first], count * sizeof(RecipeEvent))) {
+			return false;
+		}
+	}
+
+	StoredRecipe stored;
+	memset(&stored, 0, sizeof(stored));
+	stored.version = SETTINGS_VERSION;
+	stored.event_size = sizeof(RecipeEvent);
+	stored.count = program.count;
+	stored.axis_count = program.axis_count;
+	stored.source_hash = source_hash;
+	return this->saveBlob("recipe", &stored, sizeof(stored))
+			&& nvs_commit(this->handle) == ESP_OK;
+}
+
+bool SettingsStore::erase(void)
+{
+	if (!this->opened) {
+		return false;
+	}
+	return nvs_erase_all(this->handle) == ESP_OK && nvs_commit(this->handle) == ESP_OK;
+}
+
+/*
+ * 32-bit FNV-1a, never 0 so that it cannot pass for an upload.
+ */
+uint32_t SettingsStore::hashText(const char *text)
+{
+	uint32_t hash = 2166136261UL;
+	for (; *text != '\0'; text++) {
+		hash = (hash ^ (uint8_t) *text) * 16777619UL;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+/*
+ * Reads a blob of exactly length bytes; any other length is a blob of
+ * another layout.
+ */
+bool SettingsStore::loadBlob(const char *key, void *value, size_t length)
+{
+	if (!this->opened) {
+		return false;
+	}
+	size_t stored = length;
+	esp_err_t err = nvs_get_blob(this->handle, key, value, &stored);
+	if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+		ESP_LOGW(LOG_TAG, "Failed to read %s: %d", key, err);
+	}
+	return err == ESP_OK && stored == length;
+}
+
+bool SettingsStore::saveBlob(const char *key, const void *value, size_t length)
+{
+	if (!this->opened) {
+		return false;
+	}
+	esp_err_t err = nvs_set_blob(this->handle, key, value, length);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to write %s: %d", key, err);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,86 @@
+/*
+ * SettingsStore.h - calibration and the compiled recipe, kept in NVS.
+ *
+ * Everything is stored as fixed layout binary blobs in the "pour_bot" NVS
+ * namespace and read back with a copy, no parsing:
+ *
+ *   "calibration"        a Calibration: motor, pins, heater and flow gains,
+ *                        the load cell scale and the ROM codes of the
+ *                        DS18B20s found on the bus
+ *   "recipe", "recipe0".. the RecipeProgram to pour at boot, its header and
+ *                        its events in chunks small enough for one NVS page
+ *
+ * Each blob starts with SETTINGS_VERSION and the size of what it holds, so
+ * one written by a firmware with a different layout is ignored rather than
+ * misread; the caller then falls back to its built-in defaults.
+ *
+ * A stored recipe remembers the hash of the text it was compiled from, or
+ * 0 if it was uploaded.  loadRecipe() only hands back a built-in recipe
+ * whose text is unchanged, so a rebuilt firmware recompiles its own, while
+ * an uploaded one keeps being poured until something else replaces it.
+ *
+ * Writes go to flash with the caches off, which IRAM interrupts survive;
+ * still, only save while nothing is moving.
+ */
+
+// ensure this library description is only included once
+#ifndef SettingsStore_h
+#define SettingsStore_h
+
+#include <stdint.h>
+#include "nvs.h"
+#include "ds18b20.h"
+#include "recipe.h"
+
+#define SETTINGS_VERSION 2
+#define SETTINGS_MAX_SENSORS 2
+#define SETTINGS_RECIPE_CHUNK 64          // events per blob, 1.5 kB
+
+struct Calibration {
+  int32_t steps_per_revolution;     // of the spout motor
+  int8_t motor_pins[4];
+  int32_t max_speed;                // steps/s
+  int32_t acceleration;             // steps/s^2
+  int8_t sensor_pin;                // DS18B20 bus
+  int8_t heater_pin;                // SSR
+  float kp, ki, kd;                 // heater gains, see HeaterController
+  int8_t scale_dout_pin;            // HX711, -1 if no load cell is fitted
+  int8_t scale_sck_pin;
+  float scale_counts_per_gram;      // see LoadCell
+  float flow_kp, flow_ki;           // see FlowController
+  uint8_t sensor_count;             // 0 to search the bus again
+  ds18b20_addr_t sensors[SETTINGS_MAX_SENSORS];
+};
+
+class SettingsStore {
+  public:
+    SettingsStore();
+
+    // Initialises NVS, erasing it if it has no free pages, and opens the
+    // namespace.
+    bool open(void);
+
+    // Both return false, leaving *calibration as it was, if none of this
+    // version is stored.
+    bool loadCalibration(Calibration *calibration);
+    bool saveCalibration(const Calibration &calibration);
+
+    // source_hash is hashText() of the recipe text, or 0 for an upload.
+    // Loading also accepts an uploaded recipe, and needs axis_count to match.
+    bool loadRecipe(RecipeProgram *program, uint32_t source_hash, int axis_count);
+    bool saveRecipe(const RecipeProgram &program, uint32_t source_hash);
+
+    // Forgets everything stored.
+    bool erase(void);
+
+    static uint32_t hashText(const char *text);
+
+  private:
+    bool loadBlob(const char *key, void *value, size_t length);
+    bool saveBlob(const char *key, const void *value, size_t length);
+
+    nvs_handle handle;
+    bool opened;
+};
+
+#endif
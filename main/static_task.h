@@ -0,0 +1,51 @@
+/*
+ * StaticTask.h - FreeRTOS task with its stack and TCB in static memory.
+ *
+ * Every task of the firmware runs in one of these, declared at file scope
+ * or as a member of the object that owns the task, so all task memory is
+ * laid out at link time and none of it comes from the heap.  One
+ * StaticTask runs one task for the life of the firmware; starting it again
+ * is refused.
+ *
+ * Needs static allocation enabled in menuconfig.  The stack is in bytes,
+ * like every IDF stack size.
+ */
+
+// ensure this library description is only included once
+#ifndef StaticTask_h
+#define StaticTask_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#if !CONFIG_SUPPORT_STATIC_ALLOCATION
+#error "StaticTask needs static allocation (SUPPORT_STATIC_ALLOCATION) enabled in menuconfig"
+#endif
+
+template <uint32_t StackSize>
+class StaticTask {
+  public:
+    StaticTask() : handle(NULL) {}
+
+    // Returns false if the task could not be started, or already was.
+    bool start(TaskFunction_t function, const char *name, void *arg,
+        UBaseType_t priority, BaseType_t core) {
+      if (this->handle != NULL) {
+        return false;
+      }
+      this->handle = xTaskCreateStaticPinnedToCore(function, name, StackSize, arg,
+          priority, this->stack, &this->tcb, core);
+      return this->handle != NULL;
+    }
+
+    TaskHandle_t task(void) const { return this->handle; }
+
+  private:
+    TaskHandle_t handle;
+    StackType_t stack[StackSize];
+    StaticTask_t tcb;
+};
+
+#endif
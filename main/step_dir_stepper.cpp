@@ -0,0 +1,280 @@
+/*
+ * StepDirStepper.cpp - drives a STEP/DIR driver with RMT pulse trains.
+ */
+
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include "driver/gpio.h"
+#include "driver/rmt.h"
+#include "soc/rmt_struct.h"
+#include "step_dir_stepper.h"
+
+// The RMT is clocked from the 80 MHz APB clock.
+#define STEP_DIR_TICKS_PER_US 80
+// Item durations are 15 bit tick counts.
+#define STEP_DIR_MAX_DURATION 32767
+
+// One memory block per channel, refilled half a block at a time.
+#define STEP_DIR_MEM_ITEMS RMT_MEM_ITEM_NUM
+#define STEP_DIR_HALF_ITEMS (STEP_DIR_MEM_ITEMS / 2)
+
+// RMT.int_* bits of a channel
+#define STEP_DIR_TX_END_BIT(ch) (1UL << ((ch) * 3))
+#define STEP_DIR_TX_THR_BIT(ch) (1UL << ((ch) + 24))
+
+static const char* LOG_TAG = "StepDirStepper";
+
+// Which StepDirStepper, if any, owns each RMT channel.
+static StepDirStepper *channel_owner[RMT_CHANNEL_MAX];
+static rmt_isr_handle_t isr_handle;
+// RMT.int_ena is shared by all channels.
+static portMUX_TYPE rmt_mux = portMUX_INITIALIZER_UNLOCKED;
+
+StepDirStepper::StepDirStepper(int number_of_steps, int step_pin, int dir_pin, rmt_channel_t channel)
+{
+	this->direction = 0;
+	this->step_delay = 0;
+	this->acceleration = 0;
+	this->jerk = 0;
+	this->number_of_steps = number_of_steps;
+	this->step_pin = (gpio_num_t) step_pin;
+	this->dir_pin = (gpio_num_t) dir_pin;
+	this->channel = channel;
+	this->clock_divider = 1;
+	this->cruise_item.val = 0;
+	this->refill_offset = 0;
+	this->steps_left = 0;
+	this->steps_done = 0;
+
+	gpio_config_t io_conf;
+	io_conf.intr_type = GPIO_INTR_DISABLE;
+	io_conf.mode = GPIO_MODE_OUTPUT;
+	io_conf.pin_bit_mask = (1ULL<<dir_pin);
+	io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+	io_conf.pull_up_en = GPIO_PULLUP_DISABLE;
+	gpio_config(&io_conf);
+
+	rmt_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.rmt_mode = RMT_MODE_TX;
+	config.channel = channel;
+	config.clk_div = this->clock_divider;
+	config.gpio_num = this->step_pin;
+	config.mem_block_num = 1;
+	config.tx_config.loop_en = false;
+	config.tx_config.carrier_freq_hz = 0;
+	config.tx_config.carrier_duty_percent = 0;
+	config.tx_config.carrier_level = RMT_CARRIER_LEVEL_LOW;
+	config.tx_config.carrier_en = false;
+	config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+	config.tx_config.idle_output_en = true;
+	rmt_config(&config);
+	RMT.apb_conf.mem_tx_wrap_en = 1;
+
+	channel_owner[channel] = this;
+	if (isr_handle == NULL) {
+		esp_err_t err = rmt_isr_register(&StepDirStepper::isr, NULL,
+				ESP_INTR_FLAG_IRAM, &isr_handle);
+		if (err != ESP_OK) {
+			ESP_LOGE(LOG_TAG, "Failed to register RMT ISR: %d", err);
+		}
+	}
+
+	// default to 60 RPM without acceleration
+	this->setSpeed(60);
+}
+
+/*
+ * Sets the speed in revs per minute
+ */
+void StepDirStepper::setSpeed(long whatSpeed)
+{
+	this->step_delay = 60L * 1000L * 1000L / this->number_of_steps / whatSpeed;
+	this->updateProfile();
+}
+
+/*
+ * Sets the speed in steps per second
+ */
+void StepDirStepper::setMaxSpeed(long steps_per_second)
+{
+	this->step_delay = 1000L * 1000L / steps_per_second;
+	this->updateProfile();
+}
+
+void StepDirStepper::setAcceleration(long steps_per_second_2)
+{
+	this->acceleration = steps_per_second_2;
+	this->updateProfile();
+}
+
+void StepDirStepper::setJerk(long steps_per_second_3)
+{
+	this->jerk = steps_per_second_3;
+	this->updateProfile();
+}
+
+/*
+ * Recomputes the ramp and turns it into RMT items.  The clock divider is
+ * picked as small as possible, for the finest timing, while still fitting
+ * the slowest step of the ramp into one item.
+ */
+void StepDirStepper::updateProfile(void)
+{
+	if (this->completion.isRunning()) {
+		ESP_LOGW(LOG_TAG, "Profile change ignored while moving");
+		return;
+	}
+	this->profile.configure(this->step_delay, this->acceleration, this->jerk);
+
+	uint32_t slowest = this->profile.delayAt(0);
+	uint32_t divider = (slowest * STEP_DIR_TICKS_PER_US + STEP_DIR_MAX_DURATION - 1)
+			/ STEP_DIR_MAX_DURATION;
+	if (divider < 1) {
+		divider = 1;
+	}
+	if (divider > 255) {
+		ESP_LOGW(LOG_TAG, "Step interval of %u us is too long, slowest steps are shortened",
+				slowest);
+		divider = 255;
+	}
+	this->clock_divider = (uint8_t) divider;
+	rmt_set_clk_div(this->channel, this->clock_divider);
+
+	// entries past the ramp hold the cruise item, so the ISR needs no bound
+	for (uint32_t i = 0; i < MOTION_PROFILE_TABLE_SIZE; i++) {
+		this->ramp_items[i] = this->makeItem(this->profile.delayAt(i));
+	}
+	this->cruise_item = this->makeItem(this->profile.cruiseDelay());
+}
+
+/*
+ * One step: STEP low for the rest of the interval, then the pulse.  Holding
+ * STEP low first also gives the driver its DIR setup time.
+ */
+rmt_item32_t StepDirStepper::makeItem(uint32_t delay_us) const
+{
+	uint32_t total = delay_us * STEP_DIR_TICKS_PER_US / this->clock_divider;
+	uint32_t pulse = STEP_DIR_PULSE_US * STEP_DIR_TICKS_PER_US / this->clock_divider;
+	if (pulse < 1) {
+		pulse = 1;
+	}
+	// a zero duration would end the transmission
+	uint32_t low = (total > pulse) ? total - pulse : 1;
+	if (low > STEP_DIR_MAX_DURATION) {
+		low = STEP_DIR_MAX_DURATION;
+	}
+
+	rmt_item32_t item;
+	item.level0 = 0;
+	item.duration0 = low;
+	item.level1 = 1;
+	item.duration1 = pulse;
+	return item;
+}
+
+/*
+ * Moves the motor steps_to_move steps.  If the number is negative,
+ * the motor moves in the reverse direction.
+ *
+ * Blocks the calling task until the move is complete.
+ */
+void StepDirStepper::step(int steps_to_move)
+{
+	if (this->moveAsync(steps_to_move)) {
+		this->waitForCompletion(portMAX_DELAY);
+	}
+}
+
+/*
+ * Starts a move and returns immediately.  Returns false if a move is
+ * already in progress.
+ */
+bool StepDirStepper::moveAsync(int steps_to_move)
+{
+	if (this->completion.isRunning()) {
+		ESP_LOGW(LOG_TAG, "Move already in progress");
+		return false;
+	}
+	if (steps_to_move == 0) {
+		return true;
+	}
+
+	if (steps_to_move > 0) { this->direction = 1; }
+	if (steps_to_move < 0) { this->direction = 0; }
+	gpio_set_level(this->dir_pin, this->direction);
+
+	this->steps_left = abs(steps_to_move);
+	this->steps_done = 0;
+
+	// load the whole memory block; the threshold interrupt takes over from there
+	int ch = this->channel;
+	RMT.conf_ch[ch].conf1.mem_owner = RMT_MEM_OWNER_TX;
+	RMT.conf_ch[ch].conf1.mem_rd_rst = 1;
+	RMT.conf_ch[ch].conf1.mem_rd_rst = 0;
+	this->fillItems(0, STEP_DIR_MEM_ITEMS);
+	this->refill_offset = 0;
+	RMT.tx_lim_ch[ch].limit = STEP_DIR_HALF_ITEMS;
+
+	this->completion.start();
+	portENTER_CRITICAL(&rmt_mux);
+	RMT.int_clr.val = STEP_DIR_TX_THR_BIT(ch) | STEP_DIR_TX_END_BIT(ch);
+	RMT.int_ena.val |= STEP_DIR_TX_THR_BIT(ch) | STEP_DIR_TX_END_BIT(ch);
+	portEXIT_CRITICAL(&rmt_mux);
+	RMT.conf_ch[ch].conf1.tx_start = 1;
+	return true;
+}
+
+/*
+ * Writes the next count items of the move into RMT memory at offset,
+ * padding with end markers once every step has been written.
+ */
+void IRAM_ATTR StepDirStepper::fillItems(int offset, int count)
+{
+	volatile rmt_item32_t *memory = &RMTMEM.chan[this->channel].data32[offset];
+	for (int i = 0; i < count; i++) {
+		uint32_t left = this->steps_left;
+		if (left == 0) {
+			memory[i].val = 0;
+			continue;
+		}
+		uint32_t done = this->steps_done;
+		uint32_t index = (done < left - 1) ? done : left - 1;
+		memory[i].val = (index < MOTION_PROFILE_TABLE_SIZE)
+				? this->ramp_items[index].val : this->cruise_item.val;
+		this->steps_left = left - 1;
+		this->steps_done = done + 1;
+	}
+}
+
+/*
+ * Shared RMT interrupt.  A threshold event means half the memory block has
+ * been sent and can be refilled; an end event means the move is done.
+ */
+void IRAM_ATTR StepDirStepper::isr(void *arg)
+{
+	uint32_t status = RMT.int_st.val;
+
+	for (int ch = 0; ch < RMT_CHANNEL_MAX; ch++) {
+		StepDirStepper *stepper = channel_owner[ch];
+		if (stepper == NULL) {
+			continue;
+		}
+		if (status & STEP_DIR_TX_THR_BIT(ch)) {
+			RMT.int_clr.val = STEP_DIR_TX_THR_BIT(ch);
+			stepper->fillItems(stepper->refill_offset, STEP_DIR_HALF_ITEMS);
+			stepper->refill_offset ^= STEP_DIR_HALF_ITEMS;
+		}
+		if (status & STEP_DIR_TX_END_BIT(ch)) {
+			RMT.int_clr.val = STEP_DIR_TX_END_BIT(ch);
+			portENTER_CRITICAL_ISR(&rmt_mux);
+			RMT.int_ena.val &= ~(STEP_DIR_TX_THR_BIT(ch) | STEP_DIR_TX_END_BIT(ch));
+			portEXIT_CRITICAL_ISR(&rmt_mux);
+			stepper->completion.finishFromISR();
+		}
+	}
+}
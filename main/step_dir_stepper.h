@@ -0,0 +1,81 @@
+/*
+ * StepDirStepper.h - drives a STEP/DIR driver (A4988, DRV8825, TMC2xxx...)
+ * with pulse trains generated by the RMT peripheral.
+ *
+ * Every ramp step is turned into an RMT item (low for the rest of the step
+ * interval, then a short STEP pulse) ahead of time, whenever the speed or
+ * acceleration changes.  A move copies those items into the channel's RMT
+ * memory, which the peripheral plays back on its own.  The memory block
+ * wraps, and a threshold interrupt refills the half that has just been
+ * sent, so the CPU is only involved once every 32 steps no matter how fast
+ * the motor runs.  The end-of-transmission interrupt completes the move.
+ *
+ * The channel is driven through its registers with a shared interrupt
+ * handler that only looks at StepDirStepper channels, so it cannot be used
+ * together with the IDF RMT driver (rmt_driver_install).
+ */
+
+// ensure this library description is only included once
+#ifndef StepDirStepper_h
+#define StepDirStepper_h
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "driver/rmt.h"
+#include "motion_profile.h"
+#include "move_completion.h"
+
+// Width of the STEP pulse in us; comfortably above what common drivers need.
+#define STEP_DIR_PULSE_US 2
+
+class StepDirStepper {
+  public:
+    // constructor, step_pin is routed to the RMT channel:
+    StepDirStepper(int number_of_steps, int step_pin, int dir_pin, rmt_channel_t channel);
+
+    // speed setter methods:
+    void setSpeed(long whatSpeed);
+    void setMaxSpeed(long steps_per_second);
+    void setAcceleration(long steps_per_second_2);
+    void setJerk(long steps_per_second_3);
+
+    // mover method, blocks until the move is done:
+    void step(int number_of_steps);
+
+    // non-blocking mover methods:
+    bool moveAsync(int number_of_steps);
+    bool isRunning(void) const { return this->completion.isRunning(); }
+    bool waitForCompletion(TickType_t timeout) { return this->completion.wait(timeout); }
+    void setCompletionEventGroup(EventGroupHandle_t group, EventBits_t bits) {
+      this->completion.setEventGroup(group, bits);
+    }
+
+  private:
+    static void isr(void *arg);
+    void fillItems(int offset, int count);
+    rmt_item32_t makeItem(uint32_t delay_us) const;
+    void updateProfile(void);
+
+    int direction;            // direction of rotation
+    unsigned long step_delay; // cruise delay between steps, in us
+    long acceleration;        // steps/s^2, 0 for constant speed
+    long jerk;                // steps/s^3, 0 for trapezoidal ramps
+    int number_of_steps;      // total number of steps this motor can take
+
+    gpio_num_t step_pin;
+    gpio_num_t dir_pin;
+    rmt_channel_t channel;
+    uint8_t clock_divider;    // RMT ticks are clock_divider / 80 us long
+
+    MotionProfile profile;                        // step intervals of the ramp
+    rmt_item32_t ramp_items[MOTION_PROFILE_TABLE_SIZE]; // one item per ramp step
+    rmt_item32_t cruise_item;                     // item for every cruise step
+
+    int refill_offset;              // half of RMT memory the next refill goes to
+    volatile uint32_t steps_left;   // items still to be written to RMT memory
+    volatile uint32_t steps_done;   // items written so far
+    MoveCompletion completion;      // wakes waiters from the end interrupt
+};
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * StepTimer.cpp - hardware timer wrapper used to pace stepper motors.
+ */
+
+#include <esp_log.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include "driver/timer.h"
+#include "soc/timer_group_struct.h"
+#include "step_timer.h"
+#include "hrclock.h"
+#include "sdkconfig.h"
+
+// Timers count at 1 MHz so alarm values are plain microseconds.
+#define STEP_TIMER_DIVIDER (TIMER_BASE_CLK / 1000000)
+
+static const char* LOG_TAG = "StepTimer";
+
+// Which of the four hardware timers have been handed out.
+static bool timer_in_use[TIMER_GROUP_MAX][TIMER_MAX];
+static portMUX_TYPE timer_mux = portMUX_INITIALIZER_UNLOCKED;
+
+StepTimer::StepTimer()
+{
+	this->group = TIMER_GROUP_MAX;
+	this->index = TIMER_0;
+	this->interrupt = NULL;
+	this->callback = NULL;
+	this->callback_arg = NULL;
+	this->trace = NULL;
+	this->due = 0;
+}
+
+StepTimer::~StepTimer()
+{
+	this->detach();
+}
+
+/*
+ * Claims the first free hardware timer and installs the alarm ISR.
+ */
+bool StepTimer::attach(callback_t callback, void *arg)
+{
+	if (this->attached()) {
+		return true;
+	}
+
+	timer_group_t found_group = TIMER_GROUP_MAX;
+	timer_idx_t found_index = TIMER_0;
+	portENTER_CRITICAL(&timer_mux);
+	for (int g = 0; g < TIMER_GROUP_MAX && found_group == TIMER_GROUP_MAX; g++) {
+		for (int i = 0; i < TIMER_MAX; i++) {
+			if (!timer_in_use[g][i]) {
+				timer_in_use[g][i] = true;
+				found_group = (timer_group_t) g;
+				found_index = (timer_idx_t) i;
+				break;
+			}
+		}
+	}
+	portEXIT_CRITICAL(&timer_mux);
+
+	if (found_group == TIMER_GROUP_MAX) {
+		ESP_LOGE(LOG_TAG, "No free hardware timer");
+		return false;
+	}
+
+	this->callback = callback;
+	this->callback_arg = arg;
+
+	timer_config_t config;
+	config.alarm_en = TIMER_ALARM_EN;
+	config.counter_en = TIMER_PAUSE;
+	config.intr_type = TIMER_INTR_LEVEL;
+	config.counter_dir = TIMER_COUNT_UP;
+	config.auto_reload = TIMER_AUTORELOAD_EN;
+	config.divider = STEP_TIMER_DIVIDER;
+	timer_init(found_group, found_index, &config);
+	timer_set_counter_value(found_group, found_index, 0);
+	timer_enable_intr(found_group, found_index);
+	esp_err_t err = timer_isr_register(found_group, found_index, &StepTimer::isr, this,
+			ESP_INTR_FLAG_IRAM, &this->interrupt);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to register timer ISR: %d", err);
+		portENTER_CRITICAL(&timer_mux);
+		timer_in_use[found_group][found_index] = false;
+		portEXIT_CRITICAL(&timer_mux);
+		return false;
+	}
+
+	this->group = found_group;
+	this->index = found_index;
+	ESP_LOGD(LOG_TAG, "Attached to timer %d:%d", found_group, found_index);
+	return true;
+}
+
+void StepTimer::detach(void)
+{
+	if (!this->attached()) {
+		return;
+	}
+	timer_pause(this->group, this->index);
+	timer_disable_intr(this->group, this->index);
+	esp_intr_free(this->interrupt);
+	this->interrupt = NULL;
+
+	portENTER_CRITICAL(&timer_mux);
+	timer_in_use[this->group][this->index] = false;
+	portEXIT_CRITICAL(&timer_mux);
+	this->group = TIMER_GROUP_MAX;
+}
+
+void StepTimer::setCallback(callback_t callback, void *arg)
+{
+	this->callback = callback;
+	this->callback_arg = arg;
+}
+
+/*
+ * Arms the timer so the callback first runs delay_us from now.
+ */
+void StepTimer::start(uint32_t delay_us)
+{
+	if (delay_us < STEP_TIMER_MIN_DELAY_US) {
+		delay_us = STEP_TIMER_MIN_DELAY_US;
+	}
+	timer_pause(this->group, this->index);
+	timer_set_counter_value(this->group, this->index, 0);
+	timer_set_alarm_value(this->group, this->index, delay_us);
+	timer_set_alarm(this->group, this->index, TIMER_ALARM_EN);
+	if (this->trace != NULL) {
+		this->due = hrclock_cycles() + delay_us * HRCLOCK_CYCLES_PER_US;
+	}
+	timer_start(this->group, this->index);
+}
+
+void StepTimer::stop(void)
+{
+	timer_pause(this->group, this->index);
+}
+
+/*
+ * Alarm interrupt.  The counter has already been reloaded to 0 by hardware,
+ * so the next alarm value is simply the next interval.
+ */
+void IRAM_ATTR StepTimer::isr(void *arg)
+{
+	StepTimer *timer = (StepTimer *) arg;
+	uint32_t entry = hrclock_cycles();
+	timg_dev_t *dev = (timer->group == TIMER_GROUP_0) ? &TIMERG0 : &TIMERG1;
+
+	if (timer->index == TIMER_0) {
+		dev->int_clr_timers.t0 = 1;
+	} else {
+		dev->int_clr_timers.t1 = 1;
+	}
+
+	uint32_t next = timer->callback(timer->callback_arg);
+	if (next != 0 && next < STEP_TIMER_MIN_DELAY_US) {
+		next = STEP_TIMER_MIN_DELAY_US;
+	}
+	if (timer->trace != NULL) {
+		uint32_t exit = hrclock_cycles();
+		uint32_t due = timer->due;
+		timer->due = due + next * HRCLOCK_CYCLES_PER_US;
+		bool missed = next != 0 && (int32_t) (exit - timer->due) >= 0;
+		if (missed) {
+			// an alarm already passed fires as soon as it is enabled, and
+			// the schedule carries on from there
+			timer->due = exit;
+		}
+		timer->trace->record(due, entry, exit, missed);
+	}
+	if (next == 0) {
+		dev->hw_timer[timer->index].config.enable = 0;
+		return;
+	}
+	dev->hw_timer[timer->index].alarm_high = 0;
+	dev->hw_timer[timer->index].alarm_low = next;
+	dev->hw_timer[timer->index].config.alarm_en = TIMER_ALARM_EN;
+}
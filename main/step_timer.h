@@ -0,0 +1,67 @@
+/*
+ * StepTimer.h - hardware timer wrapper used to pace stepper motors.
+ *
+ * Each StepTimer claims one of the four general purpose timers (two per
+ * timer group) and calls back from its alarm interrupt.  The callback returns
+ * the number of microseconds until it should run again, or 0 to stop.
+ *
+ * The timer runs with auto-reload enabled, so the counter restarts from 0 in
+ * hardware at every alarm.  Interrupt latency therefore never accumulates
+ * into the step period: each interval is measured from the previous alarm,
+ * not from whenever the ISR got around to running.
+ */
+
+// ensure this library description is only included once
+#ifndef StepTimer_h
+#define StepTimer_h
+
+#include <stdint.h>
+#include "driver/timer.h"
+#include "step_timing_trace.h"
+
+// Shortest interval we will program; anything below this is mostly ISR overhead.
+#define STEP_TIMER_MIN_DELAY_US 10
+
+class StepTimer {
+  public:
+    // Called from the alarm ISR.  Returns the delay to the next call in us,
+    // or 0 to stop the timer.  The ISR is allocated with ESP_INTR_FLAG_IRAM,
+    // so the callback and everything it calls must live in IRAM.
+    typedef uint32_t (*callback_t)(void *arg);
+
+    StepTimer();
+    ~StepTimer();
+
+    // Claims a free hardware timer and installs the ISR.  The interrupt is
+    // allocated on the calling core.  Returns false if no timer is free.
+    bool attach(callback_t callback, void *arg);
+    bool attached(void) const { return this->group != TIMER_GROUP_MAX; }
+    // Stops the timer, frees its interrupt and hands it back.
+    void detach(void);
+
+    // Replaces the callback.  Only call this while the timer is stopped.
+    void setCallback(callback_t callback, void *arg);
+
+    // Arms the timer so the callback first runs delay_us from now.
+    void start(uint32_t delay_us);
+    // Stops the timer from task context.  The callback may also stop it by
+    // returning 0.
+    void stop(void);
+
+    // Records the timing of every alarm into trace, or nothing for NULL.
+    // Only change it while the timer is stopped.
+    void setTrace(StepTimingTrace *trace) { this->trace = trace; }
+
+  private:
+    static void isr(void *arg);
+
+    timer_group_t group;      // TIMER_GROUP_MAX while unattached
+    timer_idx_t index;
+    intr_handle_t interrupt;
+    callback_t callback;
+    void *callback_arg;
+    StepTimingTrace *trace;   // optional timing instrumentation
+    uint32_t due;             // CCOUNT of the next alarm while tracing
+};
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * StepTimingTrace.cpp - on-target step timing instrumentation.
+ */
+
+#include <stdio.h>
+#include "esp_attr.h"
+#include "hrclock.h"
+#include "telemetry.h"
+#include "step_timing_trace.h"
+
+// Longest histogram bar when dumping
+#define STEP_TRACE_BAR_WIDTH 40
+// Samples dump() prints
+#define STEP_TRACE_DUMP_SAMPLES 8
+
+StepTimingTrace::StepTimingTrace()
+{
+	this->reset_requested = false;
+	this->ring_head = 0;
+	this->clear();
+}
+
+void IRAM_ATTR StepTimingTrace::clear(void)
+{
+	this->step_count = 0;
+	this->missed = 0;
+	this->min_latency = UINT32_MAX;
+	this->max_latency = 0;
+	this->min_jitter = UINT32_MAX;
+	this->max_jitter = 0;
+	for (int i = 0; i < STEP_TRACE_BINS; i++) {
+		this->histogram[i] = 0;
+	}
+}
+
+/*
+ * Adds one step.  Runs in the step ISR, so only counters and a ring slot
+ * are touched.
+ */
+void IRAM_ATTR StepTimingTrace::record(uint32_t due, uint32_t entry, uint32_t exit, bool missed)
+{
+	if (this->reset_requested) {
+		this->clear();
+		this->reset_requested = false;
+	}
+	uint32_t latency = entry - due;
+	uint32_t jitter = exit - due;
+	if (latency < this->min_latency) {
+		this->min_latency = latency;
+	}
+	if (latency > this->max_latency) {
+		this->max_latency = latency;
+	}
+	if (jitter < this->min_jitter) {
+		this->min_jitter = jitter;
+	}
+	if (jitter > this->max_jitter) {
+		this->max_jitter = jitter;
+	}
+	uint32_t bin = hrclock_cycles_to_us(jitter);
+	if (bin >= STEP_TRACE_BINS) {
+		bin = STEP_TRACE_BINS - 1;
+	}
+	this->histogram[bin] = this->histogram[bin] + 1;
+	this->step_count = this->step_count + 1;
+	if (missed) {
+		this->missed = this->missed + 1;
+	}
+
+	uint32_t head = this->ring_head;
+	StepTimingSample *sample = &this->ring[head & (STEP_TRACE_RING_LENGTH - 1)];
+	sample->due = due;
+	sample->entry = entry;
+	sample->exit = exit;
+	TELEMETRY_BARRIER();
+	this->ring_head = head + 1;
+}
+
+/*
+ * Copies the newest samples, then drops any the ISR may have overwritten
+ * while they were being copied.
+ */
+int StepTimingTrace::recent(StepTimingSample *out, int count) const
+{
+	uint32_t head = this->ring_head;
+	uint32_t available = head < STEP_TRACE_RING_LENGTH ? head : STEP_TRACE_RING_LENGTH;
+	if ((uint32_t) count > available) {
+		count = available;
+	}
+	uint32_t first = head - count;
+	TELEMETRY_BARRIER();
+	for (int i = 0; i < count; i++) {
+		out[i] = this->ring[(first + i) & (STEP_TRACE_RING_LENGTH - 1)];
+	}
+	TELEMETRY_BARRIER();
+	// slots below this position have been reused since
+	uint32_t oldest_intact = this->ring_head - STEP_TRACE_RING_LENGTH + 1;
+	int skip = 0;
+	while (skip < count && (int32_t) (first + skip - oldest_intact) < 0) {
+		skip++;
+	}
+	for (int i = skip; i < count; i++) {
+		out[i - skip] = out[i];
+	}
+	return count - skip;
+}
+
+uint32_t StepTimingTrace::jitterPercentile(uint32_t per_mille) const
+{
+	uint64_t wanted = ((uint64_t) this->step_count * per_mille + 999) / 1000;
+	uint64_t seen = 0;
+	for (int i = 0; i < STEP_TRACE_BINS; i++) {
+		seen += this->histogram[i];
+		if (seen >= wanted) {
+			return i;
+		}
+	}
+	return STEP_TRACE_BINS - 1;
+}
+
+/*
+ * Prints from task context while the ISR may keep recording, so the
+ * figures can be a step or so apart from each other.
+ */
+void StepTimingTrace::dump(void)
+{
+	uint32_t steps = this->step_count;
+	printf("Step timing: %u steps, %u missed deadlines\n", steps, this->missed);
+	if (steps == 0) {
+		return;
+	}
+	printf("  latency %u..%u us, jitter %u..%u us, p50 %u us, p99 %u us, p99.9 %u us\n",
+			hrclock_cycles_to_us(this->min_latency), hrclock_cycles_to_us(this->max_latency),
+			hrclock_cycles_to_us(this->min_jitter), hrclock_cycles_to_us(this->max_jitter),
+			this->jitterPercentile(500), this->jitterPercentile(990),
+			this->jitterPercentile(999));
+
+	uint32_t largest = 0;
+	for (int i = 0; i < STEP_TRACE_BINS; i++) {
+		if (this->histogram[i] > largest) {
+			largest = this->histogram[i];
+		}
+	}
+	for (int i = 0; i < STEP_TRACE_BINS; i++) {
+		uint32_t count = this->histogram[i];
+		if (count == 0) {
+			continue;
+		}
+		char bar[STEP_TRACE_BAR_WIDTH + 1];
+		uint32_t width = (uint32_t) ((uint64_t) count * STEP_TRACE_BAR_WIDTH / largest);
+		if (width == 0) {
+			width = 1;
+		}
+		for (uint32_t c = 0; c < width; c++) {
+			bar[c] = '#';
+		}
+		bar[width] = '\0';
+		printf("  %s%2d us %10u %s\n", i == STEP_TRACE_BINS - 1 ? ">=" : "  ", i, count, bar);
+	}
+
+	StepTimingSample latest[STEP_TRACE_DUMP_SAMPLES];
+	int count = this->recent(latest, STEP_TRACE_DUMP_SAMPLES);
+	printf("  latest steps, cycles after due at entry and once stepped:\n");
+	for (int i = 0; i < count; i++) {
+		printf("    due %10u  +%6u  +%6u\n", latest[i].due, latest[i].entry - latest[i].due,
+				latest[i].exit - latest[i].due);
+	}
+}
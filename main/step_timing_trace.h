@@ -0,0 +1,82 @@
+/*
+ * StepTimingTrace.h - on-target step timing instrumentation.
+ *
+ * A StepTimer with a trace attached keeps the CCOUNT at which each alarm
+ * is due: the time it was started plus every interval since, in CPU
+ * cycles.  Because the timer reloads at the alarm in hardware, that is
+ * exactly when the alarm fires.  Each ISR then records
+ *  - its entry latency, CCOUNT at entry minus the due time, and
+ *  - its jitter, CCOUNT once the callback returned (the coils have been
+ *    written by then) minus the due time,
+ * and flags a missed deadline if the next alarm was already due by the
+ * time the callback returned.
+ *
+ * Jitter goes into a histogram of 1 us bins; min/max latency and jitter,
+ * step and miss counts are kept alongside, and the raw samples go into a
+ * ring that the ISR overwrites, so it always holds the latest steps.  All
+ * of it is written only by the ISR; reset() just asks the ISR to clear it,
+ * and readers check the ring position to skip samples overwritten while
+ * they copied them.
+ *
+ * CCOUNT is per core: the timer must be started from the core that owns
+ * its interrupt, i.e. the core that attached it.
+ */
+
+// ensure this library description is only included once
+#ifndef StepTimingTrace_h
+#define StepTimingTrace_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+#define STEP_TRACE_BINS 64            // 1 us histogram bins, the last collects the rest
+#define STEP_TRACE_RING_LENGTH CONFIG_POUR_BOT_STEP_TRACE_SAMPLES   // set in menuconfig
+#if (STEP_TRACE_RING_LENGTH & (STEP_TRACE_RING_LENGTH - 1)) != 0
+#error "CONFIG_POUR_BOT_STEP_TRACE_SAMPLES must be a power of two"
+#endif
+
+// One step, in CCOUNT cycles.
+struct StepTimingSample {
+  uint32_t due;               // when the alarm fired
+  uint32_t entry;             // when the ISR was entered
+  uint32_t exit;              // when the callback had stepped
+};
+
+class StepTimingTrace {
+  public:
+    StepTimingTrace();
+
+    // Called from the step ISR for every alarm.
+    void record(uint32_t due, uint32_t entry, uint32_t exit, bool missed);
+
+    // Clears everything, on the next step.
+    void reset(void) { this->reset_requested = true; }
+
+    uint32_t steps(void) const { return this->step_count; }
+    uint32_t missedDeadlines(void) const { return this->missed; }
+    // Jitter in us that per_mille of the steps stay within, from the histogram.
+    uint32_t jitterPercentile(uint32_t per_mille) const;
+
+    // Copies up to count of the latest samples, oldest first; returns how many.
+    int recent(StepTimingSample *out, int count) const;
+
+    // Prints the statistics, the histogram and the latest samples.
+    void dump(void);
+
+  private:
+    void clear(void);
+
+    volatile bool reset_requested;
+    volatile uint32_t step_count;
+    volatile uint32_t missed;
+    volatile uint32_t min_latency;    // cycles
+    volatile uint32_t max_latency;
+    volatile uint32_t min_jitter;
+    volatile uint32_t max_jitter;
+    volatile uint32_t histogram[STEP_TRACE_BINS];
+    StepTimingSample ring[STEP_TRACE_RING_LENGTH];
+    volatile uint32_t ring_head;      // samples ever written, free running
+};
+
+#endif
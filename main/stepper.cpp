@@ -80,17 +80,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "soc/gpio_struct.h"
+#include "driver/ledc.h"
+#include "soc/ledc_struct.h"
+#include "esp_attr.h"
+#include "hrclock.h"
+#include "deferred_log.h"
 #include "stepper.h"
 #include "sdkconfig.h"
 
-static uint32_t HIGH = 1;
-static uint32_t LOW = 0;
-
 static const char* LOG_TAG = "Stepper";
 
 
@@ -145,7 +147,40 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2)
 	this->step_number = 0;    // which step the motor is on
 	this->direction = 0;      // motor direction
 	this->last_step_time = 0; // time stamp in us of the last step taken
+	this->acceleration = 0;   // constant speed until told otherwise
+	this->jerk = 0;
+	this->steps_left = 0;     // no move in progress
+	this->steps_done = 0;
 	this->number_of_steps = number_of_steps; // total number of steps for this motor
+	this->steps_per_revolution = number_of_steps;
+	this->step_mode = FULL_STEP;
+	this->fixed_callback = NULL;
+	this->phase = 0;
+	this->pwm_attached = false;
+	this->pwm_timer = LEDC_TIMER_0;
+	this->pwm_channel = LEDC_CHANNEL_0;
+	this->pwm_duties = NULL;
+	this->pwm_stride = 1;
+	this->telemetry = NULL;
+	this->position = 0;
+	this->stop_requested = false;
+	this->soft_limits = false;
+	this->min_position = 0;
+	this->max_position = 0;
+	this->limit_pin = GPIO_NUM_MAX;
+	this->limit_active_level = 0;
+	this->hold_timer = NULL;
+	this->hold_timeout_us = 0;
+	this->hold_percent = 0;
+	this->released = true;    // coils are off until the first move
+	this->energized_time = 0;
+	this->coordinated = false;
+	this->coordinator_owned = false;
+	vPortCPUInitializeMutex(&this->hold_lock);
+	this->feedback = NULL;
+	this->feedback_max_error = 0;
+	this->feedback_offset = 0;
+	this->stall_detected = false;
 
 	// Arduino pins for the motor control connection:
 	this->motor_pin_1 = mapFromInt(motor_pin_1);
@@ -173,6 +208,8 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2)
 
 	// pin_count is used by the stepMotor() method:
 	this->pin_count = 2;
+
+	this->buildCoilPatterns();
 }
 
 
@@ -186,7 +223,40 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 	this->step_number = 0;    // which step the motor is on
 	this->direction = 0;      // motor direction
 	this->last_step_time = 0; // time stamp in us of the last step taken
+	this->acceleration = 0;   // constant speed until told otherwise
+	this->jerk = 0;
+	this->steps_left = 0;     // no move in progress
+	this->steps_done = 0;
 	this->number_of_steps = number_of_steps; // total number of steps for this motor
+	this->steps_per_revolution = number_of_steps;
+	this->step_mode = FULL_STEP;
+	this->fixed_callback = NULL;
+	this->phase = 0;
+	this->pwm_attached = false;
+	this->pwm_timer = LEDC_TIMER_0;
+	this->pwm_channel = LEDC_CHANNEL_0;
+	this->pwm_duties = NULL;
+	this->pwm_stride = 1;
+	this->telemetry = NULL;
+	this->position = 0;
+	this->stop_requested = false;
+	this->soft_limits = false;
+	this->min_position = 0;
+	this->max_position = 0;
+	this->limit_pin = GPIO_NUM_MAX;
+	this->limit_active_level = 0;
+	this->hold_timer = NULL;
+	this->hold_timeout_us = 0;
+	this->hold_percent = 0;
+	this->released = true;    // coils are off until the first move
+	this->energized_time = 0;
+	this->coordinated = false;
+	this->coordinator_owned = false;
+	vPortCPUInitializeMutex(&this->hold_lock);
+	this->feedback = NULL;
+	this->feedback_max_error = 0;
+	this->feedback_offset = 0;
+	this->stall_detected = false;
 
 	// Arduino pins for the motor control connection:
 	this->motor_pin_1 = mapFromInt(motor_pin_1);
@@ -214,6 +284,8 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 
 	// pin_count is used by the stepMotor() method:
 	this->pin_count = 4;
+
+	this->buildCoilPatterns();
 }
 
 /*
@@ -227,7 +299,40 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 	this->step_number = 0;    // which step the motor is on
 	this->direction = 0;      // motor direction
 	this->last_step_time = 0; // time stamp in us of the last step taken
+	this->acceleration = 0;   // constant speed until told otherwise
+	this->jerk = 0;
+	this->steps_left = 0;     // no move in progress
+	this->steps_done = 0;
 	this->number_of_steps = number_of_steps; // total number of steps for this motor
+	this->steps_per_revolution = number_of_steps;
+	this->step_mode = FULL_STEP;
+	this->fixed_callback = NULL;
+	this->phase = 0;
+	this->pwm_attached = false;
+	this->pwm_timer = LEDC_TIMER_0;
+	this->pwm_channel = LEDC_CHANNEL_0;
+	this->pwm_duties = NULL;
+	this->pwm_stride = 1;
+	this->telemetry = NULL;
+	this->position = 0;
+	this->stop_requested = false;
+	this->soft_limits = false;
+	this->min_position = 0;
+	this->max_position = 0;
+	this->limit_pin = GPIO_NUM_MAX;
+	this->limit_active_level = 0;
+	this->hold_timer = NULL;
+	this->hold_timeout_us = 0;
+	this->hold_percent = 0;
+	this->released = true;    // coils are off until the first move
+	this->energized_time = 0;
+	this->coordinated = false;
+	this->coordinator_owned = false;
+	vPortCPUInitializeMutex(&this->hold_lock);
+	this->feedback = NULL;
+	this->feedback_max_error = 0;
+	this->feedback_offset = 0;
+	this->stall_detected = false;
 
 	// Arduino pins for the motor control connection:
 	this->motor_pin_1 = mapFromInt(motor_pin_1);
@@ -253,15 +358,16 @@ Stepper::Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
 
 	// pin_count is used by the stepMotor() method:
 	this->pin_count = 5;
+
+	this->buildCoilPatterns();
 }
 
-/**
- * Returns the current time in microseconds.
- */
-long micros(){
-	clock_t elapsedClocks = clock();
-	long time = ((float) elapsedClocks/ (float) CLOCKS_PER_SEC) * 1000000;
-	return time;
+Stepper::~Stepper()
+{
+	if (this->hold_timer != NULL) {
+		esp_timer_stop(this->hold_timer);
+		esp_timer_delete(this->hold_timer);
+	}
 }
 
 /*
@@ -269,191 +375,805 @@ long micros(){
  */
 void Stepper::setSpeed(long whatSpeed)
 {
-  this->step_delay = 60L * 1000L * 1000L / this->number_of_steps / whatSpeed;
-  ESP_LOGD(LOG_TAG, "Step delay now set to %ld", this->step_delay);
+  this->step_delay = 60L * 1000L * 1000L / this->steps_per_revolution / whatSpeed;
+  DLOGD(LOG_TAG, "Step delay now set to %u", this->step_delay);
+  this->updateProfile();
+}
+
+/*
+ * Sets the speed in steps per second
+ */
+void Stepper::setMaxSpeed(long steps_per_second)
+{
+  this->step_delay = 1000L * 1000L / steps_per_second;
+  DLOGD(LOG_TAG, "Step delay now set to %u", this->step_delay);
+  this->updateProfile();
+}
+
+/*
+ * Sets the acceleration in steps per second per second.  Moves ramp up to
+ * the set speed and back down again; 0 starts and stops at full speed.
+ */
+void Stepper::setAcceleration(long steps_per_second_2)
+{
+  this->acceleration = steps_per_second_2;
+  this->updateProfile();
+}
+
+/*
+ * Sets the jerk limit in steps per second cubed, giving S-curve ramps.
+ * 0 gives plain trapezoidal ramps.
+ */
+void Stepper::setJerk(long steps_per_second_3)
+{
+  this->jerk = steps_per_second_3;
+  this->updateProfile();
+}
+
+/*
+ * Recomputes the ramp table.  The ISR reads the table, so this only
+ * happens between moves.
+ */
+void Stepper::updateProfile(void)
+{
+  if (this->completion.isRunning()) {
+    ESP_LOGW(LOG_TAG, "Profile change ignored while moving");
+    return;
+  }
+  this->profile.configure(this->step_delay, this->acceleration, this->jerk);
 }
 
 /*
  * Moves the motor steps_to_move steps.  If the number is negative,
  * the motor moves in the reverse direction.
+ *
+ * Blocks the calling task until the move is complete.
  */
 void Stepper::step(int steps_to_move)
 {
-	ESP_LOGD(LOG_TAG, "Attempting to move %d steps", steps_to_move);
-	int steps_left = abs(steps_to_move);  // how many steps to take
+	if (this->moveAsync(steps_to_move)) {
+		this->waitForCompletion(portMAX_DELAY);
+	}
+}
+
+/*
+ * Starts moving the motor steps_to_move steps and returns immediately.
+ * The steps themselves are taken from the step timer ISR.
+ *
+ * Returns false if a move is already running or no timer is available.
+ */
+bool Stepper::moveAsync(int steps_to_move)
+{
+	DLOGD(LOG_TAG, "Attempting to move %d steps", steps_to_move);
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Move already in progress");
+		return false;
+	}
+	if (steps_to_move == 0) {
+		return true;
+	}
+	if (this->stall_detected) {
+		ESP_LOGW(LOG_TAG, "Stalled, not moving until synchronised with the encoder");
+		return false;
+	}
+	if (!this->withinSoftLimits(this->position + steps_to_move)) {
+		ESP_LOGW(LOG_TAG, "Move to %d is outside the soft limits", this->position + steps_to_move);
+		return false;
+	}
+	if (!this->timer.attach(this->step_callback, this)) {
+		ESP_LOGE(LOG_TAG, "No step timer available, not moving");
+		return false;
+	}
+	this->timer.setCallback(this->step_callback, this);
+	this->stop_requested = false;
 
 	// determine direction based on whether steps_to_mode is + or -:
 	if (steps_to_move > 0) { this->direction = 1; }
 	if (steps_to_move < 0) { this->direction = 0; }
 
+	this->steps_left = abs(steps_to_move);  // how many steps to take
+	this->steps_done = 0;
+
+	// move only once the appropriate delay since the last step has passed,
+	// or a whole one after powering up released coils so the rotor settles:
+	int64_t first_delay = this->profile.delayFor(0, this->steps_left);
+	if (!this->energize()) {
+		first_delay -= hrclock_now_us() - this->last_step_time;
+	}
+	if (first_delay < STEP_TIMER_MIN_DELAY_US) {
+		first_delay = STEP_TIMER_MIN_DELAY_US;
+	}
+
+	this->completion.start();
+	this->timer.start((uint32_t) first_delay);
+	return true;
+}
+
+/*
+ * Starts a move to an absolute position.
+ */
+bool Stepper::moveTo(int32_t target)
+{
+	return this->moveAsync(target - this->position);
+}
+
+/*
+ * Redefines the current position, e.g. after referencing by other means.
+ */
+void Stepper::setCurrentPosition(int32_t position)
+{
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Position change ignored while moving");
+		return;
+	}
+	this->position = position;
+	this->alignFeedback();
+}
+
+void Stepper::setSoftLimits(int32_t min, int32_t max)
+{
+	this->min_position = min;
+	this->max_position = max;
+	this->soft_limits = true;
+}
+
+bool Stepper::withinSoftLimits(int32_t position) const
+{
+	return !this->soft_limits
+			|| (position >= this->min_position && position <= this->max_position);
+}
+
+/*
+ * Sets up the limit switch input and its interrupt.  The switch is
+ * expected to pull the pin to active_level; the opposite level is held by
+ * the internal pull resistor.
+ */
+bool Stepper::attachLimitSwitch(int pin, int active_level)
+{
+	gpio_config_t io_conf;
+	io_conf.intr_type = active_level ? GPIO_INTR_POSEDGE : GPIO_INTR_NEGEDGE;
+	io_conf.mode = GPIO_MODE_INPUT;
+	io_conf.pin_bit_mask = (1ULL<<pin);
+	io_conf.pull_down_en = active_level ? GPIO_PULLDOWN_ENABLE : GPIO_PULLDOWN_DISABLE;
+	io_conf.pull_up_en = active_level ? GPIO_PULLUP_DISABLE : GPIO_PULLUP_ENABLE;
+	gpio_config(&io_conf);
+
+	// the service may already be installed by another switch
+	esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+	if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+		ESP_LOGE(LOG_TAG, "Failed to install GPIO ISR service: %d", err);
+		return false;
+	}
+	err = gpio_isr_handler_add((gpio_num_t) pin, &Stepper::onLimitSwitch, this);
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to add limit switch handler: %d", err);
+		return false;
+	}
+	this->limit_pin = (gpio_num_t) pin;
+	this->limit_active_level = active_level;
+	return true;
+}
+
+/*
+ * Limit switch interrupt.  The step ISR sees the flag on its next step and
+ * ends the move there.
+ */
+void IRAM_ATTR Stepper::onLimitSwitch(void *arg)
+{
+	((Stepper *) arg)->stop_requested = true;
+}
+
+/*
+ * Finds the limit switch at a constant, slow speed and takes its position
+ * as home.  Soft limits and the ramp are set aside while searching.
+ */
+bool Stepper::home(int direction, long steps_per_second, int32_t home_position, TickType_t timeout)
+{
+	if (this->limit_pin == GPIO_NUM_MAX) {
+		ESP_LOGE(LOG_TAG, "No limit switch attached");
+		return false;
+	}
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Move already in progress");
+		return false;
+	}
+
+	unsigned long saved_delay = this->step_delay;
+	long saved_acceleration = this->acceleration;
+	long saved_jerk = this->jerk;
+	bool saved_limits = this->soft_limits;
+	this->step_delay = 1000L * 1000L / steps_per_second;
+	this->acceleration = 0;
+	this->jerk = 0;
+	this->soft_limits = false;
+	this->stall_detected = false;
+	this->updateProfile();
+
+	bool found = (gpio_get_level(this->limit_pin) == this->limit_active_level);
+	if (!found && this->moveAsync((direction > 0 ? 1 : -1) * STEPPER_HOMING_MAX_STEPS)) {
+		if (!this->waitForCompletion(timeout)) {
+			this->stop();
+			this->waitForCompletion(portMAX_DELAY);
+		}
+		found = this->stop_requested
+				&& gpio_get_level(this->limit_pin) == this->limit_active_level;
+	}
+
+	this->step_delay = saved_delay;
+	this->acceleration = saved_acceleration;
+	this->jerk = saved_jerk;
+	this->soft_limits = saved_limits;
+	this->updateProfile();
+
+	if (!found) {
+		ESP_LOGE(LOG_TAG, "Limit switch not found");
+		return false;
+	}
+	this->position = home_position;
+	this->alignFeedback();
+	return true;
+}
+
+void Stepper::setFeedback(QuadratureEncoder *encoder, int32_t max_error)
+{
+	if (this->completion.isRunning()) {
+		ESP_LOGW(LOG_TAG, "Feedback change ignored while moving");
+		return;
+	}
+	this->feedback = encoder;
+	this->feedback_max_error = max_error;
+	this->stall_detected = false;
+	this->alignFeedback();
+}
+
+/*
+ * Converts encoder counts to steps in 32 bits, without a 64-bit division
+ * in the step ISR.
+ */
+int32_t IRAM_ATTR Stepper::feedbackPosition(void) const
+{
+	if (this->feedback == NULL) {
+		return this->position;
+	}
+	int32_t counts = this->feedback->count();
+	int32_t per_revolution = this->feedback->countsPerRevolution();
+	return this->feedback_offset + counts / per_revolution * this->steps_per_revolution
+			+ counts % per_revolution * this->steps_per_revolution / per_revolution;
+}
+
+void Stepper::syncToFeedback(void)
+{
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Position change ignored while moving");
+		return;
+	}
+	this->position = this->feedbackPosition();
+	this->stall_detected = false;
+}
+
+/*
+ * Makes the encoder agree with the current position, whenever that is
+ * redefined or rescaled.
+ */
+void Stepper::alignFeedback(void)
+{
+	if (this->feedback != NULL) {
+		this->feedback_offset = 0;
+		this->feedback_offset = this->position - this->feedbackPosition();
+	}
+}
+
+/*
+ * Compares the position just stepped to with the encoder, from the step
+ * ISR.  The shaft trails the coils by up to a step or so under load, which
+ * max_error has to allow for.
+ */
+bool IRAM_ATTR Stepper::checkFeedback(void)
+{
+	int32_t error = this->position - this->feedbackPosition();
+	if (error <= this->feedback_max_error && error >= -this->feedback_max_error) {
+		return true;
+	}
+	this->stall_detected = true;
+	DLOGW(LOG_TAG, "Stalled %d steps off at %d", error, this->position);
+	return false;
+}
+
+/*
+ * Common tail of every step: time stamps it and returns the delay until the
+ * next one, or wakes whoever is waiting and returns 0 once the move is
+ * complete.
+ */
+uint32_t IRAM_ATTR Stepper::finishStep(void)
+{
+	// get the timeStamp of when you stepped:
+	this->last_step_time = hrclock_now_us();
+
+	// decrement the steps left:
+	this->steps_left--;
+	this->steps_done++;
+	if (this->feedback != NULL && !this->checkFeedback()) {
+		this->stop_requested = true;
+	}
+	if (this->stop_requested) {
+		this->steps_left = 0;
+	}
+	uint32_t next = 0;
+	if (this->steps_left > 0) {
+		next = this->profile.delayFor(this->steps_done, this->steps_left);
+	}
+
+	if (this->telemetry != NULL) {
+		MotionTelemetry state;
+		state.steps_left = this->steps_left;
+		state.step_interval_us = next;
+		state.last_step_time = this->last_step_time;
+		state.position[0] = this->position;
+		for (int i = 1; i < MOTION_MAX_AXES; i++) {
+			state.position[i] = 0;
+		}
+		this->telemetry->write(state);
+	}
+
+	if (next == 0) {
+		this->completion.finishFromISR();
+	}
+	return next;
+}
 
-	// decrement the number of steps, moving one step each time:
-	while (steps_left > 0)
+/*
+ * Takes one step in the current direction on behalf of MotionCoordinator.
+ * Returns the coil masks for the new state instead of writing them, so the
+ * coordinator can switch every axis with one register write.
+ */
+const CoilPattern * IRAM_ATTR Stepper::takeCoordinatedStep(int64_t now)
+{
+	if (this->direction == 1)
 	{
-		unsigned long now = micros();
-		// move only if the appropriate delay has passed:
-		if (now - this->last_step_time >= this->step_delay)
-		{
-		  // get the timeStamp of when you stepped:
-		  this->last_step_time = now;
-		  // increment or decrement the step number,
-		  // depending on direction:
-		  if (this->direction == 1)
-		  {
-			this->step_number++;
-			if (this->step_number == this->number_of_steps) {
-			  this->step_number = 0;
-			}
-		  }
-		  else
-		  {
-			if (this->step_number == 0) {
-			  this->step_number = this->number_of_steps;
+		this->step_number++;
+		if (this->step_number == this->steps_per_revolution) {
+			this->step_number = 0;
+		}
+		this->phase++;
+		if (this->phase == this->sequence_length) {
+			this->phase = 0;
+		}
+		this->position = this->position + 1;
+	}
+	else
+	{
+		if (this->step_number == 0) {
+			this->step_number = this->steps_per_revolution;
+		}
+		this->step_number--;
+		if (this->phase == 0) {
+			this->phase = this->sequence_length;
+		}
+		this->phase--;
+		this->position = this->position - 1;
+	}
+	this->last_step_time = now;
+
+	// the coordinator writes the full current pattern; should the coils have
+	// been released, they are powered again and need their timeout back
+	// (esp_timer_start_once is safe from an ISR)
+	if (this->released) {
+		portENTER_CRITICAL_ISR(&this->hold_lock);
+		this->released = false;
+		this->energized_time = now;
+		portEXIT_CRITICAL_ISR(&this->hold_lock);
+		if (this->hold_timer != NULL && this->hold_timeout_us > 0) {
+			esp_timer_start_once(this->hold_timer, this->hold_timeout_us);
+		}
+	}
+	return &this->coil_patterns[this->phase];
+}
+
+/*
+ * Microstepping drives C0/C1 with the positive/negative half of cos(theta)
+ * and C2/C3 with sin(theta), as 8-bit PWM duties.  Entry i is at
+ * theta = 45 + 11.25 * i degrees, so every 8th entry lines up with a full
+ * step of the four wire sequence.  MICROSTEP_4 uses every other entry.
+ * The step ISR reads it while flash may be busy, so it lives in DRAM.
+ */
+#define MICROSTEP_TABLE_LENGTH 32
+static DRAM_ATTR constexpr uint8_t microstep_duties[MICROSTEP_TABLE_LENGTH][4] = {
+	{ 180,   0, 180,   0 }, { 142,   0, 212,   0 }, {  98,   0, 236,   0 }, {  50,   0, 250,   0 },
+	{   0,   0, 255,   0 }, {   0,  50, 250,   0 }, {   0,  98, 236,   0 }, {   0, 142, 212,   0 },
+	{   0, 180, 180,   0 }, {   0, 212, 142,   0 }, {   0, 236,  98,   0 }, {   0, 250,  50,   0 },
+	{   0, 255,   0,   0 }, {   0, 250,   0,  50 }, {   0, 236,   0,  98 }, {   0, 212,   0, 142 },
+	{   0, 180,   0, 180 }, {   0, 142,   0, 212 }, {   0,  98,   0, 236 }, {   0,  50,   0, 250 },
+	{   0,   0,   0, 255 }, {  50,   0,   0, 250 }, {  98,   0,   0, 236 }, { 142,   0,   0, 212 },
+	{ 180,   0,   0, 180 }, { 212,   0,   0, 142 }, { 236,   0,   0,  98 }, { 250,   0,   0,  50 },
+	{ 255,   0,   0,   0 }, { 250,   0,  50,   0 }, { 236,   0,  98,   0 }, { 212,   0, 142,   0 },
+};
+
+// Coil PWM frequency, above the audible range.
+#define MICROSTEP_PWM_FREQ_HZ 20000
+
+/*
+ * Writes an on/off coil state from the masks built by buildCoilPatterns().
+ */
+template <int Length, bool HighPins>
+struct Stepper::GpioCoils {
+	static constexpr int length = Length;
+	static inline void IRAM_ATTR write(Stepper *stepper, int phase) {
+		const CoilPattern *pattern = &stepper->coil_patterns[phase];
+		GPIO.out_w1tc = pattern->clear_low;
+		GPIO.out_w1ts = pattern->set_low;
+		if (HighPins) {
+			GPIO.out1_w1tc.val = pattern->clear_high;
+			GPIO.out1_w1ts.val = pattern->set_high;
+		}
+	}
+};
+
+/*
+ * Writes a microstep state as LEDC duties, using every Stride'th table entry.
+ */
+template <int Stride>
+struct Stepper::PwmCoils {
+	static constexpr int length = MICROSTEP_TABLE_LENGTH / Stride;
+	static inline void IRAM_ATTR write(Stepper *stepper, int phase) {
+		const uint8_t *duty = microstep_duties[phase * Stride];
+		for (int c = 0; c < 4; c++) {
+			// duty register has 4 fractional bits; takes effect next PWM period
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[stepper->pwm_channel + c].duty.duty = duty[c] << 4;
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[stepper->pwm_channel + c].conf1.duty_start = 1;
+		}
+	}
+};
+
+/*
+ * Converts the coil sequence for this motor into GPIO set/clear masks, so
+ * that stepMotor() switches every coil with a single register write.
+ */
+void Stepper::buildCoilPatterns(void)
+{
+	const gpio_num_t pins[5] = {
+		this->motor_pin_1, this->motor_pin_2, this->motor_pin_3,
+		this->motor_pin_4, this->motor_pin_5
+	};
+	const uint8_t *sequence;
+	if (this->pin_count == 2) {
+		sequence = two_wire_sequence;
+		this->sequence_length = 4;
+	} else if (this->pin_count == 5) {
+		sequence = five_wire_sequence;
+		this->sequence_length = 10;
+	} else if (this->step_mode == HALF_STEP) {
+		sequence = four_wire_half_sequence;
+		this->sequence_length = 8;
+	} else {
+		sequence = four_wire_sequence;
+		this->sequence_length = 4;
+	}
+
+	this->pwm_duties = NULL;
+	if (this->step_mode == MICROSTEP_4 || this->step_mode == MICROSTEP_8) {
+		// PWM duties come straight from the table, no GPIO masks needed
+		this->pwm_stride = (this->step_mode == MICROSTEP_4) ? 2 : 1;
+		this->sequence_length = MICROSTEP_TABLE_LENGTH / this->pwm_stride;
+		this->pwm_duties = microstep_duties;
+		this->selectStepCallback();
+		return;
+	}
+
+	this->uses_high_pins = false;
+	memset(this->coil_patterns, 0, sizeof(this->coil_patterns));
+	for (int s = 0; s < this->sequence_length; s++) {
+		CoilPattern *pattern = &this->coil_patterns[s];
+		for (int p = 0; p < this->pin_count; p++) {
+			bool high = (sequence[s] >> (this->pin_count - 1 - p)) & 1;
+			int pin = pins[p];
+			if (pin < 32) {
+				if (high) pattern->set_low |= 1UL << pin;
+				else      pattern->clear_low |= 1UL << pin;
+			} else {
+				this->uses_high_pins = true;
+				if (high) pattern->set_high |= 1UL << (pin - 32);
+				else      pattern->clear_high |= 1UL << (pin - 32);
 			}
-			this->step_number--;
-		  }
-		  // decrement the steps left:
-		  steps_left--;
-		  // step the motor to step number 0, 1, ..., {3 or 10}
-		  if (this->pin_count == 5)
-			stepMotor(this->step_number % 10);
-		  else
-			stepMotor(this->step_number % 4);
-		  // Feed the WatchDog
-		  vTaskDelay(1);
 		}
 	}
+	this->selectStepCallback();
 }
 
 /*
- * Moves the motor forward or backwards.
+ * Picks the step ISR instantiation for the current coil sequence.  This is
+ * the only place that looks at the pin count and step mode; the per-step
+ * path has them baked in.  A FixedStepper's own ISR takes over whenever the
+ * motor is back in full steps.
  */
-void Stepper::stepMotor(int thisStep)
-{
-//	ESP_LOGD(LOG_TAG, "Executing step number %d", thisStep);
-  if (this->pin_count == 2) {
-    switch (thisStep) {
-      case 0:  // 01
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-      break;
-      case 1:  // 11
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, HIGH);
-      break;
-      case 2:  // 10
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-      break;
-      case 3:  // 00
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, LOW);
-      break;
-    }
-  }
-  if (this->pin_count == 4) {
-    switch (thisStep) {
-      case 0:  // 1010
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-      break;
-      case 1:  // 0110
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-      break;
-      case 2:  //0101
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-      break;
-      case 3:  //1001
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-      break;
-    }
-  }
+void Stepper::selectStepCallback(void)
+{
+	if (this->fixed_callback != NULL && this->step_mode == FULL_STEP) {
+		this->step_callback = this->fixed_callback;
+	} else if (this->pwm_duties != NULL) {
+		if (this->pwm_stride == 2)
+			this->step_callback = &Stepper::onStepTimer<PwmCoils<2> >;
+		else
+			this->step_callback = &Stepper::onStepTimer<PwmCoils<1> >;
+	} else if (this->sequence_length == 10) {
+		if (this->uses_high_pins)
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<10, true> >;
+		else
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<10, false> >;
+	} else if (this->sequence_length == 8) {
+		if (this->uses_high_pins)
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<8, true> >;
+		else
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<8, false> >;
+	} else {
+		if (this->uses_high_pins)
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<4, true> >;
+		else
+			this->step_callback = &Stepper::onStepTimer<GpioCoils<4, false> >;
+	}
+}
 
-  if (this->pin_count == 5) {
-    switch (thisStep) {
-      case 0:  // 01101
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-        gpio_set_level(motor_pin_5, HIGH);
-        break;
-      case 1:  // 01001
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, LOW);
-        gpio_set_level(motor_pin_5, HIGH);
-        break;
-      case 2:  // 01011
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-        gpio_set_level(motor_pin_5, HIGH);
-        break;
-      case 3:  // 01010
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-        gpio_set_level(motor_pin_5, LOW);
-        break;
-      case 4:  // 11010
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, HIGH);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-        gpio_set_level(motor_pin_5, LOW);
-        break;
-      case 5:  // 10010
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, LOW);
-        gpio_set_level(motor_pin_4, HIGH);
-        gpio_set_level(motor_pin_5, LOW);
-        break;
-      case 6:  // 10110
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, HIGH);
-        gpio_set_level(motor_pin_5, LOW);
-        break;
-      case 7:  // 10100
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-        gpio_set_level(motor_pin_5, LOW);
-        break;
-      case 8:  // 10101
-        gpio_set_level(motor_pin_1, HIGH);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-        gpio_set_level(motor_pin_5, HIGH);
-        break;
-      case 9:  // 00101
-        gpio_set_level(motor_pin_1, LOW);
-        gpio_set_level(motor_pin_2, LOW);
-        gpio_set_level(motor_pin_3, HIGH);
-        gpio_set_level(motor_pin_4, LOW);
-        gpio_set_level(motor_pin_5, HIGH);
-        break;
-    }
-  }
+/*
+ * Sets up an LEDC timer for microstepping a four wire motor.  The four coils
+ * are driven from channels first_channel to first_channel + 3 once a
+ * MICROSTEP mode is selected.
+ */
+bool Stepper::attachPwm(ledc_timer_t timer, ledc_channel_t first_channel)
+{
+	if (this->pin_count != 4 || first_channel + 4 > LEDC_CHANNEL_MAX) {
+		ESP_LOGE(LOG_TAG, "PWM needs a four wire motor and four free channels");
+		return false;
+	}
+
+	ledc_timer_config_t timer_conf;
+	memset(&timer_conf, 0, sizeof(timer_conf));
+	timer_conf.speed_mode = LEDC_HIGH_SPEED_MODE;
+	timer_conf.duty_resolution = LEDC_TIMER_8_BIT;
+	timer_conf.timer_num = timer;
+	timer_conf.freq_hz = MICROSTEP_PWM_FREQ_HZ;
+	if (ledc_timer_config(&timer_conf) != ESP_OK) {
+		return false;
+	}
+
+	this->pwm_timer = timer;
+	this->pwm_channel = first_channel;
+	this->pwm_attached = true;
+	return true;
+}
+
+/*
+ * Hands the motor pins to the LEDC channels, or back to plain GPIO output.
+ */
+void Stepper::routePinsToPwm(bool pwm)
+{
+	const gpio_num_t pins[4] = {
+		this->motor_pin_1, this->motor_pin_2, this->motor_pin_3, this->motor_pin_4
+	};
+	for (int c = 0; c < 4; c++) {
+		ledc_channel_t channel = (ledc_channel_t) (this->pwm_channel + c);
+		if (pwm) {
+			ledc_channel_config_t channel_conf;
+			memset(&channel_conf, 0, sizeof(channel_conf));
+			channel_conf.gpio_num = pins[c];
+			channel_conf.speed_mode = LEDC_HIGH_SPEED_MODE;
+			channel_conf.channel = channel;
+			channel_conf.intr_type = LEDC_INTR_DISABLE;
+			channel_conf.timer_sel = this->pwm_timer;
+			channel_conf.duty = 0;
+			ledc_channel_config(&channel_conf);
+			// leaves the duty fade registers set up for single updates
+			ledc_set_duty(LEDC_HIGH_SPEED_MODE, channel, 0);
+			ledc_update_duty(LEDC_HIGH_SPEED_MODE, channel);
+		} else {
+			ledc_stop(LEDC_HIGH_SPEED_MODE, channel, 0);
+			// reconnects the pad to the GPIO output register
+			gpio_set_direction(pins[c], GPIO_MODE_OUTPUT);
+		}
+	}
+}
+
+/*
+ * Selects the coil sequence.  The motor keeps its electrical position, and
+ * the speed is rescaled so the shaft turns at the same rate.  Accelerations
+ * and later speed settings are in the new (micro)steps.
+ */
+bool Stepper::setStepMode(StepMode mode)
+{
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Step mode change ignored while moving");
+		return false;
+	}
+	if (mode == this->step_mode) {
+		return true;
+	}
+	if (mode != FULL_STEP && this->pin_count != 4) {
+		ESP_LOGE(LOG_TAG, "Only four wire motors can half or microstep");
+		return false;
+	}
+	bool was_pwm = (this->pwm_duties != NULL);
+	bool is_pwm = (mode == MICROSTEP_4 || mode == MICROSTEP_8);
+	if (is_pwm && !this->pwm_attached) {
+		ESP_LOGE(LOG_TAG, "Microstepping needs attachPwm() first");
+		return false;
+	}
+	if (is_pwm && this->coordinator_owned) {
+		// the coordinator writes coil_patterns straight to the GPIOs
+		ESP_LOGE(LOG_TAG, "Coordinated axes cannot microstep");
+		return false;
+	}
+
+	// position within the electrical cycle, in 1/32ths
+	int old_length = this->sequence_length;
+	int position = this->phase * MICROSTEP_TABLE_LENGTH / old_length;
+
+	this->step_mode = mode;
+	this->buildCoilPatterns();
+	if (was_pwm != is_pwm) {
+		this->routePinsToPwm(is_pwm);
+	}
+
+	this->phase = position * this->sequence_length / MICROSTEP_TABLE_LENGTH;
+	this->step_number = this->step_number * this->sequence_length / old_length;
+	this->position = this->position * this->sequence_length / old_length;
+	this->min_position = this->min_position * this->sequence_length / old_length;
+	this->max_position = this->max_position * this->sequence_length / old_length;
+	// only four wire motors get here, where a full step cycle has 4 states
+	this->steps_per_revolution = this->number_of_steps * this->sequence_length / 4;
+	this->step_delay = this->step_delay * old_length / this->sequence_length;
+	this->updateProfile();
+	this->alignFeedback();
+	this->energize();
+	return true;
+}
+
+/*
+ * Sets up the coil hold timeout.  The esp_timer is one-shot: every move
+ * arms it, and it re-arms itself while the motor keeps stepping.
+ */
+bool Stepper::setHoldTimeout(uint32_t timeout_ms, int hold_percent)
+{
+	if (this->pin_count == 2 && timeout_ms > 0) {
+		// the driver inverts the two pins into four, so some coils are always on
+		ESP_LOGE(LOG_TAG, "Two wire motors cannot release their coils");
+		return false;
+	}
+	if (this->hold_timer == NULL && timeout_ms > 0) {
+		esp_timer_create_args_t args;
+		memset(&args, 0, sizeof(args));
+		args.callback = &Stepper::onHoldTimer;
+		args.arg = this;
+		args.name = "stepper_hold";
+		if (esp_timer_create(&args, &this->hold_timer) != ESP_OK) {
+			ESP_LOGE(LOG_TAG, "Failed to create the hold timer");
+			this->hold_timer = NULL;
+			return false;
+		}
+	}
+	if (hold_percent < 0) { hold_percent = 0; }
+	if (hold_percent > 100) { hold_percent = 100; }
+	this->hold_percent = hold_percent;
+	this->hold_timeout_us = timeout_ms * 1000;
+	if (this->hold_timer != NULL) {
+		esp_timer_stop(this->hold_timer);
+		if (timeout_ms > 0 && !this->released) {
+			esp_timer_start_once(this->hold_timer, this->hold_timeout_us);
+		}
+	}
+	return true;
+}
+
+void Stepper::release(void)
+{
+	if (this->completion.isRunning() || this->coordinated) {
+		ESP_LOGW(LOG_TAG, "Release ignored while moving");
+		return;
+	}
+	if (this->pin_count == 2) {
+		return;
+	}
+	portENTER_CRITICAL(&this->hold_lock);
+	this->reduceCoils(0);
+	portEXIT_CRITICAL(&this->hold_lock);
+}
+
+/*
+ * Puts the coils at full current for the current phase and restarts the
+ * hold timeout.  Returns true if they had been released.
+ */
+bool Stepper::energize(void)
+{
+	portENTER_CRITICAL(&this->hold_lock);
+	bool was_released = this->released;
+	this->stepMotor(this->phase);
+	this->released = false;
+	this->energized_time = hrclock_now_us();
+	portEXIT_CRITICAL(&this->hold_lock);
+	if (this->hold_timer != NULL && this->hold_timeout_us > 0) {
+		// already armed is fine, it re-arms itself for the rest of the timeout
+		esp_timer_start_once(this->hold_timer, this->hold_timeout_us);
+	}
+	return was_released;
+}
+
+/*
+ * Drops the coils to percent of full current, called with hold_lock held.
+ * Only LEDC driven coils can be reduced; GPIO driven ones are switched off.
+ */
+void Stepper::reduceCoils(int percent)
+{
+	if (this->pwm_duties != NULL) {
+		const uint8_t *duty = this->pwm_duties[this->phase * this->pwm_stride];
+		for (int c = 0; c < 4; c++) {
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[this->pwm_channel + c].duty.duty =
+					(duty[c] * percent / 100) << 4;
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[this->pwm_channel + c].conf1.duty_start = 1;
+		}
+	} else {
+		uint32_t low = 0, high = 0;
+		for (int i = 0; i < this->sequence_length; i++) {
+			low |= this->coil_patterns[i].set_low | this->coil_patterns[i].clear_low;
+			high |= this->coil_patterns[i].set_high | this->coil_patterns[i].clear_high;
+		}
+		GPIO.out_w1tc = low;
+		if (high != 0) {
+			GPIO.out1_w1tc.val = high;
+		}
+	}
+	this->released = true;
+}
+
+/*
+ * Hold timeout, runs in the esp_timer task.  Steps taken from a
+ * MotionCoordinator do not arm the timer, so it goes by the last step time
+ * rather than by when it was armed.  An axis of a coordinated move may sit
+ * still for a long time while the others move, so it is never released
+ * before the whole move is done.
+ */
+void Stepper::onHoldTimer(void *arg)
+{
+	Stepper *stepper = (Stepper *) arg;
+	portENTER_CRITICAL(&stepper->hold_lock);
+	int64_t last = stepper->last_step_time > stepper->energized_time
+			? stepper->last_step_time : stepper->energized_time;
+	int64_t idle = hrclock_now_us() - last;
+	bool expired = !stepper->completion.isRunning() && !stepper->coordinated
+			&& !stepper->released
+			&& idle >= (int64_t) stepper->hold_timeout_us;
+	if (expired) {
+		stepper->reduceCoils(stepper->hold_percent);
+	}
+	portEXIT_CRITICAL(&stepper->hold_lock);
+
+	if (!expired && !stepper->released && stepper->hold_timeout_us > 0) {
+		int64_t remaining = (int64_t) stepper->hold_timeout_us - idle;
+		if (remaining < STEPPER_HOLD_MIN_RECHECK_US) {
+			remaining = STEPPER_HOLD_MIN_RECHECK_US;
+		}
+		esp_timer_start_once(stepper->hold_timer, remaining);
+	}
+}
+
+/*
+ * Moves the motor forward or backwards.
+ */
+void IRAM_ATTR Stepper::stepMotor(int thisStep)
+{
+	DLOGV(LOG_TAG, "Executing step number %d", thisStep);
+	if (this->pwm_duties != NULL) {
+		const uint8_t *duty = this->pwm_duties[thisStep * this->pwm_stride];
+		for (int c = 0; c < 4; c++) {
+			// duty register has 4 fractional bits; takes effect next PWM period
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[this->pwm_channel + c].duty.duty = duty[c] << 4;
+			LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[this->pwm_channel + c].conf1.duty_start = 1;
+		}
+		return;
+	}
+	const CoilPattern *pattern = &this->coil_patterns[thisStep];
+	GPIO.out_w1tc = pattern->clear_low;
+	GPIO.out_w1ts = pattern->set_low;
+	if (this->uses_high_pins) {
+		GPIO.out1_w1tc.val = pattern->clear_high;
+		GPIO.out1_w1ts.val = pattern->set_high;
+	}
 }
 
 /*
@@ -79,6 +79,24 @@
 #ifndef Stepper_h
 #define Stepper_h
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "step_timer.h"
+#include "move_completion.h"
+#include "telemetry.h"
+#include "motion_profile.h"
+#include "stepper_sequences.h"
+#include "quadrature_encoder.h"
+#include "soc/gpio_struct.h"
+
+// Furthest home() travels looking for the limit switch
+#define STEPPER_HOMING_MAX_STEPS 100000
+// Soonest the hold timer checks again while the motor is still stepping
+#define STEPPER_HOLD_MIN_RECHECK_US 10000
+
 // library interface description
 class Stepper {
   public:
@@ -89,23 +107,128 @@ class Stepper {
     Stepper(int number_of_steps, int motor_pin_1, int motor_pin_2,
                                  int motor_pin_3, int motor_pin_4,
                                  int motor_pin_5);
+    ~Stepper();
 
-    // speed setter method:
+    // speed setter methods, cruise speed in revs per minute or steps per second:
     void setSpeed(long whatSpeed);
+    void setMaxSpeed(long steps_per_second);
+
+    // acceleration in steps/s^2 (0 for none), jerk in steps/s^3 (0 for a
+    // trapezoidal rather than S-curve profile):
+    void setAcceleration(long steps_per_second_2);
+    void setJerk(long steps_per_second_3);
 
-    // mover method:
+    // coil sequences; 2 and 5-wire motors only support FULL_STEP:
+    enum StepMode {
+      FULL_STEP,            // 4 states, two coils on
+      HALF_STEP,            // 8 states, alternating one and two coils on
+      MICROSTEP_4,          // 16 states of sine/cosine coil PWM, needs attachPwm()
+      MICROSTEP_8           // 32 states of sine/cosine coil PWM, needs attachPwm()
+    };
+    // drives the four coils from LEDC channels first_channel..first_channel+3:
+    bool attachPwm(ledc_timer_t timer, ledc_channel_t first_channel);
+    // speeds and accelerations are in the new (micro)steps afterwards; refused
+    // while moving, and MICROSTEP modes once the motor is a coordinated axis:
+    bool setStepMode(StepMode mode);
+
+    // mover method, blocks the calling task until the move is done:
     void step(int number_of_steps);
 
+    // non-blocking mover methods, refused while a coordinated move runs:
+    bool moveAsync(int number_of_steps);
+    bool isRunning(void) const { return this->completion.isRunning(); }
+    bool waitForCompletion(TickType_t timeout) { return this->completion.wait(timeout); }
+    // bits to set in group whenever a move completes, or NULL to disable:
+    void setCompletionEventGroup(EventGroupHandle_t group, EventBits_t bits) {
+      this->completion.setEventGroup(group, bits);
+    }
+
+    // absolute position in steps, counted from power up or the last home():
+    int32_t currentPosition(void) const { return this->position; }
+    void setCurrentPosition(int32_t position);
+    // moves straight to an absolute position, returning immediately:
+    bool moveTo(int32_t target);
+    // ends the current move after the step in progress:
+    void stop(void) { this->stop_requested = true; }
+
+    // moves that would end outside [min, max] are refused:
+    void setSoftLimits(int32_t min, int32_t max);
+    void clearSoftLimits(void) { this->soft_limits = false; }
+    bool withinSoftLimits(int32_t position) const;
+
+    // a switch on pin that reads active_level when pressed; hitting it stops
+    // any move of this motor from its GPIO interrupt:
+    bool attachLimitSwitch(int pin, int active_level);
+    // runs towards the switch (direction 1 or -1) at steps_per_second without
+    // ramping and makes the point where it triggers home_position.  Blocks
+    // until homed; false if the switch was not reached within timeout:
+    bool home(int direction, long steps_per_second, int32_t home_position, TickType_t timeout);
+
+    // once no step has been taken for timeout_ms the coils drop to
+    // hold_percent of full current if they are driven by LEDC (microstep
+    // modes), or are switched off otherwise; 0 holds at full current for
+    // good.  The next move powers them up again first:
+    bool setHoldTimeout(uint32_t timeout_ms, int hold_percent = 0);
+    // switches the coils off now, if not moving:
+    void release(void);
+    bool isReleased(void) const { return this->released; }
+
+    // closes the loop with an encoder on the shaft, or NULL for open loop.
+    // The encoder is taken to agree with the current position and every
+    // step is checked against it: a move that gets more than max_error
+    // steps off is stopped there as stalled, and moves are refused until
+    // syncToFeedback() or home():
+    void setFeedback(QuadratureEncoder *encoder, int32_t max_error);
+    // where the encoder says the motor is, in steps:
+    int32_t feedbackPosition(void) const;
+    bool stalled(void) const { return this->stall_detected; }
+    // takes the encoder position as the current position and clears a stall:
+    void syncToFeedback(void);
+
+    // hrclock_now_us() time stamp of the last step taken, 0 before the first:
+    int64_t lastStepTime(void) const { return this->last_step_time; }
+    // snapshot the step ISR updates after every step, or NULL for none:
+    void setTelemetry(MotionTelemetrySnapshot *snapshot) { this->telemetry = snapshot; }
+    // step timing instrumentation, or NULL for none; set while stopped:
+    void setTimingTrace(StepTimingTrace *trace) { this->timer.setTrace(trace); }
+
     int version(void);
 
   private:
+    template <int... Pins> friend class FixedStepper;
+    friend class MotionCoordinator;
+
+    // coil writers for the step ISR, one per kind of coil sequence
+    template <int Length, bool HighPins> struct GpioCoils;
+    template <int Stride> struct PwmCoils;
+
+    void buildCoilPatterns(void);
+    void selectStepCallback(void);
+    void routePinsToPwm(bool pwm);
     void stepMotor(int this_step);
+    template <class Coils> static uint32_t onStepTimer(void *arg);
+    template <int Length> void advancePhase(void);
+    uint32_t finishStep(void);
+    const CoilPattern *takeCoordinatedStep(int64_t now);
+    void updateProfile(void);
+    static void onLimitSwitch(void *arg);
+    bool energize(void);
+    void reduceCoils(int percent);
+    static void onHoldTimer(void *arg);
+    void alignFeedback(void);
+    bool checkFeedback(void);
 
     int direction;            // Direction of rotation
-    unsigned long step_delay = 0; // delay between steps, in ms, based on speed
+    unsigned long step_delay = 0; // delay between steps, in us, based on speed
+    long acceleration;        // steps/s^2, 0 for constant speed moves
+    long jerk;                // steps/s^3, 0 for trapezoidal ramps
     int number_of_steps;      // total number of steps this motor can take
     int pin_count;            // how many pins are in use.
     int step_number;          // which step the motor is on
+    int steps_per_revolution; // number_of_steps times the microsteps per step
+    StepMode step_mode;       // which coil sequence is in use
+    int sequence_length;      // states in the coil sequence
+    int phase;                // current state of the coil sequence
 
     // motor pin numbers:
     gpio_num_t motor_pin_1;
@@ -114,7 +237,129 @@ class Stepper {
     gpio_num_t motor_pin_4;
     gpio_num_t motor_pin_5;          // Only 5 phase motor
 
-    unsigned long last_step_time; // time stamp in us of when the last step was taken
+    CoilPattern coil_patterns[10];   // one per step of the sequence
+    bool uses_high_pins;             // any motor pin above GPIO31
+
+    bool pwm_attached;               // attachPwm() has set up the LEDC timer
+    ledc_timer_t pwm_timer;          // LEDC timer shared by the coil channels
+    ledc_channel_t pwm_channel;      // first of the four coil channels
+    const uint8_t (*pwm_duties)[4];  // microstep duty table, NULL unless microstepping
+    int pwm_stride;                  // pwm_duties entries per state
+
+    volatile int64_t last_step_time; // time stamp in us of when the last step was taken
+
+    StepTimer timer;                  // paces the steps from its alarm ISR
+    StepTimer::callback_t step_callback; // ISR specialised for the coil sequence
+    StepTimer::callback_t fixed_callback; // FixedStepper's full step ISR, or NULL
+    MotionProfile profile;            // step intervals while ramping
+    volatile int steps_left;          // steps remaining in the current move
+    volatile int steps_done;          // steps taken so far in the current move
+    MoveCompletion completion;        // wakes waiters when the move is done
+    MotionTelemetrySnapshot *telemetry; // optional published state
+
+    volatile int32_t position;        // absolute position in steps
+    volatile bool stop_requested;     // set by stop() or the limit switch
+    bool soft_limits;                 // min_position/max_position apply
+    int32_t min_position;
+    int32_t max_position;
+    gpio_num_t limit_pin;             // GPIO_NUM_MAX without a limit switch
+    int limit_active_level;
+
+    esp_timer_handle_t hold_timer;    // NULL until setHoldTimeout()
+    uint32_t hold_timeout_us;         // 0 to hold at full current
+    int hold_percent;                 // of full current after the timeout
+    volatile bool released;           // coils off or reduced
+    volatile int64_t energized_time;  // when the coils were last powered up
+    portMUX_TYPE hold_lock;           // guards released against the hold timer
+    volatile bool coordinated;        // a MotionCoordinator move is running on this axis
+    bool coordinator_owned;           // added to a MotionCoordinator, on/off coils only
+
+    QuadratureEncoder *feedback;      // NULL for open loop
+    int32_t feedback_max_error;       // steps
+    int32_t feedback_offset;          // position minus encoder steps when aligned
+    volatile bool stall_detected;     // set by the step ISR
+};
+
+/*
+ * Step timer callback, runs in ISR context.  There is one instantiation per
+ * kind of coil sequence, so the sequence length and the way the coils are
+ * written are compile time constants and the per-step path does not branch
+ * on them.
+ */
+template <class Coils>
+uint32_t IRAM_ATTR Stepper::onStepTimer(void *arg)
+{
+	Stepper *stepper = (Stepper *) arg;
+	stepper->advancePhase<Coils::length>();
+	Coils::write(stepper, stepper->phase);
+	return stepper->finishStep();
+}
+
+/*
+ * Moves step_number, the coil sequence position and the absolute position
+ * one step in the current direction.
+ */
+template <int Length>
+inline void IRAM_ATTR Stepper::advancePhase(void)
+{
+	if (this->direction == 1)
+	{
+		this->step_number++;
+		if (this->step_number == this->steps_per_revolution) {
+			this->step_number = 0;
+		}
+		this->phase = wrapPhase<Length>(this->phase + 1);
+		this->position = this->position + 1;
+	}
+	else
+	{
+		if (this->step_number == 0) {
+			this->step_number = this->steps_per_revolution;
+		}
+		this->step_number--;
+		this->phase = wrapPhase<Length>(this->phase - 1);
+		this->position = this->position - 1;
+	}
+}
+
+/*
+ * Stepper whose pins are fixed at compile time, e.g.
+ *
+ *   FixedStepper<16, 17, 18, 19> stepper(STEPS);
+ *
+ * The full step coil masks are computed by the compiler and the step ISR
+ * writes them straight from a constant table.  Pins must be below GPIO32.
+ * Other step modes fall back to the run time tables of Stepper, and
+ * setStepMode(FULL_STEP) switches back to the compile time table.
+ */
+template <int... Pins>
+class FixedStepper : public Stepper {
+  public:
+    explicit FixedStepper(int number_of_steps)
+      : Stepper(number_of_steps, Pins...)
+    {
+      this->fixed_callback = &Stepper::onStepTimer<Coils>;
+      this->selectStepCallback();
+    }
+
+  private:
+    static constexpr int pin_count = sizeof...(Pins);
+    static_assert(pin_count == 2 || pin_count == 4 || pin_count == 5,
+                  "FixedStepper needs 2, 4 or 5 pins");
+    static_assert(CoilMasks<Pins...>::low_pins,
+                  "FixedStepper pins must be below GPIO32");
+
+    typedef CoilSequence<pin_count> Sequence;
+    typedef CoilTable<Sequence, CoilMasks<Pins...>,
+                      typename MakeIndexList<Sequence::length>::type> Table;
+
+    struct Coils {
+      static constexpr int length = Sequence::length;
+      static inline void IRAM_ATTR write(Stepper *, int phase) {
+        GPIO.out_w1tc = Table::patterns[phase].clear_low;
+        GPIO.out_w1ts = Table::patterns[phase].set_low;
+      }
+    };
 };
 
 #endif
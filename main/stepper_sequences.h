@@ -0,0 +1,114 @@
+/*
+ * StepperSequences.h - coil sequences and compile time helpers for Stepper.
+ *
+ * The sequences are the tables documented in stepper.h, one bit per control
+ * wire with C0 as the most significant bit.  They are constexpr so that
+ * FixedStepper can turn them into GPIO masks at compile time.
+ */
+
+// ensure this library description is only included once
+#ifndef StepperSequences_h
+#define StepperSequences_h
+
+#include <stdint.h>
+#include "esp_attr.h"
+
+// GPIO register masks for one entry of a coil sequence
+struct CoilPattern {
+  uint32_t set_low;       // GPIO0-31 to drive high
+  uint32_t clear_low;     // GPIO0-31 to drive low
+  uint32_t set_high;      // GPIO32-39 to drive high
+  uint32_t clear_high;    // GPIO32-39 to drive low
+};
+
+static constexpr uint8_t two_wire_sequence[4] = { 0b01, 0b11, 0b10, 0b00 };
+static constexpr uint8_t four_wire_sequence[4] = { 0b1010, 0b0110, 0b0101, 0b1001 };
+static constexpr uint8_t five_wire_sequence[10] = {
+  0b01101, 0b01001, 0b01011, 0b01010, 0b11010,
+  0b10010, 0b10110, 0b10100, 0b10101, 0b00101
+};
+
+/*
+ * Half stepping inserts a one-coil state between each pair of full steps:
+ *
+ * Step C0 C1 C2 C3
+ *    1  1  0  1  0
+ *    2  0  0  1  0
+ *    3  0  1  1  0
+ *    4  0  1  0  0
+ *    5  0  1  0  1
+ *    6  0  0  0  1
+ *    7  1  0  0  1
+ *    8  1  0  0  0
+ */
+static constexpr uint8_t four_wire_half_sequence[8] = {
+  0b1010, 0b0010, 0b0110, 0b0100, 0b0101, 0b0001, 0b1001, 0b1000
+};
+
+// Full step sequence for a motor with PinCount control wires.
+template <int PinCount> struct CoilSequence;
+
+template <> struct CoilSequence<2> {
+  static constexpr int length = 4;
+  static constexpr uint8_t state(int i) { return two_wire_sequence[i]; }
+};
+
+template <> struct CoilSequence<4> {
+  static constexpr int length = 4;
+  static constexpr uint8_t state(int i) { return four_wire_sequence[i]; }
+};
+
+template <> struct CoilSequence<5> {
+  static constexpr int length = 10;
+  static constexpr uint8_t state(int i) { return five_wire_sequence[i]; }
+};
+
+// Set/clear masks of a sequence state for pins C0, C1, ... known at
+// compile time.  Only GPIO0-31 are supported.
+template <int... Pins> struct CoilMasks;
+
+template <> struct CoilMasks<> {
+  static constexpr bool low_pins = true;
+  static constexpr uint32_t set(uint8_t) { return 0; }
+  static constexpr uint32_t clear(uint8_t) { return 0; }
+};
+
+template <int Pin, int... Rest> struct CoilMasks<Pin, Rest...> {
+  static constexpr bool low_pins = Pin < 32 && CoilMasks<Rest...>::low_pins;
+  static constexpr uint32_t set(uint8_t state) {
+    return (((state >> sizeof...(Rest)) & 1) ? (1UL << Pin) : 0) | CoilMasks<Rest...>::set(state);
+  }
+  static constexpr uint32_t clear(uint8_t state) {
+    return (((state >> sizeof...(Rest)) & 1) ? 0 : (1UL << Pin)) | CoilMasks<Rest...>::clear(state);
+  }
+};
+
+// Compile time list 0, 1, ..., N - 1 for expanding tables.
+template <int... I> struct IndexList {};
+template <int N, int... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <int... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+// Table of CoilPatterns for every state of Sequence, built by the compiler.
+template <class Sequence, class Masks, class Indices> struct CoilTable;
+
+template <class Sequence, class Masks, int... I>
+struct CoilTable<Sequence, Masks, IndexList<I...> > {
+  static const CoilPattern patterns[sizeof...(I)];
+};
+
+// The step ISR reads these while flash may be busy, so they live in DRAM.
+template <class Sequence, class Masks, int... I>
+DRAM_ATTR const CoilPattern CoilTable<Sequence, Masks, IndexList<I...> >::patterns[sizeof...(I)] = {
+  { Masks::set(Sequence::state(I)), Masks::clear(Sequence::state(I)), 0, 0 }...
+};
+
+// Wraps a phase that has moved one step past either end of a sequence.
+template <int Length>
+static inline int IRAM_ATTR wrapPhase(int phase)
+{
+  return ((Length & (Length - 1)) == 0)
+      ? (phase & (Length - 1))          // power of two: mask, no compare
+      : (phase < 0 ? phase + Length : (phase == Length ? 0 : phase));
+}
+
+#endif
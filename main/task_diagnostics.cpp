@@ -0,0 +1,130 @@
+/*
+ * TaskDiagnostics.cpp - per task CPU share and stack headroom.
+ */
+
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "task_diagnostics.h"
+
+#if !CONFIG_FREERTOS_USE_TRACE_FACILITY || !CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#error "TaskDiagnostics needs the FreeRTOS trace facility and run time stats"
+#endif
+
+static const char* LOG_TAG = "TaskDiagnostics";
+
+TaskDiagnostics::TaskDiagnostics()
+{
+	this->report_count = 0;
+	this->total_run_time = 0;
+	this->period_run_time = 0;
+	this->lock = xSemaphoreCreateMutexStatic(&this->lock_memory);
+}
+
+bool TaskDiagnostics::start(UBaseType_t priority, BaseType_t core)
+{
+	if (this->sampler.task() != NULL) {
+		return true;
+	}
+	return this->sampler.start(&TaskDiagnostics::task, "diagnostics", this, priority, core);
+}
+
+void TaskDiagnostics::task(void *arg)
+{
+	((TaskDiagnostics *) arg)->run();
+}
+
+void TaskDiagnostics::run(void)
+{
+	while (1) {
+		this->sample();
+		this->check();
+		vTaskDelay(DIAG_PERIOD_MS / portTICK_PERIOD_MS);
+	}
+}
+
+/*
+ * Snapshots every task and works out its share of the time since the
+ * previous snapshot.  Tasks created since then get their share of the
+ * whole time they have existed, as near as the counters allow.
+ */
+void TaskDiagnostics::sample(void)
+{
+	uint32_t total;
+	UBaseType_t count = uxTaskGetSystemState(this->status, DIAG_MAX_TASKS, &total);
+	if (count == 0) {
+		ESP_LOGW(LOG_TAG, "More than %d tasks, not sampled", DIAG_MAX_TASKS);
+		return;
+	}
+
+	xSemaphoreTake(this->lock, portMAX_DELAY);
+	uint32_t period = total - this->total_run_time;
+	TaskReport previous[DIAG_MAX_TASKS];
+	int previous_count = this->report_count;
+	memcpy(previous, this->reports, sizeof(TaskReport) * previous_count);
+
+	for (UBaseType_t i = 0; i < count; i++) {
+		const TaskStatus_t *task = &this->status[i];
+		TaskReport *report = &this->reports[i];
+		strncpy(report->name, task->pcTaskName, sizeof(report->name) - 1);
+		report->name[sizeof(report->name) - 1] = '\0';
+		report->number = task->xTaskNumber;
+		report->priority = task->uxCurrentPriority;
+		report->state = task->eCurrentState;
+		report->stack_free = task->usStackHighWaterMark;
+		report->run_time = task->ulRunTimeCounter;
+
+		uint32_t ran = task->ulRunTimeCounter;
+		for (int p = 0; p < previous_count; p++) {
+			if (previous[p].number == task->xTaskNumber) {
+				ran = task->ulRunTimeCounter - previous[p].run_time;
+				break;
+			}
+		}
+		report->cpu_permille = period > 0 ? (uint32_t) ((uint64_t) ran * 1000 / period) : 0;
+	}
+	this->report_count = count;
+	this->total_run_time = total;
+	this->period_run_time = period;
+	xSemaphoreGive(this->lock);
+}
+
+/*
+ * Warns about tasks short of stack and cores without idle time.
+ */
+void TaskDiagnostics::check(void)
+{
+	xSemaphoreTake(this->lock, portMAX_DELAY);
+	for (int i = 0; i < this->report_count; i++) {
+		const TaskReport *report = &this->reports[i];
+		if (report->stack_free < DIAG_STACK_WARN_BYTES) {
+			ESP_LOGW(LOG_TAG, "Task %s has only %u bytes of stack left", report->name,
+					report->stack_free);
+		}
+		if (strncmp(report->name, "IDLE", 4) == 0
+				&& report->cpu_permille < DIAG_IDLE_WARN_PERCENT * 10) {
+			ESP_LOGW(LOG_TAG, "%s ran %u.%u%% of the time, core is saturated", report->name,
+					report->cpu_permille / 10, report->cpu_permille % 10);
+		}
+	}
+	xSemaphoreGive(this->lock);
+}
+
+void TaskDiagnostics::print(void)
+{
+	static const char state_names[] = "RrBSD";
+	xSemaphoreTake(this->lock, portMAX_DELAY);
+	printf("%-16s %4s %5s %7s %10s\n", "task", "prio", "state", "cpu", "stack free");
+	for (int i = 0; i < this->report_count; i++) {
+		const TaskReport *report = &this->reports[i];
+		printf("%-16s %4u %5c %5u.%u%% %10u\n", report->name, report->priority,
+				state_names[report->state < 5 ? report->state : 4],
+				report->cpu_permille / 10, report->cpu_permille % 10, report->stack_free);
+	}
+	printf("over the last %u ms\n", DIAG_PERIOD_MS);
+	xSemaphoreGive(this->lock);
+}
@@ -0,0 +1,72 @@
+/*
+ * TaskDiagnostics.h - per task CPU share and stack headroom.
+ *
+ * A low priority task takes a uxTaskGetSystemState() snapshot every
+ * DIAG_PERIOD_MS and keeps, for every task, its CPU share over the last
+ * period (from the FreeRTOS run time counters) and the least stack it has
+ * ever had left.  It warns when a task gets close to overflowing its stack
+ * and when a core's idle task gets almost no time, which is the first sign
+ * of a task starving everything below it.  print() shows the last report,
+ * e.g. from the "tasks" console command.
+ *
+ * Needs the FreeRTOS trace facility and run time stats enabled in
+ * menuconfig.  CPU shares are in % of one core, so they add up to 200 %
+ * on the dual core ESP32.
+ */
+
+// ensure this library description is only included once
+#ifndef TaskDiagnostics_h
+#define TaskDiagnostics_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "static_task.h"
+
+#define DIAG_MAX_TASKS 24
+#define DIAG_PERIOD_MS 5000
+#define DIAG_STACK_WARN_BYTES 256     // warn with less stack than this left
+#define DIAG_IDLE_WARN_PERCENT 5      // warn with less idle time than this on a core
+#define DIAG_TASK_STACK_SIZE 2560
+
+struct TaskReport {
+  char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+  UBaseType_t number;         // FreeRTOS task number, to match up samples
+  UBaseType_t priority;
+  eTaskState state;
+  uint32_t stack_free;        // least stack left so far, in bytes
+  uint32_t cpu_permille;      // of one core over the last period
+  uint32_t run_time;          // run time counter at the last sample
+};
+
+class TaskDiagnostics {
+  public:
+    TaskDiagnostics();
+
+    // Starts sampling on the given core.  Returns false if the task could
+    // not be created.
+    bool start(UBaseType_t priority, BaseType_t core);
+
+    // Takes a sample now; also what the task does every period.
+    void sample(void);
+    // Prints the last sample as a table.
+    void print(void);
+
+  private:
+    static void task(void *arg);
+    void run(void);
+    void check(void);
+
+    TaskStatus_t status[DIAG_MAX_TASKS];  // scratch for uxTaskGetSystemState()
+    TaskReport reports[DIAG_MAX_TASKS];
+    int report_count;
+    uint32_t total_run_time;              // at the last sample
+    uint32_t period_run_time;             // between the last two samples
+    SemaphoreHandle_t lock;               // guards the reports
+    StaticSemaphore_t lock_memory;
+    StaticTask<DIAG_TASK_STACK_SIZE> sampler;
+};
+
+#endif
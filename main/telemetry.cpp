@@ -0,0 +1,10 @@
+/*
+ * Telemetry.cpp - lock-free state sharing between ISRs and tasks.
+ */
+
+#include "telemetry.h"
+
+MotionTelemetrySnapshot motion_telemetry;
+HeaterTelemetrySnapshot heater_telemetry;
+FlowTelemetrySnapshot flow_telemetry;
+HeaterSampleRing heater_samples;
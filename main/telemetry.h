@@ -0,0 +1,149 @@
+/*
+ * Telemetry.h - lock-free state sharing between ISRs and tasks.
+ *
+ * TelemetrySnapshot<T> holds the latest value of a struct behind a seqlock:
+ * one writer (an ISR or a task) bumps the sequence to odd, copies the value
+ * and bumps it back to even; readers copy the value and retry if the
+ * sequence was odd or changed meanwhile.  The writer never waits, so the
+ * step ISR can publish on every step, and readers never block it.
+ *
+ * TelemetryRing<T, N> is a single producer / single consumer FIFO for
+ * samples that must not be lost between reads.  head is only written by
+ * the producer and tail only by the consumer.
+ *
+ * Neither takes a FreeRTOS mutex or a spinlock.  The writer of a snapshot
+ * and the producer of a ring must each be a single task or ISR.
+ */
+
+// ensure this library description is only included once
+#ifndef Telemetry_h
+#define Telemetry_h
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "motion_queue.h"
+
+// Orders memory accesses between the cores: memw drains the write buffer
+// and stops the compiler reordering around it.
+#ifdef __XTENSA__
+#define TELEMETRY_BARRIER() __asm__ __volatile__ ("memw" ::: "memory")
+#else
+#define TELEMETRY_BARRIER() __sync_synchronize()
+#endif
+
+template <class T>
+class TelemetrySnapshot {
+  public:
+    TelemetrySnapshot() : sequence(0), value() {}
+
+    // Publishes a new value.  Only one task or ISR may write.
+    inline void IRAM_ATTR write(const T &update) {
+      this->sequence = this->sequence + 1;
+      TELEMETRY_BARRIER();
+      this->value = update;
+      TELEMETRY_BARRIER();
+      this->sequence = this->sequence + 1;
+    }
+
+    // Copies out a consistent value, retrying while a write is in progress.
+    T read(void) const {
+      T copy;
+      uint32_t before, after;
+      do {
+        before = this->sequence;
+        TELEMETRY_BARRIER();
+        copy = this->value;
+        TELEMETRY_BARRIER();
+        after = this->sequence;
+      } while ((before & 1) || before != after);
+      return copy;
+    }
+
+  private:
+    volatile uint32_t sequence;   // odd while a write is in progress
+    T value;
+};
+
+template <class T, int N>
+class TelemetryRing {
+  public:
+    TelemetryRing() : head(0), tail(0) {}
+
+    // producer side; returns false, dropping the item, if the ring is full
+    inline bool IRAM_ATTR push(const T &item) {
+      uint32_t position = this->head;
+      if (position - this->tail == N) {
+        return false;
+      }
+      this->items[position % N] = item;
+      TELEMETRY_BARRIER();
+      this->head = position + 1;
+      return true;
+    }
+
+    // consumer side; returns false if the ring is empty
+    bool pop(T *item) {
+      uint32_t position = this->tail;
+      if (position == this->head) {
+        return false;
+      }
+      TELEMETRY_BARRIER();
+      *item = this->items[position % N];
+      TELEMETRY_BARRIER();
+      this->tail = position + 1;
+      return true;
+    }
+
+    uint32_t size(void) const { return this->head - this->tail; }
+
+  private:
+    T items[N];
+    volatile uint32_t head;   // next position to push, free running
+    volatile uint32_t tail;   // next position to pop, free running
+};
+
+// What the motion side publishes, from the step ISR.
+struct MotionTelemetry {
+  int32_t steps_left;         // steps remaining in the current move
+  uint32_t step_interval_us;  // interval before the next step, 0 when idle
+  int64_t last_step_time;     // hrclock time of the last step
+  int32_t position[MOTION_MAX_AXES]; // axis positions after it, in steps
+};
+
+// What the heater control loop publishes every period.
+struct HeaterTelemetry {
+  int32_t temperature;        // kettle temperature in 1/16 C
+  int32_t setpoint;           // target in 1/16 C
+  uint32_t duty;              // SSR duty, 0..HEATER_PWM_MAX_DUTY
+  bool sensor_ok;             // false once readings have been missed
+};
+
+// What the flow controller publishes for every load cell sample.
+struct FlowTelemetry {
+  int32_t weight;             // on the scale, in mg
+  int32_t flow;               // into the cup, in mg/s
+  int32_t target;             // mg/s, 0 when pouring open loop
+  uint32_t rate_scale;        // applied to the spout, MOTION_RATE_FULL for none
+  bool sensor_ok;             // false while the load cell is not answering
+};
+
+// The ring indexes with free running counters, which only stay in step
+// across their wrap for power of two lengths.
+#define HEATER_SAMPLE_RING_LENGTH CONFIG_POUR_BOT_HEATER_SAMPLES   // set in menuconfig
+#if (HEATER_SAMPLE_RING_LENGTH & (HEATER_SAMPLE_RING_LENGTH - 1)) != 0
+#error "CONFIG_POUR_BOT_HEATER_SAMPLES must be a power of two"
+#endif
+
+typedef TelemetrySnapshot<MotionTelemetry> MotionTelemetrySnapshot;
+typedef TelemetrySnapshot<HeaterTelemetry> HeaterTelemetrySnapshot;
+typedef TelemetrySnapshot<FlowTelemetry> FlowTelemetrySnapshot;
+typedef TelemetryRing<HeaterTelemetry, HEATER_SAMPLE_RING_LENGTH> HeaterSampleRing;
+
+// Shared instances for the firmware's tasks.
+extern MotionTelemetrySnapshot motion_telemetry;
+extern HeaterTelemetrySnapshot heater_telemetry;
+extern FlowTelemetrySnapshot flow_telemetry;
+extern HeaterSampleRing heater_samples;
+
+#endif
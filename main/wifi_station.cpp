@@ -0,0 +1,88 @@
+/*
+ * WifiStation.cpp - keeps the unit joined to a Wi-Fi network.
+ */
+
+#include <esp_log.h>
+#include <string.h>
+#include "esp_wifi.h"
+#include "esp_event_loop.h"
+#include "nvs_flash.h"
+#include "tcpip_adapter.h"
+#include "wifi_station.h"
+
+static const char* LOG_TAG = "WifiStation";
+
+static volatile bool connected = false;
+
+/*
+ * Runs in the event loop task.  Connecting is retried from every
+ * disconnect, so a missing access point is simply waited for.
+ */
+static esp_err_t onEvent(void *ctx, system_event_t *event)
+{
+	switch (event->event_id) {
+		case SYSTEM_EVENT_STA_START:
+			esp_wifi_connect();
+			break;
+		case SYSTEM_EVENT_STA_GOT_IP:
+			connected = true;
+			ESP_LOGI(LOG_TAG, "Connected as %s",
+					ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
+			break;
+		case SYSTEM_EVENT_STA_DISCONNECTED:
+			if (connected) {
+				ESP_LOGW(LOG_TAG, "Disconnected: %d", event->event_info.disconnected.reason);
+			}
+			connected = false;
+			esp_wifi_connect();
+			break;
+		default:
+			break;
+	}
+	return ESP_OK;
+}
+
+bool wifi_station_start(const char *ssid, const char *password)
+{
+	// the driver keeps its calibration data in NVS
+	esp_err_t err = nvs_flash_init();
+	if (err == ESP_ERR_NVS_NO_FREE_PAGES) {
+		nvs_flash_erase();
+		err = nvs_flash_init();
+	}
+	if (err != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to initialise NVS: %d", err);
+		return false;
+	}
+
+	tcpip_adapter_init();
+	if (esp_event_loop_init(&onEvent, NULL) != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to start the event loop");
+		return false;
+	}
+	wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+	if (esp_wifi_init(&init) != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to initialise Wi-Fi");
+		return false;
+	}
+	esp_wifi_set_storage(WIFI_STORAGE_RAM);
+	esp_wifi_set_mode(WIFI_MODE_STA);
+
+	wifi_config_t config;
+	memset(&config, 0, sizeof(config));
+	strncpy((char *) config.sta.ssid, ssid, sizeof(config.sta.ssid));
+	strncpy((char *) config.sta.password, password, sizeof(config.sta.password));
+	esp_wifi_set_config(ESP_IF_WIFI_STA, &config);
+
+	if (esp_wifi_start() != ESP_OK) {
+		ESP_LOGE(LOG_TAG, "Failed to start Wi-Fi");
+		return false;
+	}
+	ESP_LOGI(LOG_TAG, "Joining %s", ssid);
+	return true;
+}
+
+bool wifi_station_connected(void)
+{
+	return connected;
+}
@@ -0,0 +1,22 @@
+/*
+ * WifiStation.h - keeps the unit joined to a Wi-Fi network.
+ *
+ * wifi_station_start() brings up the Wi-Fi driver as a station and returns
+ * at once; the IDF event loop then connects, and reconnects whenever the
+ * access point goes away.  The credentials live in RAM only.  The Wi-Fi
+ * tasks run on the PRO CPU, away from the motion task.
+ *
+ * While Wi-Fi is running the chip cannot light-sleep (see idle_sleep.h).
+ */
+
+// ensure this library description is only included once
+#ifndef WifiStation_h
+#define WifiStation_h
+
+// Starts joining ssid; returns false if the driver could not start.
+bool wifi_station_start(const char *ssid, const char *password);
+
+// Whether the station currently has an IP address.
+bool wifi_station_connected(void);
+
+#endif